@@ -3,15 +3,27 @@
  * @brief Functions for the CS:APP3e book
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MADV_HUGEPAGE, splice() */
+#endif              // __linux__
+
 #include "csapp.h"
 
 #ifdef CSAPP_HAS_DTOA
 #include "csapp_dtoa.h"
 #endif // CSAPP_HAS_DTOA
 
+#include "csapp_private.h"
+#include "csapp_stats.h" /* No-op unless CSAPP_HAS_STATS */
+
+#include <arpa/inet.h>  /* ntohs() */
 #include <errno.h>      /* errno */
+#include <fcntl.h>      /* splice() */
 #include <limits.h>     /* SSIZE_MAX */
+#include <math.h>       /* isfinite() */
 #include <netdb.h>      /* freeaddrinfo() */
+#include <netinet/in.h> /* struct sockaddr_in6 */
+#include <pthread.h>    /* pthread_create() */
 #include <semaphore.h>  /* sem_t */
 #include <signal.h>     /* struct sigaction */
 #include <stdarg.h>     /* va_list */
@@ -21,10 +33,21 @@
 #include <stdio.h>      /* stderr */
 #include <stdlib.h>     /* abort() */
 #include <string.h>     /* memset() */
+#include <sys/mman.h>   /* mmap() */
+#ifdef __linux__
+#include <sys/sendfile.h> /* sendfile() */
+#endif                    // __linux__
 #include <sys/socket.h> /* struct sockaddr */
+#include <sys/stat.h>   /* fstat() */
+#include <sys/uio.h>    /* writev() */
 #include <sys/types.h>  /* struct sockaddr */
+#include <time.h>       /* clock_gettime() */
 #include <unistd.h>     /* STDIN_FILENO */
 
+#ifdef __SSE2__
+#include <emmintrin.h> /* _mm_cmpeq_epi8() */
+#endif // __SSE2__
+
 /************************************
  * Wrappers for Unix signal functions
  ***********************************/
@@ -108,6 +131,58 @@ static size_t uintmax_to_string(uintmax_t v, char s[], unsigned char b) {
     return len;
 }
 
+/* intmax_magnitude - Absolute value of v, well defined even for INTMAX_MIN */
+static uintmax_t intmax_magnitude(intmax_t v) {
+    uintmax_t magnitude = (uintmax_t)v;
+    return v < 0 ? -magnitude : magnitude;
+}
+
+/* uintmax_digit_count - Number of base b digits of v, without converting it */
+static size_t uintmax_digit_count(uintmax_t v, unsigned char b) {
+    static const uint64_t pow10[20] = {
+        1ULL,
+        10ULL,
+        100ULL,
+        1000ULL,
+        10000ULL,
+        100000ULL,
+        1000000ULL,
+        10000000ULL,
+        100000000ULL,
+        1000000000ULL,
+        10000000000ULL,
+        100000000000ULL,
+        1000000000000ULL,
+        10000000000000ULL,
+        100000000000000ULL,
+        1000000000000000ULL,
+        10000000000000000ULL,
+        100000000000000000ULL,
+        1000000000000000000ULL,
+        10000000000000000000ULL,
+    };
+    if (sizeof(uintmax_t) != sizeof(unsigned long long) ||
+        (b != 8 && b != 10 && b != 16)) {
+        size_t len = 1;
+        while ((v /= b) > 0) {
+            len++;
+        }
+        return len;
+    }
+    // 0 has one digit, like 1
+    size_t bits =
+        64 - (size_t)__builtin_clzll((unsigned long long)(v | 1));
+    if (b == 16) {
+        return (bits + 3) / 4;
+    }
+    if (b == 8) {
+        return (bits + 2) / 3;
+    }
+    // 1233 / 4096 approximates log10(2) from below
+    size_t t = bits * 1233 >> 12;
+    return t + 1 - ((v | 1) < pow10[t]);
+}
+
 /* Public Sio functions */
 
 /**
@@ -188,6 +263,14 @@ struct _format_data {
  * The only supported format specifiers are the following:
  *  -  Int types: %d, %i, %u, %x, %o (with size specifiers l, z)
  *  -  Others: %c, %s, %%, %p
+ *  -  Extensions: %pJ (string escaped for JSON, without the quotes),
+ *     %pT (UTC ISO-8601 time of a struct timespec *, or now if NULL),
+ *     %pI and %pN (address, and address with port, of a struct sockaddr *),
+ *     and user conversions, see sio_register_conversion
+ *
+ * Extensions take a width and a precision given with *. printf has no
+ * precision for %p, so compilers checking formats warn about %.*pJ; callers
+ * silence that around the call with #pragma GCC diagnostic ignored "-Wformat".
  */
 ssize_t sio_vdprintf(int fileno, const char *fmt, va_list argp) {
     sio_write_output_t state;
@@ -213,18 +296,77 @@ ssize_t sio_vsnprintf(char *str, size_t size, const char *fmt, va_list argp) {
         state.buffer = NULL;
         state.remaining = 0;
     }
-    ret = sio_vformat(sio_buffer_output, &state, fmt, argp);
+    sio_sink_t sink = {sio_buffer_reserve, sio_buffer_commit, sio_buffer_output,
+                       &state};
+    ret = sio_vformat_sink(&sink, fmt, argp);
     if (ret >= 0 && state.buffer != NULL) {
         *(state.buffer) = '\0';
     }
     return ret;
 }
 
+/**
+ * @brief   Formats output to a buffer, stopping as soon as it is full.
+ * @param str    The buffer to write to.
+ * @param size   The size of the buffer, including the terminating null byte.
+ * @param fmt    The format string used to determine the output.
+ * @param ...    The arguments for the format string.
+ * @return       The number of bytes written, excluding the null byte, size if
+ *               the output was truncated, or -1 on error.
+ *
+ * @remark   This function is async-signal-safe.
+ * @see      sio_vsnprintf_trunc
+ */
+ssize_t sio_snprintf_trunc(char *str, size_t size, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vsnprintf_trunc(str, size, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/**
+ * @brief   Formats output to a buffer from a va_list, stopping as soon as it
+ *          is full.
+ *
+ * Unlike sio_vsnprintf, which formats everything to compute the length the
+ * output would have had, this stops at the first conversion or block of text
+ * that does not fit, after storing the part of it that does. The cost of a
+ * truncated call is thus proportional to what is kept. As with snprintf, a
+ * return value greater than or equal to size means the output was truncated,
+ * but it is not the full length: it is always size in that case.
+ *
+ * The buffer is always null terminated when size is not 0.
+ */
+ssize_t sio_vsnprintf_trunc(char *str, size_t size, const char *fmt,
+                            va_list argp) {
+    sio_buffer_trunc_output_t state;
+    ssize_t ret;
+    if (size > 0) {
+        state.buffer.buffer = str;
+        state.buffer.remaining = size - 1;
+    } else { // No Output
+        state.buffer.buffer = NULL;
+        state.buffer.remaining = 0;
+    }
+    sio_sink_t sink = {sio_buffer_reserve, sio_buffer_commit,
+                       sio_buffer_trunc_output, &state};
+    ret = sio_vformat_sink(&sink, fmt, argp);
+    if (state.buffer.buffer != NULL) {
+        *(state.buffer.buffer) = '\0';
+    }
+    if (ret == SIO_OUTPUT_FULL) {
+        return (ssize_t)size;
+    }
+    return ret;
+}
+
 #define PADDING_BUF_LEN 128
 
 ssize_t sio_write_output(void *state, char padding, size_t count_left, size_t count_right,
                          const char *data, size_t len) {
     int fileno = ((sio_write_output_t *)state)->fileno;
+    CSAPP_STAT_ADD(CSAPP_STAT_SIO_SINK_CALLS, 1);
 
     if (count_left > (size_t)SSIZE_MAX || len > (size_t) SSIZE_MAX || count_left + len > (size_t) SSIZE_MAX || count_right > (size_t) SSIZE_MAX || count_left + len + count_right > (size_t) SSIZE_MAX) {
         return -1;
@@ -238,6 +380,7 @@ ssize_t sio_write_output(void *state, char padding, size_t count_left, size_t co
         if (padding_left_len > PADDING_BUF_LEN) {
             padding_left_len = PADDING_BUF_LEN;
         }
+        CSAPP_STAT_ADD(CSAPP_STAT_SIO_WRITES, 1);
         ssize_t ret = rio_writen(fileno, (const void *)buf, padding_left_len);
         if (ret < 0 || (size_t)ret != padding_left_len) {
             return -1;
@@ -246,6 +389,7 @@ ssize_t sio_write_output(void *state, char padding, size_t count_left, size_t co
     }
 
     if (len > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_SIO_WRITES, 1);
         ssize_t ret = rio_writen(fileno, (const void *)data, len);
         if (ret < 0 || (size_t)ret != len) {
             return -1;
@@ -257,19 +401,21 @@ ssize_t sio_write_output(void *state, char padding, size_t count_left, size_t co
         if (padding_right_len > PADDING_BUF_LEN) {
             padding_right_len = PADDING_BUF_LEN;
         }
+        CSAPP_STAT_ADD(CSAPP_STAT_SIO_WRITES, 1);
         ssize_t ret = rio_writen(fileno, (const void *)buf, padding_right_len);
         if (ret < 0 || (size_t)ret != padding_right_len) {
             return -1;
         }
         num_written += ret;
     }
+    CSAPP_STAT_ADD(CSAPP_STAT_SIO_BYTES, num_written);
     return num_written;
 }
 
 ssize_t sio_buffer_output(void *state, char padding, size_t count_left, size_t count_right,
                           const char *data, size_t len) {
 
-    size_t i = 0;
+    size_t n;
     size_t total_len = count_left + len + count_right; // TODO check all those null bytes
     if (total_len > SSIZE_MAX) { // This check is in general insufficient,
                                  // but in our use case,
@@ -277,29 +423,664 @@ ssize_t sio_buffer_output(void *state, char padding, size_t count_left, size_t c
         return -1;
     }
     sio_buffer_output_t *buffer_state = state;
+    CSAPP_STAT_ADD(CSAPP_STAT_SIO_SINK_CALLS, 1);
 
     if (buffer_state->buffer != NULL) {
-        for (i = 0; i < count_left && buffer_state->remaining > 0; i++) {
-            *(buffer_state->buffer) = padding;
-            buffer_state->buffer++;
-            buffer_state->remaining--;
-        }
-        for (i = 0; i < len && buffer_state->remaining > 0; i++) {
-            *(buffer_state->buffer) = *data;
-            buffer_state->buffer++;
-            data++;
-            buffer_state->remaining--;
-        }
-        for (i = 0; i < count_right && buffer_state->remaining > 0; i++) {
-            *(buffer_state->buffer) = padding;
-            buffer_state->buffer++;
-            buffer_state->remaining--;
+        n = count_left < buffer_state->remaining ? count_left
+                                                 : buffer_state->remaining;
+        memset(buffer_state->buffer, padding, n);
+        buffer_state->buffer += n;
+        buffer_state->remaining -= n;
+        n = len < buffer_state->remaining ? len : buffer_state->remaining;
+        if (n > 0) {
+            memcpy(buffer_state->buffer, data, n);
         }
+        buffer_state->buffer += n;
+        buffer_state->remaining -= n;
+        n = count_right < buffer_state->remaining ? count_right
+                                                  : buffer_state->remaining;
+        memset(buffer_state->buffer, padding, n);
+        buffer_state->buffer += n;
+        buffer_state->remaining -= n;
         *(buffer_state->buffer) = '\0';
     }
     return (ssize_t)total_len;
 }
 
+/**
+ * @brief   Output function of a buffer that stops the formatting once full.
+ * @param state   A sio_buffer_trunc_output_t.
+ * @return        The number of bytes output, or SIO_OUTPUT_FULL after storing
+ *                the part that fits, or -1 on error.
+ */
+ssize_t sio_buffer_trunc_output(void *state, char padding, size_t count_left,
+                                size_t count_right, const char *data,
+                                size_t len) {
+    sio_buffer_trunc_output_t *trunc_state = state;
+    size_t remaining = trunc_state->buffer.remaining;
+    ssize_t ret = sio_buffer_output(&trunc_state->buffer, padding, count_left,
+                                    count_right, data, len);
+    if (ret > 0 && (size_t)ret > remaining) {
+        return SIO_OUTPUT_FULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief   Reserve function of the buffer sink.
+ * @param state   A sio_buffer_output_t or sio_buffer_trunc_output_t.
+ * @param len     The number of bytes to reserve.
+ * @return        Where to write the len bytes, or NULL if they do not fit, so
+ *                that sio_buffer_output counts or truncates them instead.
+ */
+char *sio_buffer_reserve(void *state, size_t len) {
+    sio_buffer_output_t *buffer_state = state;
+    if (buffer_state->buffer == NULL || len > buffer_state->remaining) {
+        return NULL;
+    }
+    return buffer_state->buffer;
+}
+
+/**
+ * @brief   Commit function of the buffer sink.
+ * @param state   A sio_buffer_output_t or sio_buffer_trunc_output_t.
+ * @param len     The number of bytes written to the last reservation.
+ * @return        len.
+ */
+ssize_t sio_buffer_commit(void *state, size_t len) {
+    sio_buffer_output_t *buffer_state = state;
+    CSAPP_STAT_ADD(CSAPP_STAT_SIO_SINK_CALLS, 1);
+    buffer_state->buffer += len;
+    buffer_state->remaining -= len;
+    *(buffer_state->buffer) = '\0';
+    return (ssize_t)len;
+}
+
+/*
+ * JSON string escaping
+ *
+ * Strings are streamed to the output function as runs of bytes that need no
+ * escaping, separated by short escape sequences, so that no intermediate
+ * buffer is needed. Finding the next byte to escape is the hot loop: it uses
+ * SSE2 when available, and a word-at-a-time scan otherwise.
+ */
+
+/* json_needs_escape - Check whether c must be escaped in a JSON string */
+static bool json_needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+/* json_scan - Return the index of the first byte to escape in s, or len */
+static size_t json_scan(const char *s, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                 _mm_cmpeq_epi8(v, backslash));
+        /* v <= 0x1f (unsigned) iff max(v, 0x1f) == 0x1f */
+        m = _mm_or_si128(m,
+                         _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w, q, b;
+        memcpy(&w, s + i, sizeof(w));
+        q = w ^ (ones * '"');
+        b = w ^ (ones * '\\');
+        /* Classic "has zero byte" and "has byte less than n" tests */
+        if ((((q - ones) & ~q) | ((b - ones) & ~b) |
+             ((w - ones * 0x20) & ~w)) &
+            highs) {
+            break; /* Locate it exactly below */
+        }
+    }
+#endif // __SSE2__
+    for (; i < len; i++) {
+        if (json_needs_escape((unsigned char)s[i])) {
+            return i;
+        }
+    }
+    return len;
+}
+
+/* json_escape_char - Write the escape sequence of c to esc, return its length
+ */
+static size_t json_escape_char(unsigned char c, char esc[6]) {
+    static const char hex[] = "0123456789abcdef";
+    esc[0] = '\\';
+    switch (c) {
+    case '"':
+        esc[1] = '"';
+        return 2;
+    case '\\':
+        esc[1] = '\\';
+        return 2;
+    case '\b':
+        esc[1] = 'b';
+        return 2;
+    case '\f':
+        esc[1] = 'f';
+        return 2;
+    case '\n':
+        esc[1] = 'n';
+        return 2;
+    case '\r':
+        esc[1] = 'r';
+        return 2;
+    case '\t':
+        esc[1] = 't';
+        return 2;
+    default:
+        esc[1] = 'u';
+        esc[2] = '0';
+        esc[3] = '0';
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 0xf];
+        return 6;
+    }
+}
+
+/* json_escaped_length - Length of s once escaped, only needed for padding */
+static size_t json_escaped_length(const char *s, size_t len) {
+    size_t total = 0;
+    char esc[6];
+    while (len > 0) {
+        size_t run = json_scan(s, len);
+        total += run;
+        s += run;
+        len -= run;
+        if (len > 0) {
+            total += json_escape_char((unsigned char)*s, esc);
+            s++;
+            len--;
+        }
+    }
+    return total;
+}
+
+/* sio_output_json - Stream the JSON escaped form of s (without the quotes) */
+static ssize_t sio_output_json(sio_output_function output, void *output_state,
+                               const char *s, size_t len) {
+    ssize_t total = 0;
+    char esc[6];
+    while (len > 0) {
+        size_t run = json_scan(s, len);
+        if (run > 0) {
+            ssize_t r = output(output_state, ' ', 0, 0, s, run);
+            if (r < 0) {
+                return r;
+            }
+            total += r;
+            s += run;
+            len -= run;
+        }
+        if (len > 0) {
+            size_t esc_len = json_escape_char((unsigned char)*s, esc);
+            ssize_t r = output(output_state, ' ', 0, 0, esc, esc_len);
+            if (r < 0) {
+                return r;
+            }
+            total += r;
+            s++;
+            len--;
+        }
+    }
+    return total;
+}
+
+/* sio_format_json_string - Implementation of %pJ, with padding and precision
+ */
+static ssize_t sio_format_json_string(sio_output_function output,
+                                      void *output_state, const void *arg,
+                                      int padding, int precision) {
+    const char *str = arg;
+    if (str == NULL) {
+        str = "(null)";
+    }
+    size_t len =
+        precision >= 0 ? strnlen(str, (size_t)precision) : strlen(str);
+    if (padding == 0) {
+        return sio_output_json(output, output_state, str, len);
+    }
+
+    // Padding requires the escaped length up front
+    size_t escaped_len = json_escaped_length(str, len);
+    size_t left_padding_count = 0;
+    size_t right_padding_count = 0;
+    if (padding > 0 && (size_t)padding > escaped_len) {
+        left_padding_count = (size_t)padding - escaped_len;
+    }
+    if (padding < 0 && (size_t)(-padding) > escaped_len) {
+        right_padding_count = (size_t)(-padding) - escaped_len;
+    }
+    ssize_t res = output(output_state, ' ', left_padding_count, 0, NULL, 0);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r = sio_output_json(output, output_state, str, len);
+    if (r < 0) {
+        return r;
+    }
+    res += r;
+    r = output(output_state, ' ', right_padding_count, 0, NULL, 0);
+    if (r < 0) {
+        return r;
+    }
+    return res + r;
+}
+
+/*
+ * ISO-8601 timestamps
+ *
+ * localtime_r is not async-signal-safe, so timestamps are rendered in UTC from
+ * the seconds since the epoch, using Howard Hinnant's civil_from_days. The
+ * "YYYY-MM-DDTHH:MM:SS" part only changes once per second, and log lines come
+ * in bursts, so each thread caches it along with the second it stands for:
+ * most calls only render the fractional digits.
+ *
+ * A signal handler may interrupt the thread while it uses its cache. The busy
+ * flag makes the handler render its timestamp from scratch instead of reading
+ * or clobbering a half-written cache.
+ */
+#define SIO_TIME_PREFIX_LEN 19 /* strlen("YYYY-MM-DDTHH:MM:SS") */
+#define SIO_TIME_DEFAULT_PRECISION 6
+
+struct sio_time_cache {
+    volatile sig_atomic_t busy;
+    bool valid;
+    time_t second;
+    char prefix[SIO_TIME_PREFIX_LEN];
+};
+
+static __thread struct sio_time_cache sio_time_cache;
+
+/* Two decimal digits for each value from 0 to 99 */
+static const char sio_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+/* write_2digits - Write v (less than 100) as two decimal digits */
+static void write_2digits(char *s, unsigned int v) {
+    memcpy(s, &sio_digit_pairs[2 * v], 2);
+}
+
+/* sio_time_prefix - Render "YYYY-MM-DDTHH:MM:SS" for the given second */
+static void sio_time_prefix(time_t t, char prefix[SIO_TIME_PREFIX_LEN]) {
+    int64_t secs = (int64_t)t;
+    int64_t days = secs / 86400;
+    int64_t rem = secs % 86400;
+    if (rem < 0) {
+        rem += 86400;
+        days--;
+    }
+
+    // civil_from_days, with eras of 400 years starting on March 1st
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    unsigned int day = (unsigned int)(doy - (153 * mp + 2) / 5 + 1);
+    unsigned int month = (unsigned int)(mp < 10 ? mp + 3 : mp - 9);
+    int64_t year = yoe + era * 400 + (month <= 2);
+
+    // Years outside of 0000-9999 are clamped, ISO-8601 needs a sign for them
+    if (year < 0) {
+        year = 0;
+    } else if (year > 9999) {
+        year = 9999;
+    }
+    write_2digits(&prefix[0], (unsigned int)(year / 100));
+    write_2digits(&prefix[2], (unsigned int)(year % 100));
+    prefix[4] = '-';
+    write_2digits(&prefix[5], month);
+    prefix[7] = '-';
+    write_2digits(&prefix[8], day);
+    prefix[10] = 'T';
+    write_2digits(&prefix[11], (unsigned int)(rem / 3600));
+    prefix[13] = ':';
+    write_2digits(&prefix[14], (unsigned int)(rem / 60 % 60));
+    prefix[16] = ':';
+    write_2digits(&prefix[17], (unsigned int)(rem % 60));
+}
+
+/* sio_format_timestamp - Implementation of %pT
+ *
+ * The argument is a const struct timespec *, or NULL for the current time.
+ * The precision is the number of fractional digits, 6 by default, at most 9.
+ * Nothing is formatted for a tv_nsec outside [0, 999999999].
+ */
+static ssize_t sio_format_timestamp(sio_output_function output,
+                                    void *output_state, const void *arg,
+                                    int padding, int precision) {
+    struct timespec now;
+    const struct timespec *ts = arg;
+    if (ts == NULL) {
+        int rc = -1;
+#ifdef CLOCK_REALTIME_COARSE
+        rc = clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#endif // CLOCK_REALTIME_COARSE
+        if (rc < 0 && clock_gettime(CLOCK_REALTIME, &now) < 0) {
+            return -1;
+        }
+        ts = &now;
+    }
+    if (ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000) {
+        return -1;
+    }
+    if (precision < 0) {
+        precision = SIO_TIME_DEFAULT_PRECISION;
+    } else if (precision > 9) {
+        precision = 9;
+    }
+
+    char line[SIO_TIME_PREFIX_LEN + 12];
+    struct sio_time_cache *cache = &sio_time_cache;
+    if (cache->busy) {
+        // We interrupted our own thread using the cache
+        sio_time_prefix(ts->tv_sec, line);
+    } else {
+        cache->busy = 1;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (!cache->valid || cache->second != ts->tv_sec) {
+            sio_time_prefix(ts->tv_sec, cache->prefix);
+            cache->second = ts->tv_sec;
+            cache->valid = true;
+        }
+        memcpy(line, cache->prefix, SIO_TIME_PREFIX_LEN);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        cache->busy = 0;
+    }
+
+    size_t len = SIO_TIME_PREFIX_LEN;
+    if (precision > 0) {
+        unsigned long frac = (unsigned long)ts->tv_nsec;
+        for (int i = precision; i < 9; i++) {
+            frac /= 10;
+        }
+        line[len++] = '.';
+        for (int i = precision - 1; i >= 0; i--) {
+            line[len + (size_t)i] = (char)('0' + frac % 10);
+            frac /= 10;
+        }
+        len += (size_t)precision;
+    }
+    line[len++] = 'Z';
+
+    size_t left_padding_count = 0;
+    size_t right_padding_count = 0;
+    if (padding > 0 && (size_t)padding > len) {
+        left_padding_count = (size_t)padding - len;
+    }
+    if (padding < 0 && (size_t)(-padding) > len) {
+        right_padding_count = (size_t)(-padding) - len;
+    }
+    return output(output_state, ' ', left_padding_count, right_padding_count,
+                  line, len);
+}
+
+/*
+ * Socket addresses
+ *
+ * %pI renders the address of a struct sockaddr *, %pN the address and its port
+ * as "a.b.c.d:port" or "[v6]:port", for logging peers right after accept. It
+ * replaces getnameinfo(NI_NUMERICHOST), which is neither async-signal-safe nor
+ * cheap. IPv6 addresses follow RFC 5952: lower case hexadecimal, the longest
+ * run of two or more zero groups compressed to "::", and IPv4-mapped addresses
+ * written as ::ffff:a.b.c.d. Unlike glibc's inet_ntop, the deprecated
+ * IPv4-compatible ::a.b.c.d form is not used. Families other than AF_INET and
+ * AF_INET6 render as "(unknown)".
+ */
+#define SIO_SOCKADDR_LEN 64 /* "[" INET6_ADDRSTRLEN "]:65535" fits */
+
+/* write_decimal - Write v (less than 100000) in decimal, return its length */
+static size_t write_decimal(char *s, unsigned int v) {
+    char digits[5];
+    size_t i = sizeof(digits);
+    while (v >= 100) {
+        i -= 2;
+        write_2digits(&digits[i], v % 100);
+        v /= 100;
+    }
+    if (v >= 10) {
+        i -= 2;
+        write_2digits(&digits[i], v);
+    } else {
+        digits[--i] = (char)('0' + v);
+    }
+    memcpy(s, &digits[i], sizeof(digits) - i);
+    return sizeof(digits) - i;
+}
+
+/**
+ * @brief   Writes v in decimal, two digits at a time, without null
+ *          termination.
+ * @param v   The value.
+ * @param s   Where to write, at least 20 bytes.
+ * @return    The number of digits written.
+ */
+size_t sio_uint64_to_decimal(uint64_t v, char *s) {
+    size_t len = uintmax_digit_count(v, 10);
+    size_t i = len;
+    while (v >= 100) {
+        i -= 2;
+        write_2digits(&s[i], (unsigned int)(v % 100));
+        v /= 100;
+    }
+    if (v >= 10) {
+        write_2digits(s, (unsigned int)v);
+    } else {
+        s[0] = (char)('0' + v);
+    }
+    return len;
+}
+
+/* write_hex_group - Write a 16 bit group in hexadecimal, without leading 0 */
+static size_t write_hex_group(char *s, unsigned int v) {
+    size_t len = 0;
+    for (int shift = 12; shift >= 0; shift -= 4) {
+        unsigned int nibble = (v >> shift) & 0xf;
+        if (len > 0 || nibble != 0 || shift == 0) {
+            s[len++] = "0123456789abcdef"[nibble];
+        }
+    }
+    return len;
+}
+
+/* write_in4 - Write the 4 bytes of an IPv4 address in dotted notation */
+static size_t write_in4(char *s, const unsigned char *bytes) {
+    size_t len = 0;
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            s[len++] = '.';
+        }
+        len += write_decimal(&s[len], bytes[i]);
+    }
+    return len;
+}
+
+/* write_in6 - Write an IPv6 address as recommended by RFC 5952 */
+static size_t write_in6(char *s, const struct in6_addr *addr) {
+    const unsigned char *bytes = addr->s6_addr;
+    unsigned int groups[8];
+    for (int i = 0; i < 8; i++) {
+        groups[i] = (unsigned int)bytes[2 * i] << 8 | bytes[2 * i + 1];
+    }
+    bool mapped = groups[0] == 0 && groups[1] == 0 && groups[2] == 0 &&
+                  groups[3] == 0 && groups[4] == 0 && groups[5] == 0xffff;
+    int hex_groups = mapped ? 6 : 8;
+
+    // The longest run of at least two zero groups, the first one on ties
+    int best = -1;
+    int best_len = 1;
+    for (int i = 0; i < hex_groups;) {
+        int run = 0;
+        while (i + run < hex_groups && groups[i + run] == 0) {
+            run++;
+        }
+        if (run > best_len) {
+            best = i;
+            best_len = run;
+        }
+        i += run > 0 ? run : 1;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < hex_groups;) {
+        if (i == best) {
+            s[len++] = ':';
+            s[len++] = ':';
+            i += best_len;
+            continue;
+        }
+        if (i > 0 && i != best + best_len) {
+            s[len++] = ':';
+        }
+        len += write_hex_group(&s[len], groups[i]);
+        i++;
+    }
+    if (mapped) {
+        s[len++] = ':';
+        len += write_in4(&s[len], &bytes[12]);
+    }
+    return len;
+}
+
+/* sio_format_sockaddr - Render a socket address, with its port if asked */
+static ssize_t sio_format_sockaddr(sio_output_function output,
+                                   void *output_state, const void *arg,
+                                   int padding, bool with_port) {
+    const struct sockaddr *sa = arg;
+    char line[SIO_SOCKADDR_LEN];
+    size_t len = 0;
+    unsigned int port = 0;
+    if (sa == NULL) {
+        memcpy(line, "(null)", strlen("(null)"));
+        len = strlen("(null)");
+        with_port = false;
+    } else if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = arg;
+        len = write_in4(line, (const unsigned char *)&sin->sin_addr.s_addr);
+        port = ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = arg;
+        if (with_port) {
+            line[len++] = '[';
+        }
+        len += write_in6(&line[len], &sin6->sin6_addr);
+        if (with_port) {
+            line[len++] = ']';
+        }
+        port = ntohs(sin6->sin6_port);
+    } else {
+        memcpy(line, "(unknown)", strlen("(unknown)"));
+        len = strlen("(unknown)");
+        with_port = false;
+    }
+    if (with_port) {
+        line[len++] = ':';
+        len += write_decimal(&line[len], port);
+    }
+
+    size_t left_padding_count = 0;
+    size_t right_padding_count = 0;
+    if (padding > 0 && (size_t)padding > len) {
+        left_padding_count = (size_t)padding - len;
+    }
+    if (padding < 0 && (size_t)(-padding) > len) {
+        right_padding_count = (size_t)(-padding) - len;
+    }
+    return output(output_state, ' ', left_padding_count, right_padding_count,
+                  line, len);
+}
+
+/* sio_format_address - Implementation of %pI */
+static ssize_t sio_format_address(sio_output_function output,
+                                  void *output_state, const void *arg,
+                                  int padding, int precision) {
+    return sio_format_sockaddr(output, output_state, arg, padding, false);
+}
+
+/* sio_format_endpoint - Implementation of %pN */
+static ssize_t sio_format_endpoint(sio_output_function output,
+                                   void *output_state, const void *arg,
+                                   int padding, int precision) {
+    return sio_format_sockaddr(output, output_state, arg, padding, true);
+}
+
+/*
+ * Extension conversions
+ *
+ * %p immediately followed by an upper case letter selects an extension
+ * conversion, which receives the pointer argument and formats it straight into
+ * the output function. Since this is still %p as far as the compiler is
+ * concerned, format string checking keeps working. A %p followed by a letter
+ * that has no registered conversion is a plain pointer followed by that letter.
+ *
+ * Dispatch is a single table lookup indexed by the letter.
+ */
+#define SIO_CONVERSION_COUNT 26
+
+static sio_conversion_function sio_conversions[SIO_CONVERSION_COUNT] = {
+    ['I' - 'A'] = sio_format_address,
+    ['J' - 'A'] = sio_format_json_string,
+    ['N' - 'A'] = sio_format_endpoint,
+    ['T' - 'A'] = sio_format_timestamp,
+};
+
+/* Built-in conversions cannot be replaced */
+static bool sio_conversion_builtin(char suffix) {
+    return strchr("IJNT", suffix) != NULL;
+}
+
+/* sio_conversion_lookup - Return the conversion for %p<suffix>, or NULL */
+static sio_conversion_function sio_conversion_lookup(char suffix) {
+    if (suffix < 'A' || suffix > 'Z') {
+        return NULL;
+    }
+    return sio_conversions[suffix - 'A'];
+}
+
+/**
+ * @brief   Registers an extension conversion, used as %p<suffix>.
+ * @param suffix   The upper case letter selecting the conversion.
+ * @param conv     The conversion function, or NULL to unregister.
+ * @return         0 on success, -1 if the suffix is not an upper case letter
+ *                 or belongs to a built-in conversion.
+ *
+ * The conversion function receives the output function and its state, the
+ * pointer argument, the padding given with * (0 if none, negative to pad on
+ * the right) and the precision given with .* (-1 if none). It must write
+ * directly to the output function and return the number of bytes written, or
+ * a negative value on error. When the output function returns a negative
+ * value, SIO_OUTPUT_FULL included, the conversion must stop and return that
+ * value unchanged, so that the formatting stops with it. It should be
+ * async-signal-safe if the format is used from signal handlers.
+ *
+ * Conversions should be registered at startup, before any thread or signal
+ * handler may use them: the table itself is not synchronized.
+ */
+int sio_register_conversion(char suffix, sio_conversion_function conv) {
+    if (suffix < 'A' || suffix > 'Z' || sio_conversion_builtin(suffix)) {
+        return -1;
+    }
+    sio_conversions[suffix - 'A'] = conv;
+    return 0;
+}
+
 ssize_t sio_format(sio_output_function output, void *output_state,
                    const char *fmt, ...) {
     va_list argp;
@@ -323,10 +1104,53 @@ typedef enum {
     NumFloat,
 } number_type_t;*/
 
+/* sio_count_output - Output function counting bytes, used when measuring */
+static ssize_t sio_count_output(void *state, char padding, size_t count_left,
+                                size_t count_right, const char *data,
+                                size_t len) {
+    return (ssize_t)(count_left + len + count_right);
+}
+
+/* sio_sink_integer - Write an integer with its padding straight into memory
+ * reserved from the sink.
+ *
+ * Returns what the sink commit returns, or 0 if the sink could not reserve the
+ * memory, in which case the integer must go through the output function.
+ */
+static ssize_t sio_sink_integer(const sio_sink_t *sink, const char *prefix,
+                                uintmax_t v, unsigned char b, int padding) {
+    size_t prefix_len = strlen(prefix);
+    size_t len = prefix_len + uintmax_digit_count(v, b);
+    size_t width = padding < 0 ? (size_t)(-(ssize_t)padding) : (size_t)padding;
+    size_t total = len < width ? width : len;
+    char *dst = sink->reserve(sink->state, total);
+    if (dst == NULL) {
+        return 0;
+    }
+    size_t left_padding_count = padding > 0 ? total - len : 0;
+    memset(dst, ' ', left_padding_count);
+    memcpy(dst + left_padding_count, prefix, prefix_len);
+    char *p = dst + left_padding_count + len;
+    do {
+        *--p = "0123456789abcdef"[v % b];
+    } while ((v /= b) > 0);
+    memset(dst + left_padding_count + len, ' ', total - len - left_padding_count);
+    return sink->commit(sink->state, total);
+}
+
 /* TODO's: Add support for .* precision, and refactor the name num_written below
+ *
+ * With a NULL output function, nothing is written and the return value is the
+ * length of the output: integer lengths come from their digit counts and float
+ * lengths from sio_measure_double_exact, so no digit is generated.
+ *
+ * With a sink that can reserve memory, integers are written straight into it,
+ * everything else goes through the output function of the sink.
  */
-ssize_t sio_vformat(sio_output_function output, void *output_state,
-                    const char *fmt, va_list argp) {
+static ssize_t sio_vformat_internal(sio_output_function output,
+                                   void *output_state, const sio_sink_t *sink,
+                                   const char *fmt, va_list argp) {
+    bool measure = output == NULL;
     size_t pos = 0;
     ssize_t num_written =
         0; // refactor this name, which no longer reflects the real meaning
@@ -343,11 +1167,13 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
         bool handled = false;
         ssize_t written = 0;
         bool padded = false;
+        bool streamed = false;
         bool precision_given = false;
         int padding = 0;
         int precision = -1;
         size_t current = 0;
         number_size_t num_size = NumSizeInt;
+        sio_conversion_function conversion = NULL;
         // number_type_t num_type = NumNone;
 
         if (local_fmt[0] == '%' && local_fmt[1] != '\0') {
@@ -358,6 +1184,7 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
                 uintmax_t u;
                 intmax_t s;
                 double f;
+                const void *ptr;
             } convert_value = {.u = 0};
 
             if (local_fmt[current] == '*') {
@@ -467,6 +1294,13 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
             case 'p': {
                 if (num_size != NumSizeInt) {
                     error = true;
+                } else if ((conversion = sio_conversion_lookup(
+                                local_fmt[current + 1])) != NULL) {
+                    // Extension conversion
+                    convert_type = 'E';
+                    convert_value.ptr = va_arg(argp, const void *);
+                    current += 2;
+                    local_pos += current;
                 } else {
                     void *ptr = va_arg(argp, void *);
                     if (ptr == NULL) {
@@ -562,7 +1396,71 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
                 break;
             }
 
-            // Convert int type to string
+            // Write integers straight into memory reserved from the sink
+            if (sink != NULL && sink->reserve != NULL) {
+                switch (convert_type) {
+                case 'd':
+                    written = sio_sink_integer(
+                        sink, convert_value.s < 0 ? "-" : "",
+                        intmax_magnitude(convert_value.s), 10, padding);
+                    break;
+                case 'u':
+                    written =
+                        sio_sink_integer(sink, "", convert_value.u, 10, padding);
+                    break;
+                case 'x':
+                    written =
+                        sio_sink_integer(sink, "", convert_value.u, 16, padding);
+                    break;
+                case 'o':
+                    written =
+                        sio_sink_integer(sink, "", convert_value.u, 8, padding);
+                    break;
+                case 'p':
+                    written = sio_sink_integer(sink, "0x", convert_value.u, 16,
+                                               padding);
+                    break;
+                default:
+                    break;
+                }
+                if (written != 0) {
+                    convert_type = '\0';
+                    streamed = true;
+                    handled = true;
+                }
+            }
+
+            // Convert int type to string, or only count its digits
+            if (measure) {
+                switch (convert_type) {
+                case 'd':
+                    data.len = (convert_value.s < 0) +
+                               uintmax_digit_count(
+                                   intmax_magnitude(convert_value.s), 10);
+                    convert_type = '\0';
+                    handled = true;
+                    break;
+                case 'u':
+                    data.len = uintmax_digit_count(convert_value.u, 10);
+                    convert_type = '\0';
+                    handled = true;
+                    break;
+                case 'x':
+                case 'p':
+                    data.len = uintmax_digit_count(convert_value.u, 16) +
+                               (convert_type == 'p' ? 2 : 0);
+                    convert_type = '\0';
+                    handled = true;
+                    break;
+                case 'o':
+                    data.len = uintmax_digit_count(convert_value.u, 8);
+                    convert_type = '\0';
+                    handled = true;
+                    break;
+                default:
+                    break;
+                }
+            }
             switch (convert_type) {
             case 'd':
                 data.str = data.buf;
@@ -591,6 +1489,15 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
                     uintmax_to_string(convert_value.u, data.buf + 2, 16) + 2;
                 handled = true;
                 break;
+            case 'E':
+                // Streamed straight to the output by the conversion
+                written = conversion(measure ? sio_count_output : output,
+                                     output_state, convert_value.ptr,
+                                     padding,
+                                     precision_given ? precision : -1);
+                streamed = true;
+                handled = true;
+                break;
             case 'f':
                 // Float may generate longer results than 128
                 data.str = data.buf;
@@ -599,9 +1506,16 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
                 if (!precision_given) {
                     precision = FLOAT_DEFAULT_PRECISION;
                 }
-                written = sio_format_double_exact(output, output_state,
-                                                  convert_value.f, FORMAT_f,
-                                                  padding, precision); // Right padding is unsupported
+                if (measure) {
+                    written = (ssize_t)sio_measure_double_exact(
+                        convert_value.f, FORMAT_f, padding, precision);
+                } else {
+                    CSAPP_STAT_START(float_start);
+                    written = sio_format_double_exact(
+                        output, output_state, convert_value.f, FORMAT_f,
+                        padding, precision);
+                    CSAPP_STAT_RECORD(CSAPP_HIST_SIO_FLOAT, float_start);
+                }
 #else
                 data.str = "<float>";
                 data.len = strlen(data.str);
@@ -609,7 +1523,8 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
                 handled = true;
                 break;
             default:
-                error = true;
+                // Not a numeric conversion, nothing left to convert
+                break;
             }
 
         }
@@ -634,12 +1549,17 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
         if (padded && padding < 0 && (size_t) (-padding) > data.len) { // Right padding unsupported
             right_padding_count = (size_t) (-padding) - data.len;
         }
-        if (written == 0) {
-            written =
-                output(output_state, ' ', left_padding_count, right_padding_count, data.str, data.len);
+        if (written == 0 && !streamed) {
+            if (measure) {
+                written = (ssize_t)(left_padding_count + data.len +
+                                    right_padding_count);
+            } else {
+                written = output(output_state, ' ', left_padding_count,
+                                 right_padding_count, data.str, data.len);
+            }
         }
         if (written < 0) {
-            return -1;
+            return written;
         }
         num_written += written;
     }
@@ -651,10 +1571,372 @@ ssize_t sio_vformat(sio_output_function output, void *output_state,
     return num_written;
 }
 
-/* Async-signal-safe assertion support*/
-void __sio_assert_fail(const char *assertion, const char *file,
-                       unsigned int line, const char *function) {
-    sio_dprintf(STDERR_FILENO, "%s: %s:%u: %s: Assertion `%s' failed.\n",
+/**
+ * @brief   Formats output to an output function from a va_list.
+ * @param output         The output function receiving the formatted data.
+ * @param output_state   The state of the output function.
+ * @param fmt            The format string, see sio_vdprintf.
+ * @param argp           The arguments for the format string.
+ * @return               The number of bytes written, -1 on error, or
+ *                       SIO_OUTPUT_FULL if the output function returned it.
+ *
+ * @remark   This function is async-signal-safe.
+ *
+ * An output function returns SIO_OUTPUT_FULL when its destination cannot take
+ * any more data: formatting then stops right away, without converting the
+ * remaining arguments. Conversions, including registered ones, must return
+ * the negative value of the output function unchanged so that it propagates.
+ */
+ssize_t sio_vformat(sio_output_function output, void *output_state,
+                    const char *fmt, va_list argp) {
+    CSAPP_STAT_START(start);
+    ssize_t ret = sio_vformat_internal(output, output_state, NULL, fmt, argp);
+    CSAPP_STAT_RECORD(CSAPP_HIST_SIO_VFORMAT, start);
+    return ret;
+}
+
+/**
+ * @brief   Formats output to a reserve/commit sink.
+ * @param sink   The sink receiving the formatted data. reserve returns at
+ *               least the requested number of contiguous writable bytes, or
+ *               NULL to fall back to output; commit publishes the bytes
+ *               written to the last reservation and returns their number, or
+ *               a negative value like an output function.
+ * @param fmt    The format string, see sio_vdprintf.
+ * @return       The number of bytes written, -1 on error, or SIO_OUTPUT_FULL
+ *               if a sink function returned it.
+ *
+ * @remark   This function is async-signal-safe if the sink functions are.
+ */
+ssize_t sio_format_sink(const sio_sink_t *sink, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vformat_sink(sink, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/**
+ * @brief   Formats output to a reserve/commit sink from a va_list.
+ * @param sink   The sink receiving the formatted data.
+ * @param fmt    The format string, see sio_vdprintf.
+ * @param argp   The arguments for the format string.
+ * @return       The number of bytes written, -1 on error, or SIO_OUTPUT_FULL.
+ *
+ * @remark   This function is async-signal-safe if the sink functions are.
+ *
+ * Conversions with a known length are rendered directly into memory obtained
+ * from the reserve function of the sink, then published with its commit
+ * function, instead of going through a temporary buffer and a copy. When the
+ * sink has no reserve function, or it returns NULL, the output function of the
+ * sink is used, so any output function can be wrapped with SIO_OUTPUT_SINK.
+ */
+ssize_t sio_vformat_sink(const sio_sink_t *sink, const char *fmt,
+                         va_list argp) {
+    CSAPP_STAT_START(start);
+    ssize_t ret =
+        sio_vformat_internal(sink->output, sink->state, sink, fmt, argp);
+    CSAPP_STAT_RECORD(CSAPP_HIST_SIO_VFORMAT, start);
+    return ret;
+}
+
+/**
+ * @brief   Computes the length of formatted output, without producing it.
+ * @param fmt    The format string, see sio_vdprintf.
+ * @param ...    The arguments for the format string.
+ * @return       The exact number of bytes sio_format would write, not counting
+ *               any NUL terminator, or -1 on error.
+ *
+ * @remark   This function is async-signal-safe.
+ * @see      sio_vformat_measure
+ */
+ssize_t sio_format_measure(const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vformat_measure(fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/**
+ * @brief   Computes the length of formatted output from a va_list.
+ * @param fmt    The format string, see sio_vdprintf.
+ * @param argp   The arguments for the format string.
+ * @return       The exact number of bytes sio_vformat would write, or -1 on
+ *               error.
+ *
+ * @remark   This function is async-signal-safe.
+ *
+ * No digit is generated: integers are measured from their bit length, strings
+ * with strlen and floats from their decimal exponent, rounding carries such as
+ * 9.99 becoming 10.0 included. Extension conversions are run into a counting
+ * output function. This allows sizing a buffer once before formatting into it.
+ */
+ssize_t sio_vformat_measure(const char *fmt, va_list argp) {
+    return sio_vformat_internal(NULL, NULL, NULL, fmt, argp);
+}
+
+/*
+ * Structured JSON records
+ *
+ * These helpers emit one JSON object, field by field, straight into an output
+ * function: keys and string values are escaped on the fly and numbers are
+ * converted directly, so a record is produced in a single pass without any
+ * temporary buffer. Errors are sticky: once an output fails, every following
+ * call fails with the same negative value, and so does sio_json_end.
+ */
+
+/**
+ * @brief   Output function escaping everything it writes for a JSON string.
+ * @param state    A sio_json_output_t wrapping the real output function.
+ *
+ * The return value is the number of bytes written to the wrapped output, which
+ * is larger than the input when escapes are needed.
+ */
+ssize_t sio_json_output(void *state, char padding, size_t count_left,
+                        size_t count_right, const char *data, size_t len) {
+    sio_json_output_t *json_state = state;
+
+    // Padding is only ever ' ', '0' or '.', which need no escaping
+    ssize_t res = json_state->output(json_state->output_state, padding,
+                                     count_left, 0, NULL, 0);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r = sio_output_json(json_state->output, json_state->output_state,
+                                data, len);
+    if (r < 0) {
+        return r;
+    }
+    res += r;
+    r = json_state->output(json_state->output_state, padding, 0, count_right,
+                           NULL, 0);
+    if (r < 0) {
+        return r;
+    }
+    return res + r;
+}
+
+/* sio_json_emit - Write raw bytes for a record, keeping track of errors */
+static ssize_t sio_json_emit(sio_json_record_t *rec, const char *data,
+                             size_t len) {
+    if (rec->written < 0) {
+        return rec->written;
+    }
+    ssize_t r = rec->output(rec->output_state, ' ', 0, 0, data, len);
+    if (r < 0) {
+        rec->written = r;
+        return r;
+    }
+    rec->written += r;
+    return r;
+}
+
+/* sio_json_key - Write the separator and `"key":` for the next field */
+static ssize_t sio_json_key(sio_json_record_t *rec, const char *key) {
+    ssize_t res = rec->fields == 0 ? sio_json_emit(rec, "\"", 1)
+                                   : sio_json_emit(rec, ",\"", 2);
+    if (res < 0) {
+        return res;
+    }
+    rec->fields++;
+    ssize_t r = sio_output_json(rec->output, rec->output_state, key,
+                                strlen(key));
+    if (r < 0) {
+        rec->written = r;
+        return r;
+    }
+    rec->written += r;
+    res += r;
+    r = sio_json_emit(rec, "\":", 2);
+    if (r < 0) {
+        return r;
+    }
+    return res + r;
+}
+
+/**
+ * @brief   Starts a JSON record, writing its opening brace.
+ * @param rec            The record state to initialize.
+ * @param output         The output function receiving the record.
+ * @param output_state   The state of the output function.
+ * @return               The number of bytes written, or -1 on error.
+ *
+ * @remark   This function is async-signal-safe, and so are all sio_json_*
+ *           functions, except that sio_json_add_double needs CSAPP_HAS_DTOA.
+ */
+ssize_t sio_json_begin(sio_json_record_t *rec, sio_output_function output,
+                       void *output_state) {
+    rec->output = output;
+    rec->output_state = output_state;
+    rec->written = 0;
+    rec->fields = 0;
+    return sio_json_emit(rec, "{", 1);
+}
+
+/**
+ * @brief   Adds a string field, escaped as it is written.
+ * @return  The number of bytes written, or -1 on error.
+ *
+ * A NULL value is written as the JSON null literal.
+ */
+ssize_t sio_json_add_string(sio_json_record_t *rec, const char *key,
+                            const char *value) {
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    if (value == NULL) {
+        ssize_t r = sio_json_emit(rec, "null", 4);
+        return r < 0 ? r : res + r;
+    }
+    ssize_t r = sio_json_emit(rec, "\"", 1);
+    if (r < 0) {
+        return r;
+    }
+    res += r;
+    r = sio_output_json(rec->output, rec->output_state, value, strlen(value));
+    if (r < 0) {
+        rec->written = r;
+        return r;
+    }
+    rec->written += r;
+    res += r;
+    r = sio_json_emit(rec, "\"", 1);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Adds a string field whose value is formatted with sio_format.
+ * @return  The number of bytes written, or -1 on error.
+ *
+ * The formatted value is escaped on its way to the output, through
+ * sio_json_output, so it is never materialized.
+ */
+ssize_t sio_json_add_format(sio_json_record_t *rec, const char *key,
+                            const char *fmt, ...) {
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r = sio_json_emit(rec, "\"", 1);
+    if (r < 0) {
+        return r;
+    }
+    res += r;
+
+    sio_json_output_t json_state;
+    json_state.output = rec->output;
+    json_state.output_state = rec->output_state;
+    va_list argp;
+    va_start(argp, fmt);
+    r = sio_vformat(sio_json_output, &json_state, fmt, argp);
+    va_end(argp);
+    if (r < 0) {
+        rec->written = r;
+        return r;
+    }
+    rec->written += r;
+    res += r;
+
+    r = sio_json_emit(rec, "\"", 1);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Adds a signed integer field.
+ * @return  The number of bytes written, or -1 on error.
+ */
+ssize_t sio_json_add_int(sio_json_record_t *rec, const char *key,
+                         long long value) {
+    char buf[64];
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    size_t len = intmax_to_string((intmax_t)value, buf, 10);
+    ssize_t r = sio_json_emit(rec, buf, len);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Adds an unsigned integer field.
+ * @return  The number of bytes written, or -1 on error.
+ */
+ssize_t sio_json_add_uint(sio_json_record_t *rec, const char *key,
+                          unsigned long long value) {
+    char buf[64];
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    size_t len = uintmax_to_string((uintmax_t)value, buf, 10);
+    ssize_t r = sio_json_emit(rec, buf, len);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Adds a floating point field, as with %.*f.
+ * @param precision   Digits after the decimal point, negative for the default.
+ * @return            The number of bytes written, or -1 on error.
+ *
+ * JSON has no representation for infinities and NaN, they are written as
+ * null, as is every double when the library is built without CSAPP_HAS_DTOA.
+ */
+ssize_t sio_json_add_double(sio_json_record_t *rec, const char *key,
+                            double value, int precision) {
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r;
+#ifdef CSAPP_HAS_DTOA
+    if (isfinite(value)) {
+        if (precision < 0) {
+            precision = FLOAT_DEFAULT_PRECISION;
+        }
+        r = sio_format_double_exact(rec->output, rec->output_state, value,
+                                    FORMAT_f, 0, precision);
+        if (r < 0) {
+            rec->written = r;
+            return r;
+        }
+        rec->written += r;
+        return res + r;
+    }
+#endif // CSAPP_HAS_DTOA
+    r = sio_json_emit(rec, "null", 4);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Adds a boolean field.
+ * @return  The number of bytes written, or -1 on error.
+ */
+ssize_t sio_json_add_bool(sio_json_record_t *rec, const char *key, int value) {
+    ssize_t res = sio_json_key(rec, key);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r = value ? sio_json_emit(rec, "true", 4)
+                      : sio_json_emit(rec, "false", 5);
+    return r < 0 ? r : res + r;
+}
+
+/**
+ * @brief   Ends a JSON record, writing its closing brace.
+ * @return  The total number of bytes of the record, or the negative value
+ *          returned by the output function if any part of it failed.
+ */
+ssize_t sio_json_end(sio_json_record_t *rec) {
+    sio_json_emit(rec, "}", 1);
+    return rec->written;
+}
+
+/* Async-signal-safe assertion support*/
+void __sio_assert_fail(const char *assertion, const char *file,
+                       unsigned int line, const char *function) {
+    sio_dprintf(STDERR_FILENO, "%s: %s:%u: %s: Assertion `%s' failed.\n",
                 __progname, file, line, function, assertion);
     abort();
 }
@@ -670,21 +1952,29 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n) {
     size_t nleft = n;
     ssize_t nread;
     char *bufp = usrbuf;
+    CSAPP_STAT_START(start);
 
     while (nleft > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
         if ((nread = read(fd, bufp, nleft)) < 0) {
             if (errno != EINTR) {
+                CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READN, start);
                 return -1; /* errno set by read() */
             }
 
             /* Interrupted by sig handler return, call read() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_EINTR, 1);
             nread = 0;
         } else if (nread == 0) {
             break; /* EOF */
+        } else if ((size_t)nread < nleft) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_READS, 1);
         }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, nread);
         nleft -= (size_t)nread;
         bufp += nread;
     }
+    CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READN, start);
     return (ssize_t)(n - nleft); /* Return >= 0 */
 }
 
@@ -695,47 +1985,419 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
     size_t nleft = n;
     ssize_t nwritten;
     const char *bufp = usrbuf;
+    CSAPP_STAT_START(start);
 
     while (nleft > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITES, 1);
         if ((nwritten = write(fd, bufp, nleft)) <= 0) {
             if (errno != EINTR) {
+                CSAPP_STAT_RECORD(CSAPP_HIST_RIO_WRITEN, start);
                 return -1; /* errno set by write() */
             }
 
             /* Interrupted by sig handler return, call write() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_EINTR, 1);
             nwritten = 0;
+        } else if ((size_t)nwritten < nleft) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_WRITES, 1);
         }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_BYTES, nwritten);
         nleft -= (size_t)nwritten;
         bufp += nwritten;
     }
+    CSAPP_STAT_RECORD(CSAPP_HIST_RIO_WRITEN, start);
     return (ssize_t)n;
 }
 
+/* Adaptive buffers double after this many reads filling them... */
+#define RIO_GROW_STREAK 4
+/* ... and halve after this many reads filling less than a quarter */
+#define RIO_SHRINK_STREAK 16
+
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_alloc_buf - Allocate an internal buffer of size bytes, with huge pages
+ *    if it is large enough and the system has them. Sets the flags saying
+ *    how to free it. Returns NULL with errno set on error.
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-    size_t cnt;
+static char *rio_alloc_buf(size_t size, unsigned int *flags) {
+#ifdef __linux__
+    if (size >= RIO_HUGE_BUFSIZE) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            (void)madvise(p, size, MADV_HUGEPAGE); /* Only a hint */
+            *flags = RIO_BUF_MMAP;
+            return p;
+        }
+    }
+#endif // __linux__
+    *flags = RIO_BUF_MALLOC;
+    return malloc(size);
+}
+
+/*
+ * rio_free_buf - Free a buffer of rio_alloc_buf, given its flags
+ */
+static void rio_free_buf(char *buf, size_t size, unsigned int flags) {
+    if (flags & RIO_BUF_MMAP) {
+        munmap(buf, size);
+    } else if (flags & RIO_BUF_MALLOC) {
+        free(buf);
+    }
+}
+
+/*
+ * rio_release_buf - Free the internal buffer if rio allocated it, and go
+ *    back to the default rio_buf
+ */
+static void rio_release_buf(rio_t *rp) {
+    rio_free_buf(rp->rio_bufstart, rp->rio_bufsize, rp->rio_flags);
+    rp->rio_flags = 0;
+    rp->rio_bufstart = rp->rio_buf;
+    rp->rio_bufsize = sizeof(rp->rio_buf);
+}
+
+/*
+ * rio_count_read - Track the streaks of reads of n bytes filling an
+ *    adaptive buffer, which means the descriptor has more to give at once,
+ *    and of small reads, which mean the buffer is mostly wasted
+ */
+static void rio_count_read(rio_t *rp, size_t n) {
+    if (n == rp->rio_bufsize) {
+        rp->rio_streak = rp->rio_streak > 0 ? rp->rio_streak + 1 : 1;
+    } else if (n < rp->rio_bufsize / 4) {
+        rp->rio_streak = rp->rio_streak < 0 ? rp->rio_streak - 1 : -1;
+    } else {
+        rp->rio_streak = 0;
+    }
+}
+
+/*
+ * rio_adapt - Resize an empty adaptive buffer at the end of a streak
+ */
+static void rio_adapt(rio_t *rp) {
+    size_t size;
+    if (rp->rio_streak >= RIO_GROW_STREAK &&
+        rp->rio_bufsize < rp->rio_bufmax) {
+        size = rp->rio_bufsize * 2;
+        if (size > rp->rio_bufmax) {
+            size = rp->rio_bufmax;
+        }
+    } else if (rp->rio_streak <= -RIO_SHRINK_STREAK &&
+               rp->rio_bufsize > sizeof(rp->rio_buf)) {
+        size = rp->rio_bufsize / 2;
+        if (size < sizeof(rp->rio_buf)) {
+            size = sizeof(rp->rio_buf);
+        }
+    } else {
+        return;
+    }
+
+    rp->rio_streak = 0;
+    unsigned int flags = 0;
+    char *buf = rp->rio_buf;
+    if (size > sizeof(rp->rio_buf) &&
+        (buf = rio_alloc_buf(size, &flags)) == NULL) {
+        return; /* Keep the current buffer */
+    }
+    rio_release_buf(rp);
+    rp->rio_bufstart = buf;
+    rp->rio_bufsize = size;
+    rp->rio_flags = flags;
+}
+
+/*
+ * rio_map_more - Map the next window of a mapped file, starting at the
+ *    page of the next unread byte so that the unread bytes stay mapped.
+ *    Returns the number of bytes mapped past the previous window, 0 on
+ *    EOF or if the unread bytes fill a whole window, or -1 on error.
+ */
+static ssize_t rio_map_more(rio_t *rp) {
+    struct stat st;
+    off_t next = rp->rio_mapoff + (rp->rio_bufptr - rp->rio_bufstart);
+    off_t end = rp->rio_mapoff + (off_t)rp->rio_bufsize;
+
+    if (fstat(rp->rio_fd, &st) < 0) {
+        return -1; /* errno set by fstat() */
+    }
+    if (st.st_size <= end) {
+        return 0; /* EOF */
+    }
+    off_t start = next - next % (off_t)sysconf(_SC_PAGESIZE);
+    size_t len = rp->rio_bufmax;
+    if ((off_t)len > st.st_size - start) {
+        len = (size_t)(st.st_size - start);
+    }
+    if (start + (off_t)len <= end) {
+        return 0; /* The window is full */
+    }
+    char *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, rp->rio_fd, start);
+    if (p == MAP_FAILED) {
+        return -1; /* errno set by mmap() */
+    }
+#ifdef __linux__
+    (void)madvise(p, len, MADV_SEQUENTIAL); /* Only a hint */
+#endif // __linux__
+    if (rp->rio_flags & RIO_BUF_MMAP) {
+        munmap(rp->rio_bufstart, rp->rio_bufsize);
+    }
+    rp->rio_flags |= RIO_BUF_MMAP;
+    rp->rio_bufstart = p;
+    rp->rio_bufsize = len;
+    rp->rio_mapoff = start;
+    rp->rio_bufptr = p + (next - start);
+    rp->rio_cnt = (ssize_t)(start + (off_t)len - next);
+    return (ssize_t)(start + (off_t)len - end);
+}
+
+/*
+ * Prefetching
+ *
+ * A helper thread reads into a ring of nbufs buffers, ahead of the caller.
+ * filled counts the buffers read and not released yet, starting at head:
+ * the one the caller is reading, if held, then the ones waiting for it. The
+ * thread reads into the buffer after them while filled < nbufs. Each buffer
+ * is read into its second half, the first half leaving room to move the
+ * unread bytes of the previous buffer in front of it, so that a line never
+ * straddles two buffers. The thread stops at EOF or at the first error,
+ * which the caller then keeps getting.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    size_t size;        /* Bytes read into each buffer */
+    unsigned int nbufs; /* Buffers in the ring */
+    char *mem;          /* The buffers, each 2 * size bytes */
+    unsigned int flags; /* How mem was allocated */
+    ssize_t *counts;    /* What read() returned into each buffer */
+    int *errors;        /* errno after read() failed */
+    unsigned int head;
+    unsigned int filled;
+    bool held;
+    bool stop;
+} rio_prefetch_t;
+
+/* rio_prefetch_buf - The start of buffer i */
+static char *rio_prefetch_buf(rio_prefetch_t *p, unsigned int i) {
+    return p->mem + 2 * p->size * i;
+}
+
+/*
+ * rio_prefetch_thread - Fill the free buffers until EOF, an error, or
+ *    rio_freeb. Cancellation, by rio_freeb, is only enabled within read(),
+ *    which may block on pipes and sockets.
+ */
+static void *rio_prefetch_thread(void *arg) {
+    rio_prefetch_t *p = arg;
+    ssize_t n = 1;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&p->lock);
+    while (n > 0) {
+        while (!p->stop && p->filled == p->nbufs) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stop) {
+            break;
+        }
+        unsigned int i = (p->head + p->filled) % p->nbufs;
+        pthread_mutex_unlock(&p->lock);
+
+        char *buf = rio_prefetch_buf(p, i) + p->size;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        do {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
+            n = read(p->fd, buf, p->size);
+        } while (n < 0 && errno == EINTR);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (n > 0) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, n);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->counts[i] = n;
+        p->errors[i] = n < 0 ? errno : 0;
+        p->filled++;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * rio_prefetch_next - Switch to the next buffer read by the thread, moving
+ *    the unread bytes in front of it. Returns the number of bytes it adds,
+ *    or 0 on EOF or -1 on error, in which case nothing changes.
+ */
+static ssize_t rio_prefetch_next(rio_t *rp) {
+    rio_prefetch_t *p = rp->rio_ahead;
+    size_t keep = rp->rio_cnt > 0 ? (size_t)rp->rio_cnt : 0;
+
+    pthread_mutex_lock(&p->lock);
+    unsigned int needed = p->held ? 2 : 1;
+    while (p->filled < needed) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    unsigned int i = (p->head + needed - 1) % p->nbufs;
+    ssize_t n = p->counts[i];
+    int error = p->errors[i];
+    pthread_mutex_unlock(&p->lock);
+    if (n < 0) {
+        errno = error;
+        return -1; /* The buffer stays filled, for next time */
+    } else if (n == 0) {
+        return 0; /* EOF, likewise */
+    }
 
+    char *buf = rio_prefetch_buf(p, i);
+    memcpy(buf + p->size - keep, rp->rio_bufptr, keep);
+    rp->rio_bufstart = buf;
+    rp->rio_bufptr = buf + p->size - keep;
+    rp->rio_cnt = (ssize_t)(keep + (size_t)n);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->held) {
+        p->head = (p->head + 1) % p->nbufs;
+        p->filled--;
+        pthread_cond_broadcast(&p->cond);
+    }
+    p->held = true;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+/*
+ * rio_prefetch_stop - Stop the thread and free the buffers
+ */
+static void rio_prefetch_stop(rio_t *rp) {
+    rio_prefetch_t *p = rp->rio_ahead;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_cancel(p->thread);
+    pthread_join(p->thread, NULL);
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    rio_free_buf(p->mem, 2 * p->size * p->nbufs, p->flags);
+    free(p->counts);
+    free(p->errors);
+    free(p);
+    rp->rio_ahead = NULL;
+    rp->rio_flags = 0;
+    rp->rio_bufstart = rp->rio_buf;
+    rp->rio_bufsize = sizeof(rp->rio_buf);
+}
+
+/*
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the internal buffer, 0
+ *    on EOF or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp) {
+    if (rp->rio_flags & RIO_FILE_MAP) {
+        return rp->rio_cnt > 0 ? rp->rio_cnt : rio_map_more(rp);
+    }
+    if (rp->rio_flags & RIO_PREFETCH) {
+        ssize_t rc = rp->rio_cnt > 0 ? 1 : rio_prefetch_next(rp);
+        return rc <= 0 ? rc : rp->rio_cnt;
+    }
     while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
+        if (rp->rio_bufmax > 0) {
+            rio_adapt(rp);
+        }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
+        ssize_t nread = read(rp->rio_fd, rp->rio_bufstart, rp->rio_bufsize);
+        if (nread < 0) {
             if (errno != EINTR) {
-                return -1; /* errno set by read() */
+                return -1; /* errno set by read(), rio_cnt stays 0 */
             }
 
             /* Interrupted by sig handler return, nothing to do */
-        } else if (rp->rio_cnt == 0) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_EINTR, 1);
+        } else if (nread == 0) {
             return 0; /* EOF */
         } else {
-            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+            if ((size_t)nread < rp->rio_bufsize) {
+                CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_READS, 1);
+            }
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, nread);
+            if (rp->rio_bufmax > 0) {
+                rio_count_read(rp, (size_t)nread);
+            }
+            rp->rio_cnt = nread;
+            rp->rio_bufptr = rp->rio_bufstart; /* Reset buffer ptr */
         }
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_fill_more - Move the unread bytes to the start of the internal
+ *    buffer, and read() more bytes after them. Returns the number of
+ *    bytes read, 0 on EOF or if the buffer is full, or -1 on error.
+ */
+ssize_t rio_fill_more(rio_t *rp) {
+    ssize_t rc;
+
+    if (rp->rio_flags & RIO_FILE_MAP) {
+        return rio_map_more(rp);
+    }
+    if (rp->rio_flags & RIO_PREFETCH) {
+        return rp->rio_cnt < (ssize_t)rp->rio_bufsize ? rio_prefetch_next(rp)
+                                                      : 0;
+    }
+    if (rp->rio_cnt < 0) {
+        rp->rio_cnt = 0; /* Left by a failed read() */
+    }
+    if (rp->rio_bufptr != rp->rio_bufstart) {
+        memmove(rp->rio_bufstart, rp->rio_bufptr, (size_t)rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_bufstart;
+    }
+    size_t space = rp->rio_bufsize - (size_t)rp->rio_cnt;
+    if (space == 0) {
+        return 0;
+    }
+    for (;;) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
+        rc = read(rp->rio_fd, rp->rio_bufstart + rp->rio_cnt, space);
+        if (rc >= 0) {
+            break;
+        }
+        if (errno != EINTR) {
+            return -1; /* errno set by read() */
+        }
+
+        /* Interrupted by sig handler return, call read() again */
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_EINTR, 1);
+    }
+    if (rc > 0 && (size_t)rc < space) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_READS, 1);
+    }
+    CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, rc);
+    rp->rio_cnt += rc;
+    return rc;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+    size_t cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0) {
+        return rc; /* EOF or error */
+    }
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -755,55 +2417,1274 @@ void rio_readinitb(rio_t *rp, int fd) {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_bufstart = rp->rio_buf;
+    rp->rio_bufsize = sizeof(rp->rio_buf);
+    rp->rio_bufmax = 0;
+    rp->rio_streak = 0;
+    rp->rio_flags = 0;
+    rp->rio_mapoff = 0;
+    rp->rio_ahead = NULL;
 }
 
 /*
- * rio_readnb - Robustly read n bytes (buffered)
+ * rio_readinitb_sized - Associate a descriptor with a read buffer of the
+ *    given size. The buffer is buf if it is not NULL, and belongs to the
+ *    caller. Otherwise it is allocated, with huge pages from
+ *    RIO_HUGE_BUFSIZE on where available, and rio_freeb frees it.
+ *    Returns 0, or -1 with errno set on error.
  */
-ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
-    size_t nleft = n;
-    ssize_t nread;
-    char *bufp = usrbuf;
-
-    while (nleft > 0) {
-        if ((nread = rio_read(rp, bufp, nleft)) < 0) {
-            return -1; /* errno set by read() */
-        } else if (nread == 0) {
-            break; /* EOF */
+int rio_readinitb_sized(rio_t *rp, int fd, void *buf, size_t size) {
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    rio_readinitb(rp, fd);
+    if (buf == NULL) {
+        unsigned int flags;
+        buf = rio_alloc_buf(size, &flags);
+        if (buf == NULL) {
+            return -1; /* errno set by malloc() */
         }
-        nleft -= (size_t)nread;
-        bufp += nread;
+        rp->rio_flags = flags;
     }
-    return (ssize_t)(n - nleft); /* return >= 0 */
+    rp->rio_bufptr = buf;
+    rp->rio_bufstart = buf;
+    rp->rio_bufsize = size;
+    return 0;
+}
+
+/*
+ * rio_readinitb_adaptive - Associate a descriptor with a read buffer that
+ *    starts as rio_buf, doubles up to max_size while reads keep filling
+ *    it, and halves back while they stay small. Buffers are only resized
+ *    when empty, so no data is moved. Call rio_freeb when done.
+ *    Returns 0, or -1 with errno set on error.
+ */
+int rio_readinitb_adaptive(rio_t *rp, int fd, size_t max_size) {
+    rio_readinitb(rp, fd);
+    rp->rio_bufmax = max_size;
+    return 0;
+}
+
+/*
+ * rio_readinitb_mmap - Associate a descriptor with a read buffer that, for
+ *    regular files, is a read-only mapping of a window of the file, slid
+ *    forward as it is read. Reads then copy straight from the page cache,
+ *    without read() calls, and rio_readline_view does not copy at all.
+ *    The window is RIO_MMAP_WINDOW bytes if 0, and at least two pages.
+ *    Reading starts at the current file offset, which is not updated.
+ *    Other descriptors fall back to read() and rio_buf. Call rio_freeb
+ *    when done. Returns 0, or -1 with errno set on error.
+ *
+ *    As with any mapping, truncating the file while it is read raises
+ *    SIGBUS.
+ */
+int rio_readinitb_mmap(rio_t *rp, int fd, size_t window) {
+    struct stat st;
+    off_t offset;
+
+    rio_readinitb(rp, fd);
+    if (fstat(fd, &st) < 0) {
+        return -1; /* errno set by fstat() */
+    }
+    if (!S_ISREG(st.st_mode) || (offset = lseek(fd, 0, SEEK_CUR)) < 0) {
+        return 0; /* Use read() */
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (window == 0) {
+        window = RIO_MMAP_WINDOW;
+    } else if (window < 2 * page) {
+        window = 2 * page;
+    }
+    rp->rio_flags = RIO_FILE_MAP;
+    rp->rio_bufmax = window;
+    rp->rio_bufsize = 0; /* Nothing mapped yet */
+    rp->rio_mapoff = offset;
+    return 0;
+}
+
+/*
+ * rio_readinitb_prefetch - Associate a descriptor with nbufs read buffers
+ *    of size bytes, filled ahead by a helper thread while the caller works
+ *    on the current one, so that reading overlaps parsing. size is
+ *    RIO_PREFETCH_BUFSIZE and nbufs RIO_PREFETCH_BUFS if 0, nbufs at least
+ *    2. Regular files are also advised as read sequentially. Lines longer
+ *    than size come from rio_readline_view in pieces of less than 2 * size
+ *    bytes, the unread bytes of a buffer and the next one. The thread
+ *    reads the descriptor ahead of the caller until EOF or an error, so it
+ *    must not be used other than through rp until rio_freeb, which stops
+ *    the thread. Returns 0, or -1 with errno set on error.
+ */
+int rio_readinitb_prefetch(rio_t *rp, int fd, size_t size,
+                           unsigned int nbufs) {
+    rio_readinitb(rp, fd);
+    if (size == 0) {
+        size = RIO_PREFETCH_BUFSIZE;
+    }
+    if (nbufs == 0) {
+        nbufs = RIO_PREFETCH_BUFS;
+    } else if (nbufs < 2) {
+        nbufs = 2;
+    }
+    rio_prefetch_t *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return -1; /* errno set by calloc() */
+    }
+    p->fd = fd;
+    p->size = size;
+    p->nbufs = nbufs;
+    p->counts = calloc(nbufs, sizeof(*p->counts));
+    p->errors = calloc(nbufs, sizeof(*p->errors));
+    p->mem = rio_alloc_buf(2 * size * nbufs, &p->flags);
+    if (p->counts == NULL || p->errors == NULL || p->mem == NULL) {
+        int error = errno;
+        rio_free_buf(p->mem, 2 * size * nbufs, p->flags);
+        free(p->counts);
+        free(p->errors);
+        free(p);
+        errno = error;
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); /* A hint */
+    }
+#endif // POSIX_FADV_SEQUENTIAL
+    int rc = pthread_create(&p->thread, NULL, rio_prefetch_thread, p);
+    if (rc != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        rio_free_buf(p->mem, 2 * size * nbufs, p->flags);
+        free(p->counts);
+        free(p->errors);
+        free(p);
+        errno = rc;
+        return -1;
+    }
+    rp->rio_ahead = p;
+    rp->rio_flags = RIO_PREFETCH;
+    rp->rio_bufsize = size;
+    return 0;
+}
+
+/*
+ * rio_freeb - Free the buffer allocated by rio_readinitb_sized or
+ *    rio_readinitb_adaptive, or stop the thread and free the buffers of
+ *    rio_readinitb_prefetch. Unread buffered bytes are lost. Does nothing
+ *    for other buffers.
+ */
+void rio_freeb(rio_t *rp) {
+    if (rp->rio_flags & RIO_PREFETCH) {
+        rio_prefetch_stop(rp);
+    }
+    rio_release_buf(rp);
+    rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_bufmax = 0;
+}
+
+/*
+ * rio_readnb - Robustly read n bytes (buffered)
+ */
+ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    ssize_t nread;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nread = rio_read(rp, bufp, nleft)) < 0) {
+            return -1; /* errno set by read() */
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        nleft -= (size_t)nread;
+        bufp += nread;
+    }
+    return (ssize_t)(n - nleft); /* return >= 0 */
 }
 
 /*
  * rio_readlineb - Robustly read a text line (buffered)
+ *
+ * The buffered bytes are searched for the newline with memchr(), and the
+ * part of the line they hold is copied at once, rather than byte by byte.
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    size_t n;
+    size_t n = 0; /* Bytes stored in usrbuf */
     ssize_t rc;
-    char c, *bufp = usrbuf;
+    char *bufp = usrbuf;
+    CSAPP_STAT_START(start);
 
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1) {
+    while (n + 1 < maxlen) {
+        if ((rc = rio_fill(rp)) == 0) {
+            if (n == 0) {
+                CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READLINEB, start);
                 return 0; /* EOF, no data read */
             } else {
                 break; /* EOF, some data was read */
             }
-        } else {
+        } else if (rc < 0) {
+            CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READLINEB, start);
             return -1; /* Error */
         }
+
+        size_t cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt) {
+            cnt = (size_t)rp->rio_cnt;
+        }
+        char *newline = memchr(rp->rio_bufptr, '\n', cnt);
+        if (newline != NULL) {
+            cnt = (size_t)(newline - rp->rio_bufptr) + 1;
+        }
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= (ssize_t)cnt;
+        bufp += cnt;
+        n += cnt;
+        if (newline != NULL) {
+            break;
+        }
     }
     *bufp = 0;
-    return (ssize_t)(n - 1);
+    CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READLINEB, start);
+    return (ssize_t)n;
+}
+
+/*
+ * rio_readline_view - Read a text line without copying it (buffered)
+ *
+ * The line is returned as a view into the internal buffer, valid until the
+ * next call on rp. A line starting near the end of the buffer is moved to its
+ * start before reading the rest. A line longer than the buffer is returned
+ * in pieces of the buffer size, like rio_readlineb with a maxlen of
+ * RIO_BUFSIZE + 1 does for the default buffer. Returns the length of the
+ * line, 0 on EOF or -1 on error.
+ */
+ssize_t rio_readline_view(rio_t *rp, rio_line_t *line) {
+    size_t scanned = 0; /* Unread bytes known not to hold a '\n' */
+    size_t len;
+    ssize_t rc;
+
+    for (;;) {
+        char *newline = memchr(rp->rio_bufptr + scanned, '\n',
+                               (size_t)rp->rio_cnt - scanned);
+        if (newline != NULL) {
+            len = (size_t)(newline - rp->rio_bufptr) + 1;
+            break;
+        }
+        scanned = (size_t)rp->rio_cnt;
+        if ((rc = rio_fill_more(rp)) < 0) {
+            return -1; /* Error */
+        } else if (rc == 0) {
+            len = scanned; /* EOF, or a line longer than the buffer */
+            break;
+        }
+    }
+    line->data = rp->rio_bufptr;
+    line->len = len;
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= (ssize_t)len;
+    return (ssize_t)len; /* 0 on EOF, no data read */
+}
+
+/*
+ * rio_readlines_view - Read the text lines in the internal buffer without
+ *    copying them (buffered)
+ *
+ * The first line is read like rio_readline_view does, refilling the buffer
+ * if needed. Then every other complete line already buffered is returned, up
+ * to max lines in all. Returns the number of lines, 0 on EOF or -1 on error.
+ */
+ssize_t rio_readlines_view(rio_t *rp, rio_line_t *lines, size_t max) {
+    ssize_t rc;
+    size_t n = 1;
+
+    if (max == 0) {
+        return 0;
+    }
+    if ((rc = rio_readline_view(rp, &lines[0])) <= 0) {
+        return rc; /* EOF or error */
+    }
+    while (n < max && rp->rio_cnt > 0) {
+        char *newline = memchr(rp->rio_bufptr, '\n', (size_t)rp->rio_cnt);
+        if (newline == NULL) {
+            break; /* Incomplete, left for the next call */
+        }
+        size_t len = (size_t)(newline - rp->rio_bufptr) + 1;
+        lines[n].data = rp->rio_bufptr;
+        lines[n].len = len;
+        rp->rio_bufptr += len;
+        rp->rio_cnt -= (ssize_t)len;
+        n++;
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * rio_capacity - The number of unread bytes the internal buffer can always
+ *    hold at once: mapped windows start at the page of the next unread byte
+ */
+size_t rio_capacity(const rio_t *rp) {
+    if (rp->rio_flags & RIO_FILE_MAP) {
+        return rp->rio_bufmax - (size_t)sysconf(_SC_PAGESIZE) + 1;
+    }
+    return rp->rio_bufsize;
+}
+
+/*
+ * rio_readframe - Read a length prefixed frame (buffered)
+ *
+ * The body of the frame is returned as a view into the internal buffer when
+ * the whole frame fits in it, and is copied to usrbuf otherwise, which must
+ * then hold framing->max_len bytes. Returns the number of bytes read, the
+ * prefix included, 0 on EOF, or -1 on error: EMSGSIZE if the body is longer
+ * than framing->max_len, or than the buffer without usrbuf, EPROTO if EOF
+ * cuts the frame short, EINVAL for a bad prefix width. A body too long, or
+ * cut short while it would fit in the buffer, leaves the buffer at the
+ * prefix. Once copying to usrbuf has begun, an error or EOF leaves the
+ * prefix and the bytes of the body read so far consumed.
+ */
+ssize_t rio_readframe(rio_t *rp, const rio_framing_t *framing, void *usrbuf,
+                      rio_line_t *frame) {
+    size_t width = framing->width;
+    ssize_t rc;
+
+    if (width == 0 || width > sizeof(uint64_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (rp->rio_cnt < (ssize_t)width) {
+        if ((rc = rio_fill_more(rp)) < 0) {
+            return -1; /* errno set by read() */
+        } else if (rc == 0) {
+            if (rp->rio_cnt == 0) {
+                return 0; /* EOF between frames */
+            }
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    const unsigned char *prefix = (const unsigned char *)rp->rio_bufptr;
+    uint64_t len = 0;
+    for (size_t i = 0; i < width; i++) {
+        len = len << 8 | prefix[framing->little_endian ? width - 1 - i : i];
+    }
+    if (len > framing->max_len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    size_t total = width + (size_t)len;
+
+    if (total <= rio_capacity(rp)) {
+        while (rp->rio_cnt < (ssize_t)total) {
+            if ((rc = rio_fill_more(rp)) < 0) {
+                return -1;
+            } else if (rc == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        frame->data = rp->rio_bufptr + width;
+        frame->len = (size_t)len;
+        rp->rio_bufptr += total;
+        rp->rio_cnt -= (ssize_t)total;
+        return (ssize_t)total;
+    }
+    if (usrbuf == NULL) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    rp->rio_bufptr += width;
+    rp->rio_cnt -= (ssize_t)width;
+    if ((rc = rio_readnb(rp, usrbuf, (size_t)len)) < 0) {
+        return -1;
+    } else if ((size_t)rc < len) {
+        errno = EPROTO;
+        return -1;
+    }
+    frame->data = usrbuf;
+    frame->len = (size_t)len;
+    return (ssize_t)total;
+}
+
+/*
+ * rio_find_delim - Return the first occurrence of the dlen bytes of delim
+ *    in the len bytes of s, or NULL. A single byte is found with memchr().
+ *    Longer delimiters have their first and last bytes compared at 16
+ *    positions at once with SSE2 when available, and memchr() finds their
+ *    first byte otherwise. Candidates are then checked with memcmp().
+ */
+static char *rio_find_delim(char *s, size_t len, const char *delim,
+                            size_t dlen) {
+    if (dlen == 1) {
+        return memchr(s, delim[0], len);
+    }
+    if (len < dlen) {
+        return NULL;
+    }
+    size_t starts = len - dlen + 1; /* Positions the delimiter can start at */
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(delim[0]);
+    const __m128i last = _mm_set1_epi8(delim[dlen - 1]);
+    for (; i + 16 <= starts; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        __m128i b = _mm_loadu_si128(
+            (const __m128i *)(const void *)(s + i + dlen - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            char *p = s + i + (size_t)__builtin_ctz(mask);
+            if (memcmp(p + 1, delim + 1, dlen - 2) == 0) {
+                return p;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif // __SSE2__
+    while (i < starts) {
+        char *p = memchr(s + i, delim[0], starts - i);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p + 1, delim + 1, dlen - 1) == 0) {
+            return p;
+        }
+        i = (size_t)(p - s) + 1;
+    }
+    return NULL;
+}
+
+/*
+ * rio_readuntil - Read a record ending with the dlen bytes of delim
+ *    (buffered)
+ *
+ * Like rio_readline_view with any delimiter, such as "\0" or "\r\n". The
+ * record, delimiter included, is returned as a view into the internal
+ * buffer when it fits in it. A longer one is copied to usrbuf, of maxlen
+ * bytes, or comes in pieces of the buffer size if usrbuf is NULL. The last
+ * record may end at EOF without the delimiter. Returns the length of the
+ * record, 0 on EOF, or -1 on error: EMSGSIZE if usrbuf is too small for the
+ * record, whose first bytes are then lost, EINVAL for an empty delimiter.
+ */
+ssize_t rio_readuntil(rio_t *rp, const void *delim, size_t dlen, void *usrbuf,
+                      size_t maxlen, rio_line_t *record) {
+    size_t scanned = 0; /* Unread bytes known not to start a delimiter */
+    size_t copied = 0;  /* Bytes of the record moved to usrbuf */
+    char *usr = usrbuf;
+    size_t len;
+    ssize_t rc;
+
+    if (dlen == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (;;) {
+        char *found = rio_find_delim(rp->rio_bufptr + scanned,
+                                     (size_t)rp->rio_cnt - scanned, delim,
+                                     dlen);
+        if (found != NULL) {
+            len = (size_t)(found - rp->rio_bufptr) + dlen;
+            break;
+        }
+        if ((size_t)rp->rio_cnt >= dlen) {
+            scanned = (size_t)rp->rio_cnt - dlen + 1;
+        }
+        if ((rc = rio_fill_more(rp)) < 0) {
+            return -1; /* Error */
+        } else if (rc > 0) {
+            continue;
+        }
+
+        /* EOF, or the buffer is full */
+        if (usr == NULL || scanned == 0) {
+            len = (size_t)rp->rio_cnt;
+            break;
+        }
+        /* Make room, keeping what may be the start of the delimiter */
+        if (copied + scanned > maxlen) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(usr + copied, rp->rio_bufptr, scanned);
+        copied += scanned;
+        rp->rio_bufptr += scanned;
+        rp->rio_cnt -= (ssize_t)scanned;
+        scanned = 0;
+    }
+
+    if (usr != NULL && copied + len > maxlen) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (copied == 0) {
+        record->data = rp->rio_bufptr;
+        record->len = len;
+    } else {
+        memcpy(usr + copied, rp->rio_bufptr, len);
+        record->data = usr;
+        record->len = copied + len;
+    }
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= (ssize_t)len;
+    return (ssize_t)record->len; /* 0 on EOF, no data read */
+}
+
+/*
+ * rio_writev_all - Robustly write the iovcnt buffers of iov, which are
+ *    updated as they are written. Sockets are written with sendmsg() and
+ *    the given flags, other descriptors with writev(). Returns 0, or -1
+ *    on error.
+ */
+static int rio_writev_all(int fd, struct iovec *iov, int iovcnt, int flags,
+                          int socket) {
+    ssize_t nwritten;
+    size_t nleft = 0;
+    CSAPP_STAT_START(start);
+
+    for (int i = 0; i < iovcnt; i++) {
+        nleft += iov[i].iov_len;
+    }
+    while (nleft > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITES, 1);
+        if (socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)iovcnt;
+            nwritten = sendmsg(fd, &msg, flags);
+        } else {
+            nwritten = writev(fd, iov, iovcnt);
+        }
+        if (nwritten < 0) {
+            if (errno != EINTR) {
+                CSAPP_STAT_RECORD(CSAPP_HIST_RIO_WRITEN, start);
+                return -1; /* errno set by write() */
+            }
+
+            /* Interrupted by sig handler return, call write() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_EINTR, 1);
+            continue;
+        } else if ((size_t)nwritten < nleft) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_WRITES, 1);
+        }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_BYTES, nwritten);
+        nleft -= (size_t)nwritten;
+
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= (size_t)nwritten;
+        }
+    }
+    CSAPP_STAT_RECORD(CSAPP_HIST_RIO_WRITEN, start);
+    return 0;
+}
+
+/* Buffers passed to readv() and writev() at once */
+#ifdef IOV_MAX
+#define RIO_IOV_MAX IOV_MAX
+#else
+#define RIO_IOV_MAX 1024
+#endif // IOV_MAX
+
+/*
+ * rio_readv_all - Robustly read into the iovcnt buffers of iov, which are
+ *    updated as they are filled. Returns the number of bytes read, short
+ *    only on EOF, or -1 on error.
+ */
+static ssize_t rio_readv_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t nread;
+    size_t n = 0, nleft = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        nleft += iov[i].iov_len;
+    }
+    n = nleft;
+    while (nleft > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
+        if ((nread = readv(fd, iov, iovcnt)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by read() */
+            }
+
+            /* Interrupted by sig handler return, call read() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_EINTR, 1);
+            continue;
+        } else if (nread == 0) {
+            break; /* EOF */
+        } else if ((size_t)nread < nleft) {
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_SHORT_READS, 1);
+        }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, nread);
+        nleft -= (size_t)nread;
+
+        /* Skip what was filled */
+        while (iovcnt > 0 && (size_t)nread >= iov->iov_len) {
+            nread -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nread;
+            iov->iov_len -= (size_t)nread;
+        }
+    }
+    return (ssize_t)(n - nleft);
+}
+
+/*
+ * rio_readvn - Robustly read into iovcnt buffers (unbuffered)
+ *
+ * Like rio_readn, for the buffers of iov, filled in order. More than
+ * IOV_MAX buffers are read IOV_MAX at a time. Returns the number of bytes
+ * read, short only on EOF, or -1 on error.
+ */
+ssize_t rio_readvn(int fd, const struct iovec *iov, int iovcnt) {
+    struct iovec chunk[RIO_IOV_MAX];
+    size_t total = 0;
+    CSAPP_STAT_START(start);
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i += RIO_IOV_MAX) {
+        int n = iovcnt - i < RIO_IOV_MAX ? iovcnt - i : RIO_IOV_MAX;
+        size_t len = 0;
+        memcpy(chunk, iov + i, (size_t)n * sizeof(*chunk));
+        for (int j = 0; j < n; j++) {
+            len += chunk[j].iov_len;
+        }
+        ssize_t nread = rio_readv_all(fd, chunk, n);
+        if (nread < 0) {
+            CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READN, start);
+            return -1; /* errno set by read() */
+        }
+        total += (size_t)nread;
+        if ((size_t)nread < len) {
+            break; /* EOF */
+        }
+    }
+    CSAPP_STAT_RECORD(CSAPP_HIST_RIO_READN, start);
+    return (ssize_t)total; /* Return >= 0 */
+}
+
+/*
+ * rio_writevn - Robustly write iovcnt buffers (unbuffered)
+ *
+ * Like rio_writen, for the buffers of iov, written in order. More than
+ * IOV_MAX buffers are written IOV_MAX at a time. Returns the number of
+ * bytes written, or -1 on error.
+ */
+ssize_t rio_writevn(int fd, const struct iovec *iov, int iovcnt) {
+    struct iovec chunk[RIO_IOV_MAX];
+    size_t total = 0;
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i += RIO_IOV_MAX) {
+        int n = iovcnt - i < RIO_IOV_MAX ? iovcnt - i : RIO_IOV_MAX;
+        memcpy(chunk, iov + i, (size_t)n * sizeof(*chunk));
+        for (int j = 0; j < n; j++) {
+            total += chunk[j].iov_len;
+        }
+        if (rio_writev_all(fd, chunk, n, 0, 0) < 0) {
+            return -1; /* errno set by write() */
+        }
+    }
+    return (ssize_t)total;
+}
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer and reset
+ *    buffer. On Linux, writes to stream sockets are sent with MSG_MORE
+ *    whenever more bytes remain buffered after them, so that the kernel
+ *    coalesces them into full segments; the bytes sent by rio_flushb push
+ *    them out.
+ */
+void rio_writeinitb(rio_writer_t *wp, int fd) {
+    wp->rio_fd = fd;
+    wp->rio_cnt = 0;
+    wp->rio_off = 0;
+    wp->rio_more = 0;
+#ifdef MSG_MORE
+    struct stat st;
+    int type;
+    socklen_t len = sizeof(type);
+    if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode) &&
+        getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+        type == SOCK_STREAM) {
+        wp->rio_more = 1;
+    }
+#endif // MSG_MORE
+}
+
+/*
+ * rio_writeb - Robustly write n bytes (buffered)
+ *
+ * Writes that fit are only copied to the internal buffer. Otherwise the
+ * pending bytes and all of usrbuf but its last partial buffer are written
+ * at once with writev(), and that last part is kept buffered. Returns n, or
+ * -1 on error, in which case the pending bytes are dropped.
+ */
+ssize_t rio_writeb(rio_writer_t *wp, const void *usrbuf, size_t n) {
+    const char *bufp = usrbuf;
+    size_t space = sizeof(wp->rio_buf) - wp->rio_cnt;
+
+    if (n <= space) {
+        memcpy(wp->rio_buf + wp->rio_cnt, bufp, n);
+        wp->rio_cnt += n;
+        return (ssize_t)n;
+    }
+
+    /* Keep between 1 and RIO_BUFSIZE bytes, so that the next flush ends
+     * what is sent here with MSG_MORE */
+    size_t total = wp->rio_cnt + n;
+    size_t keep = (total - 1) % sizeof(wp->rio_buf) + 1;
+    struct iovec iov[2];
+    iov[0].iov_base = wp->rio_buf + wp->rio_off;
+    iov[0].iov_len = wp->rio_cnt - wp->rio_off;
+    iov[1].iov_base = (void *)bufp;
+    iov[1].iov_len = n - keep;
+    int flags = 0;
+#ifdef MSG_MORE
+    if (wp->rio_more) {
+        flags = MSG_MORE;
+    }
+#endif // MSG_MORE
+    int rc = rio_writev_all(wp->rio_fd, iov, 2, flags, wp->rio_more);
+    wp->rio_cnt = 0;
+    wp->rio_off = 0;
+    if (rc < 0) {
+        return -1;
+    }
+    memcpy(wp->rio_buf, bufp + n - keep, keep);
+    wp->rio_cnt = keep;
+    return (ssize_t)n;
+}
+
+/*
+ * rio_writelineb - Robustly write a null terminated string followed by a
+ *    newline (buffered). Returns the number of bytes written, or -1 on
+ *    error.
+ */
+ssize_t rio_writelineb(rio_writer_t *wp, const char *line) {
+    size_t len = strlen(line);
+    if (rio_writeb(wp, line, len) < 0 || rio_writeb(wp, "\n", 1) < 0) {
+        return -1;
+    }
+    return (ssize_t)len + 1;
+}
+
+/*
+ * rio_flushb - Robustly write the pending bytes (buffered). Returns 0, or
+ *    -1 on error, in which case the pending bytes are dropped.
+ */
+int rio_flushb(rio_writer_t *wp) {
+    struct iovec iov;
+    iov.iov_base = wp->rio_buf + wp->rio_off;
+    iov.iov_len = wp->rio_cnt - wp->rio_off;
+    int rc = rio_writev_all(wp->rio_fd, &iov, 1, 0, wp->rio_more);
+    wp->rio_cnt = 0;
+    wp->rio_off = 0;
+    return rc;
+}
+
+/*
+ * fd to fd copies
+ *
+ * Each rio_copy_* method copies up to len - *copied more bytes, adding them
+ * to *copied, and returns RIO_COPY_DONE once len bytes or EOF were reached,
+ * -1 on error, or RIO_COPY_UNSUPPORTED if the kernel refused a transfer for
+ * these descriptors, so that the next method copies the rest.
+ */
+#define RIO_COPY_DONE 0
+#define RIO_COPY_UNSUPPORTED 1
+/* Bytes moved by each splice() through a pipe, its default capacity */
+#define RIO_SPLICE_CHUNK 65536
+
+#ifdef __linux__
+/* rio_copy_refused - Whether errno says a method does not apply */
+static bool rio_copy_refused(void) {
+    return errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+           errno == EOPNOTSUPP || errno == EBADF || errno == ESPIPE;
+}
+
+/* rio_copy_range - Copy between regular files inside the kernel */
+static int rio_copy_range(int out, int in, off_t *offset, size_t len,
+                          size_t *copied) {
+    bool first = true;
+    while (*copied < len) {
+        ssize_t n = copy_file_range(in, offset, out, NULL, len - *copied, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return first && rio_copy_refused() ? RIO_COPY_UNSUPPORTED : -1;
+        } else if (n == 0) {
+            break; /* EOF */
+        }
+        first = false;
+        *copied += (size_t)n;
+    }
+    return RIO_COPY_DONE;
+}
+
+/* rio_copy_sendfile - Copy from a regular file to any descriptor */
+static int rio_copy_sendfile(int out, int in, off_t *offset, size_t len,
+                             size_t *copied) {
+    bool first = true;
+    while (*copied < len) {
+        ssize_t n = sendfile(out, in, offset, len - *copied);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return first && rio_copy_refused() ? RIO_COPY_UNSUPPORTED : -1;
+        } else if (n == 0) {
+            break; /* EOF */
+        }
+        first = false;
+        *copied += (size_t)n;
+    }
+    return RIO_COPY_DONE;
+}
+
+/*
+ * rio_splice_all - Move *n bytes from a pipe to out, counting them down in
+ *    *n. Returns 0, or -1 with the bytes not moved left in the pipe.
+ */
+static int rio_splice_all(int out, int pipe_in, size_t *n) {
+    while (*n > 0) {
+        ssize_t m = splice(pipe_in, NULL, out, NULL, *n,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (m < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *n -= (size_t)m;
+    }
+    return 0;
+}
+
+/* rio_drain_pipe - Write the n bytes left in a pipe to out */
+static int rio_drain_pipe(int out, int pipe_in, size_t n) {
+    char buf[RIO_BUFSIZE];
+    while (n > 0) {
+        ssize_t m = read(pipe_in, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (m < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1; /* errno set by read() */
+        }
+        if (rio_writen(out, buf, (size_t)m) < 0) {
+            return -1; /* errno set by write() */
+        }
+        n -= (size_t)m;
+    }
+    return 0;
+}
+
+/* rio_copy_splice - Copy when either end is a pipe, or through a pipe */
+static int rio_copy_splice(int out, int in, bool in_pipe, bool out_pipe,
+                           off_t *offset, size_t len, size_t *copied) {
+    int fds[2] = {-1, -1};
+    int rc = RIO_COPY_DONE;
+    bool first = true;
+
+    if (!in_pipe && !out_pipe && pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    while (*copied < len) {
+        size_t chunk = len - *copied;
+        if (fds[1] >= 0 && chunk > RIO_SPLICE_CHUNK) {
+            chunk = RIO_SPLICE_CHUNK;
+        }
+        ssize_t n = splice(in, in_pipe ? NULL : offset,
+                           fds[1] >= 0 ? fds[1] : out, NULL, chunk,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = first && rio_copy_refused() ? RIO_COPY_UNSUPPORTED : -1;
+            break;
+        } else if (n == 0) {
+            break; /* EOF */
+        }
+        first = false;
+        size_t left = (size_t)n;
+        if (fds[0] >= 0 && rio_splice_all(out, fds[0], &left) < 0) {
+            /* in was drained: write its bytes out of the pipe instead */
+            if (!rio_copy_refused() || rio_drain_pipe(out, fds[0], left) < 0) {
+                rc = -1;
+                break;
+            }
+            rc = RIO_COPY_UNSUPPORTED;
+        }
+        *copied += (size_t)n;
+        if (rc == RIO_COPY_UNSUPPORTED) {
+            break;
+        }
+    }
+    if (fds[0] >= 0) {
+        int saved = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved;
+    }
+    return rc;
+}
+#endif // __linux__
+
+/* rio_copy_rw - Copy through a user buffer, with read() and rio_writen() */
+static int rio_copy_rw(int out, int in, off_t *offset, size_t len,
+                       size_t *copied) {
+    char buf[RIO_BUFSIZE];
+    while (*copied < len) {
+        size_t chunk = len - *copied;
+        if (chunk > sizeof(buf)) {
+            chunk = sizeof(buf);
+        }
+        ssize_t n = offset != NULL ? pread(in, buf, chunk, *offset)
+                                   : read(in, buf, chunk);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1; /* errno set by read() */
+        } else if (n == 0) {
+            break; /* EOF */
+        }
+        if (rio_writen(out, buf, (size_t)n) < 0) {
+            return -1; /* errno set by write() */
+        }
+        if (offset != NULL) {
+            *offset += n;
+        }
+        *copied += (size_t)n;
+    }
+    return RIO_COPY_DONE;
+}
+
+/*
+ * rio_copyfd - Robustly copy len bytes from in to out (unbuffered)
+ *
+ * The bytes are read at *offset, which is then advanced, or at the file
+ * offset of in if offset is NULL. On Linux they are copied inside the
+ * kernel: with copy_file_range() between regular files, sendfile() from a
+ * regular file, and splice() otherwise, directly when one end is a pipe or
+ * through a pipe. Copies the kernel refuses go through a user buffer.
+ * Returns the number of bytes copied, short only on EOF, or -1 on error.
+ */
+ssize_t rio_copyfd(int out, int in, off_t *offset, size_t len) {
+    size_t copied = 0;
+    int rc = RIO_COPY_UNSUPPORTED;
+
+#ifdef __linux__
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0) {
+        return -1; /* errno set by fstat() */
+    }
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        rc = rio_copy_range(out, in, offset, len, &copied);
+    }
+    if (rc == RIO_COPY_UNSUPPORTED && S_ISREG(in_st.st_mode)) {
+        rc = rio_copy_sendfile(out, in, offset, len, &copied);
+    }
+    /* splice() refuses files in append mode, after draining in */
+    bool append = S_ISREG(out_st.st_mode) && (fcntl(out, F_GETFL) & O_APPEND);
+    if (rc == RIO_COPY_UNSUPPORTED && !append) {
+        rc = rio_copy_splice(out, in, S_ISFIFO(in_st.st_mode),
+                             S_ISFIFO(out_st.st_mode), offset, len, &copied);
+    }
+#endif // __linux__
+    if (rc == RIO_COPY_UNSUPPORTED) {
+        rc = rio_copy_rw(out, in, offset, len, &copied);
+    }
+    return rc < 0 ? -1 : (ssize_t)copied;
+}
+
+/*
+ * rio_copyfdb - Robustly copy len bytes from rp to out (buffered)
+ *
+ * The bytes already in the internal buffer of rp are written first, then
+ * the rest is copied from its descriptor with rio_copyfd. Files read with
+ * rio_readinitb_mmap are written straight from their mapping, and prefetched
+ * ones from their buffers. Returns the number of bytes copied, short only on
+ * EOF, or -1 on error.
+ */
+ssize_t rio_copyfdb(int out, rio_t *rp, size_t len) {
+    size_t copied = 0;
+    ssize_t rc;
+
+    while (copied < len &&
+           (rp->rio_cnt > 0 || rp->rio_flags & (RIO_FILE_MAP | RIO_PREFETCH))) {
+        if ((rc = rio_fill(rp)) < 0) {
+            return -1; /* errno set by fstat() or mmap() */
+        } else if (rc == 0) {
+            return (ssize_t)copied; /* EOF */
+        }
+        size_t n = len - copied;
+        if ((size_t)rp->rio_cnt < n) {
+            n = (size_t)rp->rio_cnt;
+        }
+        if (rio_writen(out, rp->rio_bufptr, n) < 0) {
+            return -1; /* errno set by write() */
+        }
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= (ssize_t)n;
+        copied += n;
+    }
+    if (copied < len) {
+        if ((rc = rio_copyfd(out, rp->rio_fd, NULL, len - copied)) < 0) {
+            return -1;
+        }
+        copied += (size_t)rc;
+    }
+    return (ssize_t)copied;
+}
+
+/*
+ * Non-blocking I/O
+ *
+ * The _nb functions are for descriptors with O_NONBLOCK, polled by an event
+ * loop. Where the functions above would wait, they return RIO_AGAIN, keeping
+ * their progress so that the same call can be repeated once the descriptor
+ * is ready: in *done for unbuffered transfers, in the rio_t or rio_writer_t
+ * for buffered ones.
+ */
+
+/* rio_would_block - Whether errno says the descriptor is not ready */
+static bool rio_would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * rio_readn_nb - Read n bytes (unbuffered, non-blocking), resuming after
+ *    the *done bytes of usrbuf already read. *done counts the bytes read.
+ *    Returns *done once it reaches n or on EOF, RIO_AGAIN if the descriptor
+ *    has nothing more to read for now, or -1 on error.
+ */
+ssize_t rio_readn_nb(int fd, void *usrbuf, size_t n, size_t *done) {
+    char *bufp = usrbuf;
+    ssize_t nread;
+
+    while (*done < n) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READS, 1);
+        if ((nread = read(fd, bufp + *done, n - *done)) < 0) {
+            if (errno != EINTR) {
+                return rio_would_block() ? RIO_AGAIN : -1;
+            }
+
+            /* Interrupted by sig handler return, call read() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_EINTR, 1);
+            continue;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_READ_BYTES, nread);
+        *done += (size_t)nread;
+    }
+    return (ssize_t)*done;
+}
+
+/*
+ * rio_writen_nb - Write n bytes (unbuffered, non-blocking), resuming after
+ *    the *done bytes of usrbuf already written. *done counts the bytes
+ *    written. Returns n once they all are, RIO_AGAIN if the descriptor
+ *    accepts nothing more for now, or -1 on error.
+ */
+ssize_t rio_writen_nb(int fd, const void *usrbuf, size_t n, size_t *done) {
+    const char *bufp = usrbuf;
+    ssize_t nwritten;
+
+    while (*done < n) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITES, 1);
+        if ((nwritten = write(fd, bufp + *done, n - *done)) < 0) {
+            if (errno != EINTR) {
+                return rio_would_block() ? RIO_AGAIN : -1;
+            }
+
+            /* Interrupted by sig handler return, call write() again */
+            CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_EINTR, 1);
+            continue;
+        }
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_BYTES, nwritten);
+        *done += (size_t)nwritten;
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * rio_readnb_nb - Read n bytes (buffered, non-blocking), resuming after the
+ *    *done bytes of usrbuf already read. *done counts the bytes read.
+ *    Returns *done once it reaches n or on EOF, RIO_AGAIN if the descriptor
+ *    has nothing more to read for now, or -1 on error.
+ */
+ssize_t rio_readnb_nb(rio_t *rp, void *usrbuf, size_t n, size_t *done) {
+    char *bufp = usrbuf;
+    ssize_t nread;
+
+    while (*done < n) {
+        if ((nread = rio_read(rp, bufp + *done, n - *done)) < 0) {
+            return rio_would_block() ? RIO_AGAIN : -1;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        *done += (size_t)nread;
+    }
+    return (ssize_t)*done;
+}
+
+/*
+ * rio_readline_nb - Read a text line without copying it (buffered,
+ *    non-blocking)
+ *
+ * Like rio_readline_view, but returns RIO_AGAIN when the line is not
+ * complete yet and the descriptor has nothing more to read for now. The
+ * partial line stays in the internal buffer, and the next call returns it
+ * whole. rio_readlineb would instead drop the part it copied.
+ */
+ssize_t rio_readline_nb(rio_t *rp, rio_line_t *line) {
+    ssize_t rc = rio_readline_view(rp, line);
+    if (rc < 0 && rio_would_block()) {
+        return RIO_AGAIN; /* Nothing was consumed */
+    }
+    return rc;
+}
+
+/*
+ * rio_writev_once - Write the iovcnt buffers of iov with a single
+ *    writev(), or sendmsg() on sockets, retried if interrupted. Returns the
+ *    number of bytes written, or -1 on error.
+ */
+static ssize_t rio_writev_once(rio_writer_t *wp, struct iovec *iov,
+                               int iovcnt) {
+    ssize_t nwritten;
+
+    for (;;) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITES, 1);
+        if (wp->rio_more) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)iovcnt;
+            nwritten = sendmsg(wp->rio_fd, &msg, 0);
+        } else {
+            nwritten = writev(wp->rio_fd, iov, iovcnt);
+        }
+        if (nwritten >= 0 || errno != EINTR) {
+            break;
+        }
+
+        /* Interrupted by sig handler return, call write() again */
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_EINTR, 1);
+    }
+    if (nwritten > 0) {
+        CSAPP_STAT_ADD(CSAPP_STAT_RIO_WRITE_BYTES, nwritten);
+    }
+    return nwritten;
+}
+
+/*
+ * rio_writeb_nb - Write up to n bytes (buffered, non-blocking)
+ *
+ * Bytes that fit are only copied to the internal buffer. Otherwise the
+ * pending bytes and usrbuf are written with one writev(), as much as the
+ * descriptor accepts, and what then fits is buffered. Returns the number of
+ * bytes of usrbuf taken, written or buffered, RIO_AGAIN if none could be,
+ * or -1 on error, in which case the pending bytes are dropped. Sockets are
+ * not sent MSG_MORE hints, since nothing may follow before the event loop
+ * calls rio_flushb_nb.
+ */
+ssize_t rio_writeb_nb(rio_writer_t *wp, const void *usrbuf, size_t n) {
+    const char *bufp = usrbuf;
+    size_t done = 0;
+
+    if (n > sizeof(wp->rio_buf) - wp->rio_cnt) {
+        size_t pending = wp->rio_cnt - wp->rio_off;
+        struct iovec iov[2];
+        iov[0].iov_base = wp->rio_buf + wp->rio_off;
+        iov[0].iov_len = pending;
+        iov[1].iov_base = (void *)bufp;
+        iov[1].iov_len = n;
+        ssize_t nwritten = rio_writev_once(wp, iov, 2);
+        if (nwritten < 0) {
+            if (!rio_would_block()) {
+                wp->rio_cnt = 0;
+                wp->rio_off = 0;
+                return -1; /* errno set by write() */
+            }
+            nwritten = 0;
+        }
+        if ((size_t)nwritten < pending) {
+            wp->rio_off += (size_t)nwritten;
+        } else {
+            done = (size_t)nwritten - pending;
+            wp->rio_cnt = 0;
+            wp->rio_off = 0;
+        }
+    }
+
+    size_t cnt = n - done;
+    if (wp->rio_off > 0 && cnt > sizeof(wp->rio_buf) - wp->rio_cnt) {
+        /* Move the pending bytes to the start of the buffer */
+        wp->rio_cnt -= wp->rio_off;
+        memmove(wp->rio_buf, wp->rio_buf + wp->rio_off, wp->rio_cnt);
+        wp->rio_off = 0;
+    }
+    if (cnt > sizeof(wp->rio_buf) - wp->rio_cnt) {
+        cnt = sizeof(wp->rio_buf) - wp->rio_cnt;
+    }
+    memcpy(wp->rio_buf + wp->rio_cnt, bufp + done, cnt);
+    wp->rio_cnt += cnt;
+    done += cnt;
+    return done > 0 || n == 0 ? (ssize_t)done : RIO_AGAIN;
+}
+
+/*
+ * rio_flushb_nb - Write the pending bytes (buffered, non-blocking). Returns
+ *    0 once they all are, RIO_AGAIN if the descriptor accepts nothing more
+ *    for now and some are left, or -1 on error, in which case the pending
+ *    bytes are dropped.
+ */
+int rio_flushb_nb(rio_writer_t *wp) {
+    while (wp->rio_off < wp->rio_cnt) {
+        struct iovec iov;
+        iov.iov_base = wp->rio_buf + wp->rio_off;
+        iov.iov_len = wp->rio_cnt - wp->rio_off;
+        ssize_t nwritten = rio_writev_once(wp, &iov, 1);
+        if (nwritten < 0) {
+            if (rio_would_block()) {
+                return RIO_AGAIN;
+            }
+            wp->rio_cnt = 0;
+            wp->rio_off = 0;
+            return -1; /* errno set by write() */
+        }
+        wp->rio_off += (size_t)nwritten;
+    }
+    wp->rio_cnt = 0;
+    wp->rio_off = 0;
+    return 0;
 }
 
 /********************************
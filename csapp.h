@@ -41,9 +41,12 @@
 #include <stdarg.h>    /* va_list */
 #include <stddef.h>    /* size_t */
 #include <sys/types.h> /* ssize_t */
+#include <sys/uio.h>   /* struct iovec */
 
 // CONFIG
 #define CSAPP_HAS_DTOA
+// Define CSAPP_HAS_STATS when building csapp.c to enable the counters and
+// latency histograms of csapp_stats.h
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 #define DEF_MODE S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH
@@ -55,8 +58,47 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     ssize_t rio_cnt;           /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_bufstart;        /* Internal buf, rio_buf or a larger one */
+    size_t rio_bufsize;        /* Size of the internal buf */
+    size_t rio_bufmax;         /* Largest size of an adaptive buf, else 0 */
+    int rio_streak;            /* Adaptive: > 0 full reads, < 0 small ones */
+    unsigned int rio_flags;    /* How rio_bufstart was allocated */
+    off_t rio_mapoff;          /* Mapped files: offset of rio_bufstart */
+    void *rio_ahead;           /* Prefetch: state shared with the thread */
+    char rio_buf[RIO_BUFSIZE]; /* Default internal buffer */
 } rio_t;
+/* Buffers of rio_readinitb_sized from this size on use huge pages if possible */
+#define RIO_HUGE_BUFSIZE (2 << 20)
+/* Default size of the part of a file rio_readinitb_mmap maps at once */
+#define RIO_MMAP_WINDOW (64 << 20)
+/* Default size and number of the buffers of rio_readinitb_prefetch */
+#define RIO_PREFETCH_BUFSIZE (256 << 10)
+#define RIO_PREFETCH_BUFS 4
+
+/* Persistent state for buffered writes */
+typedef struct {
+    int rio_fd;                /* Descriptor for this internal buf */
+    size_t rio_cnt;            /* End of the pending bytes in internal buf */
+    size_t rio_off;            /* Start of the pending bytes in internal buf */
+    int rio_more;              /* Socket accepting MSG_MORE hints */
+    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+} rio_writer_t;
+
+/* Returned by the _nb functions when a non-blocking descriptor is not ready */
+#define RIO_AGAIN (-2)
+
+/* A line inside the internal buffer of a rio_t, not null terminated */
+typedef struct {
+    const char *data; /* Valid until the next call on the rio_t */
+    size_t len;       /* Including the '\n', if any */
+} rio_line_t;
+
+/* Length prefixed frames of rio_readframe */
+typedef struct {
+    unsigned int width; /* Bytes of the length prefix, 1 to 8 */
+    int little_endian;  /* Byte order of the prefix, big endian if 0 */
+    size_t max_len;     /* Longest frame body accepted */
+} rio_framing_t;
 
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
@@ -84,14 +126,49 @@ ssize_t sio_snprintf(char *str, size_t size, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
 ssize_t sio_vsnprintf(char *str, size_t size, const char *fmt, va_list argp)
     __attribute__((format(printf, 3, 0)));
+ssize_t sio_snprintf_trunc(char *str, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+ssize_t sio_vsnprintf_trunc(char *str, size_t size, const char *fmt,
+                            va_list argp) __attribute__((format(printf, 3, 0)));
 
 typedef ssize_t (*sio_output_function)(void *, char, size_t, size_t, const char *,
                                        size_t);
+/* Returned by output functions that are full, to stop formatting early */
+#define SIO_OUTPUT_FULL ((ssize_t)-2)
 ssize_t sio_format(sio_output_function output, void *output_state,
                    const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 ssize_t sio_vformat(sio_output_function output, void *output_state,
                     const char *fmt, va_list argp)
     __attribute__((format(printf, 3, 0)));
+/* Reserve/commit sinks, formatting straight into the destination memory.
+ * reserve returns at least len contiguous writable bytes, or NULL to use
+ * output instead; commit publishes len bytes of the last reservation and
+ * returns len or a negative error, like an output function. */
+typedef struct {
+    char *(*reserve)(void *state, size_t len);
+    ssize_t (*commit)(void *state, size_t len);
+    sio_output_function output;
+    void *state;
+} sio_sink_t;
+/* Adapter for sinks that only have an output function */
+#define SIO_OUTPUT_SINK(output, state) {NULL, NULL, (output), (state)}
+ssize_t sio_format_sink(const sio_sink_t *sink, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t sio_vformat_sink(const sio_sink_t *sink, const char *fmt, va_list argp)
+    __attribute__((format(printf, 2, 0)));
+ssize_t sio_format_measure(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+ssize_t sio_vformat_measure(const char *fmt, va_list argp)
+    __attribute__((format(printf, 1, 0)));
+
+/*
+ * Extension conversions, used as %p followed by an upper case letter. A
+ * precision with them makes format checking warn, see sio_vdprintf.
+ */
+typedef ssize_t (*sio_conversion_function)(sio_output_function output,
+                                           void *output_state, const void *arg,
+                                           int padding, int precision);
+int sio_register_conversion(char suffix, sio_conversion_function conv);
 
 typedef struct {
     int fileno;
@@ -108,6 +185,50 @@ typedef struct {
 ssize_t sio_buffer_output(void *state, char padding, size_t count_left, size_t count_right,
                           const char *data, size_t len);
 
+/* A buffer that stops the formatting with SIO_OUTPUT_FULL once full */
+typedef struct {
+    sio_buffer_output_t buffer; /* First, so the buffer sink functions apply */
+} sio_buffer_trunc_output_t;
+
+ssize_t sio_buffer_trunc_output(void *state, char padding, size_t count_left,
+                                size_t count_right, const char *data,
+                                size_t len);
+char *sio_buffer_reserve(void *state, size_t len);
+ssize_t sio_buffer_commit(void *state, size_t len);
+
+/* JSON escaping output, wraps another output function */
+typedef struct {
+    sio_output_function output;
+    void *output_state;
+} sio_json_output_t;
+
+ssize_t sio_json_output(void *state, char padding, size_t count_left,
+                        size_t count_right, const char *data, size_t len);
+
+/* Structured JSON records, emitted in one pass as {"key":value,...} */
+typedef struct {
+    sio_output_function output;
+    void *output_state;
+    ssize_t written; /* Bytes written so far, or -1 after an error */
+    size_t fields;   /* Number of fields already written */
+} sio_json_record_t;
+
+ssize_t sio_json_begin(sio_json_record_t *rec, sio_output_function output,
+                       void *output_state);
+ssize_t sio_json_add_string(sio_json_record_t *rec, const char *key,
+                            const char *value);
+ssize_t sio_json_add_format(sio_json_record_t *rec, const char *key,
+                            const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+ssize_t sio_json_add_int(sio_json_record_t *rec, const char *key,
+                         long long value);
+ssize_t sio_json_add_uint(sio_json_record_t *rec, const char *key,
+                          unsigned long long value);
+ssize_t sio_json_add_double(sio_json_record_t *rec, const char *key,
+                            double value, int precision);
+ssize_t sio_json_add_bool(sio_json_record_t *rec, const char *key, int value);
+ssize_t sio_json_end(sio_json_record_t *rec);
+
 #define sio_assert(expr)                                                       \
     ((expr) ? (void)0 : __sio_assert_fail(#expr, __FILE__, __LINE__, __func__))
 
@@ -118,9 +239,35 @@ void __sio_assert_fail(const char *assertion, const char *file,
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
+ssize_t rio_readvn(int fd, const struct iovec *iov, int iovcnt);
+ssize_t rio_writevn(int fd, const struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd);
+int rio_readinitb_sized(rio_t *rp, int fd, void *buf, size_t size);
+int rio_readinitb_adaptive(rio_t *rp, int fd, size_t max_size);
+int rio_readinitb_mmap(rio_t *rp, int fd, size_t window);
+int rio_readinitb_prefetch(rio_t *rp, int fd, size_t size,
+                           unsigned int nbufs);
+void rio_freeb(rio_t *rp);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_writeinitb(rio_writer_t *wp, int fd);
+ssize_t rio_writeb(rio_writer_t *wp, const void *usrbuf, size_t n);
+ssize_t rio_writelineb(rio_writer_t *wp, const char *line);
+int rio_flushb(rio_writer_t *wp);
+ssize_t rio_readline_view(rio_t *rp, rio_line_t *line);
+ssize_t rio_readlines_view(rio_t *rp, rio_line_t *lines, size_t max);
+ssize_t rio_readframe(rio_t *rp, const rio_framing_t *framing, void *usrbuf,
+                      rio_line_t *frame);
+ssize_t rio_readuntil(rio_t *rp, const void *delim, size_t dlen, void *usrbuf,
+                      size_t maxlen, rio_line_t *record);
+ssize_t rio_copyfd(int out, int in, off_t *offset, size_t len);
+ssize_t rio_copyfdb(int out, rio_t *rp, size_t len);
+ssize_t rio_readn_nb(int fd, void *usrbuf, size_t n, size_t *done);
+ssize_t rio_writen_nb(int fd, const void *usrbuf, size_t n, size_t *done);
+ssize_t rio_readnb_nb(rio_t *rp, void *usrbuf, size_t n, size_t *done);
+ssize_t rio_readline_nb(rio_t *rp, rio_line_t *line);
+ssize_t rio_writeb_nb(rio_writer_t *wp, const void *usrbuf, size_t n);
+int rio_flushb_nb(rio_writer_t *wp);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(const char *hostname, const char *port);
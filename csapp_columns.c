@@ -0,0 +1,343 @@
+/**
+ * @file csapp_columns.c
+ * @brief Bulk CSV/TSV formatting of column arrays, see csapp_columns.h
+ *
+ * Rows are formatted into a block: memory reserved from the sink when it can
+ * reserve a whole block, a local buffer otherwise. A full block is committed
+ * or written with a single call to the sink.
+ *
+ * The parallel variant starts its threads once. Thread i formats chunks i,
+ * i + threads, ... into its own growing buffer, then waits for the turn of its
+ * chunk to write it, so that formatting the next chunks overlaps writing.
+ * When the digit memo is compiled in (CSAPP_DTOA_CACHE_SIZE), it is per
+ * thread, and each worker keeps its own warm across its chunks.
+ */
+
+#include "csapp.h"
+#include "csapp_columns.h"
+#include "csapp_dtoa.h"
+#include "csapp_private.h"
+
+#include <pthread.h> /* pthread_create() */
+#include <stdbool.h> /* bool */
+#include <stdint.h>  /* int64_t */
+#include <stdlib.h>  /* realloc() */
+#include <string.h>  /* memcpy() */
+
+/* A sign and 20 digits for 64 bit integers */
+#define COLUMNS_INTEGER_LEN 21
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    const sio_sink_t *sink; /* Flushed into when full, NULL to grow instead */
+    bool reserved;          /* data was reserved from the sink */
+    char *local;            /* Block used when the sink reserves nothing */
+    ssize_t written;        /* Bytes flushed into the sink */
+    ssize_t error;          /* Last error of an output, 0 if none */
+} columns_buffer_t;
+
+/* columns_next_block - Start a block, reserved from the sink if possible */
+static void columns_next_block(columns_buffer_t *b) {
+    const sio_sink_t *sink = b->sink;
+    char *block = NULL;
+    if (sink->reserve != NULL) {
+        block = sink->reserve(sink->state, SIO_COLUMNS_BLOCK);
+    }
+    b->reserved = block != NULL;
+    b->data = b->reserved ? block : b->local;
+    b->size = SIO_COLUMNS_BLOCK;
+    b->len = 0;
+}
+
+/* columns_flush - Hand the block to the sink */
+static ssize_t columns_flush(columns_buffer_t *b) {
+    const sio_sink_t *sink = b->sink;
+    if (b->len == 0) {
+        return 0;
+    }
+    ssize_t ret;
+    if (b->reserved) {
+        ret = sink->commit(sink->state, b->len);
+    } else {
+        ret = sink->output(sink->state, ' ', 0, 0, b->data, b->len);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    b->written += (ssize_t)b->len;
+    b->len = 0;
+    return 0;
+}
+
+/*
+ * columns_room - Make room for len more bytes. Returns 1 if len exceeds a
+ *    block: the block was flushed, and the next one is only started once
+ *    the bytes were written directly to the sink.
+ */
+static ssize_t columns_room(columns_buffer_t *b, size_t len) {
+    if (b->size - b->len >= len) {
+        return 0;
+    }
+    if (b->sink == NULL) {
+        size_t size = b->size > 0 ? 2 * b->size : SIO_COLUMNS_BLOCK;
+        while (size - b->len < len) {
+            size *= 2;
+        }
+        char *data = realloc(b->data, size);
+        if (data == NULL) {
+            return -1;
+        }
+        b->data = data;
+        b->size = size;
+        return 0;
+    }
+    ssize_t ret = columns_flush(b);
+    if (ret < 0) {
+        return ret;
+    }
+    if (len > SIO_COLUMNS_BLOCK) {
+        return 1; // Written directly, no reservation may be open meanwhile
+    }
+    columns_next_block(b);
+    return 0;
+}
+
+/* columns_output - Output function appending to a columns_buffer_t */
+static ssize_t columns_output(void *state, char padding, size_t count_left,
+                              size_t count_right, const char *data,
+                              size_t len) {
+    columns_buffer_t *b = state;
+    size_t total = count_left + len + count_right;
+    ssize_t ret = columns_room(b, total);
+    if (ret == 1) {
+        // Larger than a block, the block was flushed
+        ret = b->sink->output(b->sink->state, padding, count_left, count_right,
+                              data, len);
+        if (ret >= 0) {
+            b->written += ret;
+        }
+        columns_next_block(b);
+    } else if (ret == 0) {
+        char *s = b->data + b->len;
+        memset(s, padding, count_left);
+        if (len > 0) {
+            memcpy(s + count_left, data, len);
+        }
+        memset(s + count_left + len, padding, count_right);
+        b->len += total;
+        ret = (ssize_t)total;
+    }
+    if (ret < 0) {
+        b->error = ret;
+    }
+    return ret;
+}
+
+/* columns_format_rows - Format rows [first, end) into b */
+static ssize_t columns_format_rows(columns_buffer_t *b,
+                                   const sio_column_t *columns,
+                                   size_t ncolumns, size_t first, size_t end,
+                                   char delimiter) {
+    for (size_t row = first; row < end; row++) {
+        for (size_t c = 0; c < ncolumns; c++) {
+            const sio_column_t *column = &columns[c];
+            ssize_t ret;
+            if (column->type == SIO_COLUMN_DOUBLE) {
+                double d = ((const double *)column->values)[row];
+                ret = sio_format_double_exact(columns_output, b, d, FORMAT_f,
+                                              0, column->precision);
+                if (ret < 0) {
+                    return b->error < 0 ? b->error : ret;
+                }
+            } else {
+                ret = columns_room(b, COLUMNS_INTEGER_LEN);
+                if (ret < 0) {
+                    return ret;
+                }
+                char *s = b->data + b->len;
+                uint64_t magnitude;
+                if (column->type == SIO_COLUMN_INT64) {
+                    int64_t v = ((const int64_t *)column->values)[row];
+                    magnitude = (uint64_t)v;
+                    if (v < 0) {
+                        *s++ = '-';
+                        b->len++;
+                        magnitude = -magnitude;
+                    }
+                } else {
+                    magnitude = ((const uint64_t *)column->values)[row];
+                }
+                b->len += sio_uint64_to_decimal(magnitude, s);
+            }
+            ret = columns_room(b, 1);
+            if (ret < 0) {
+                return ret;
+            }
+            b->data[b->len++] = c + 1 < ncolumns ? delimiter : '\n';
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief   Writes rows of column arrays as delimited text.
+ * @param sink        Where the text goes, see sio_format_sink.
+ * @param columns     The columns, each holding one value per row.
+ * @param ncolumns    The number of columns.
+ * @param rows        The number of rows.
+ * @param delimiter   Written between the values of a row, ',' for CSV or
+ *                    '\t' for TSV. Each row ends with '\n'.
+ * @return            The number of bytes written, or the negative value the
+ *                    sink failed with (SIO_OUTPUT_FULL included).
+ *
+ * Values are not quoted: integers and doubles never contain the delimiter.
+ *
+ * @remark   This function is async-signal-safe.
+ */
+ssize_t sio_format_columns(const sio_sink_t *sink, const sio_column_t *columns,
+                           size_t ncolumns, size_t rows, char delimiter) {
+    char local[SIO_COLUMNS_BLOCK];
+    columns_buffer_t b = {NULL, 0, 0, sink, false, local, 0, 0};
+    columns_next_block(&b);
+    ssize_t ret = columns_format_rows(&b, columns, ncolumns, 0, rows, delimiter);
+    if (ret == 0) {
+        ret = columns_flush(&b);
+    }
+    return ret < 0 ? ret : b.written;
+}
+
+typedef struct {
+    const sio_sink_t *sink;
+    const sio_column_t *columns;
+    size_t ncolumns;
+    size_t rows;
+    char delimiter;
+    size_t threads; /* Workers actually running */
+    bool started;   /* threads is final */
+    size_t turn;    /* Next chunk to write */
+    ssize_t written;
+    ssize_t error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} columns_job_t;
+
+typedef struct {
+    columns_job_t *job;
+    size_t index;
+    pthread_t thread;
+} columns_worker_t;
+
+/* columns_worker - Format every threads-th chunk, write them in turn */
+static void *columns_worker(void *arg) {
+    columns_worker_t *w = arg;
+    columns_job_t *job = w->job;
+    columns_buffer_t b = {NULL, 0, 0, NULL, false, NULL, 0, 0};
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->started) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    size_t threads = job->threads;
+    pthread_mutex_unlock(&job->lock);
+
+    size_t chunks =
+        (job->rows + SIO_COLUMNS_CHUNK_ROWS - 1) / SIO_COLUMNS_CHUNK_ROWS;
+    for (size_t chunk = w->index; chunk < chunks; chunk += threads) {
+        size_t first = chunk * SIO_COLUMNS_CHUNK_ROWS;
+        size_t end = first + SIO_COLUMNS_CHUNK_ROWS;
+        if (end > job->rows) {
+            end = job->rows;
+        }
+        b.len = 0;
+        ssize_t ret = columns_format_rows(&b, job->columns, job->ncolumns,
+                                          first, end, job->delimiter);
+
+        pthread_mutex_lock(&job->lock);
+        while (job->turn != chunk && job->error == 0) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if (job->error == 0 && ret == 0 && b.len > 0) {
+            ret = job->sink->output(job->sink->state, ' ', 0, 0, b.data,
+                                    b.len);
+            if (ret >= 0) {
+                job->written += ret;
+            }
+        }
+        if (job->error == 0 && ret < 0) {
+            job->error = ret;
+        }
+        job->turn++;
+        bool stop = job->error != 0;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+        if (stop) {
+            break;
+        }
+    }
+    free(b.data);
+    return NULL;
+}
+
+/**
+ * @brief   Writes rows of column arrays as delimited text, formatted by
+ *          several threads.
+ * @param threads   The number of threads formatting, the calling one
+ *                  included.
+ * @return          The number of bytes written, or the negative value the
+ *                  sink or the formatting failed with, -1 with errno set if
+ *                  memory ran out.
+ * @see     sio_format_columns
+ *
+ * The output is the same as sio_format_columns's, each chunk of
+ * SIO_COLUMNS_CHUNK_ROWS rows going to the sink with a single output call.
+ * The sink is only used by one thread at a time.
+ */
+ssize_t sio_format_columns_parallel(const sio_sink_t *sink,
+                                    const sio_column_t *columns,
+                                    size_t ncolumns, size_t rows,
+                                    char delimiter, unsigned int threads) {
+    if (threads <= 1 || rows <= SIO_COLUMNS_CHUNK_ROWS) {
+        return sio_format_columns(sink, columns, ncolumns, rows, delimiter);
+    }
+    columns_worker_t *workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+    columns_job_t job = {.sink = sink,
+                         .columns = columns,
+                         .ncolumns = ncolumns,
+                         .rows = rows,
+                         .delimiter = delimiter,
+                         .threads = 1};
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // Workers wait until we know how many of them could be started, since
+    // it decides which chunks each of them formats
+    for (size_t i = 1; i < threads; i++) {
+        workers[job.threads].job = &job;
+        workers[job.threads].index = job.threads;
+        if (pthread_create(&workers[job.threads].thread, NULL, columns_worker,
+                           &workers[job.threads]) == 0) {
+            job.threads++;
+        }
+    }
+    pthread_mutex_lock(&job.lock);
+    job.started = true;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+
+    workers[0].job = &job;
+    workers[0].index = 0;
+    columns_worker(&workers[0]);
+    for (size_t i = 1; i < job.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    free(workers);
+    return job.error < 0 ? job.error : job.written;
+}
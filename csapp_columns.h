@@ -0,0 +1,50 @@
+/**
+ * @file csapp_columns.h
+ * @brief Bulk CSV/TSV formatting of column arrays
+ *
+ * Dumping a large result set with one sio_snprintf per row parses the format
+ * string, fetches each value with va_arg and calls the output function a
+ * handful of times for every row. sio_format_columns instead takes the
+ * columns as typed arrays: the type, precision and delimiters are decided
+ * once, integers are written straight into a block buffer, doubles go through
+ * sio_format_double_exact, and the sink only sees whole blocks. Built with
+ * CSAPP_DTOA_CACHE_SIZE, repeated doubles also hit the digit memo of
+ * csapp_dtoa.h; otherwise each double is converted on its own.
+ *
+ * sio_format_columns_parallel splits the rows into chunks formatted by
+ * several threads, and writes the chunks to the sink in order.
+ */
+
+#ifndef CSAPP_COLUMNS_H
+#define CSAPP_COLUMNS_H
+
+#include "csapp.h"
+
+#include <stddef.h>    /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+/* Bytes formatted before they are handed to the sink */
+#define SIO_COLUMNS_BLOCK 16384
+/* Rows in each chunk of sio_format_columns_parallel */
+#define SIO_COLUMNS_CHUNK_ROWS 16384
+
+typedef enum {
+    SIO_COLUMN_INT64,  /* values is a const int64_t * */
+    SIO_COLUMN_UINT64, /* values is a const uint64_t * */
+    SIO_COLUMN_DOUBLE, /* values is a const double *, written as %.*f */
+} sio_column_type_t;
+
+typedef struct {
+    sio_column_type_t type;
+    const void *values; /* One value per row */
+    int precision;      /* Digits after the point of doubles, -1 for 6 */
+} sio_column_t;
+
+ssize_t sio_format_columns(const sio_sink_t *sink, const sio_column_t *columns,
+                           size_t ncolumns, size_t rows, char delimiter);
+ssize_t sio_format_columns_parallel(const sio_sink_t *sink,
+                                    const sio_column_t *columns,
+                                    size_t ncolumns, size_t rows,
+                                    char delimiter, unsigned int threads);
+
+#endif // CSAPP_COLUMNS_H
@@ -1,4 +1,5 @@
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -129,6 +130,14 @@ static size_t maxz(size_t a, size_t b) {
     }
 }
 
+static size_t minz(size_t a, size_t b) {
+    if (a < b) {
+        return a;
+    } else {
+        return b;
+    }
+}
+
 #define BIG_NUM_SIZE 40
 #define DIGIT_BITS 32
 
@@ -432,7 +441,7 @@ static bignum32x40_t *bignum32x40_mul_pow2(bignum32x40_t *self, size_t bits) {
 #endif // DEBUG
 
     sio_assert(bits == 0 ||
-               self->base[BIG_NUM_SIZE - digits - 1] >> (BIG_NUM_SIZE - bits) ==
+               self->base[BIG_NUM_SIZE - digits - 1] >> (DIGIT_BITS - bits) ==
                    0);
     sio_assert(self->size + digits <= BIG_NUM_SIZE);
     for (size_t i = 1; i <= self->size; i++) {
@@ -526,7 +535,8 @@ static bignum32x40_t *bignum32x40_mul_digits(bignum32x40_t *self,
             ? bignum32x40_mul_helper(&ret[0], self->base, self->size, digits, n)
             : bignum32x40_mul_helper(&ret[0], digits, n, self->base,
                                      self->size);
-    memcpy(&self->base[0], &ret[0], maxz(retsz, self->size));
+    memcpy(&self->base[0], &ret[0],
+           maxz(retsz, self->size) * sizeof(uint32_t));
     self->size = retsz;
     return self;
 }
@@ -779,7 +789,7 @@ static char round_up(char *digit_buffer, int len) {
         } else {
             // 999..999 rounds to 1000..000 with an increased exponent
             digit_buffer[0] = '1';
-            for (int j = 0; j < len; j++) {
+            for (int j = 1; j < len; j++) {
                 digit_buffer[j] = '0';
             }
             return '0';
@@ -934,6 +944,282 @@ static size_t sio_double_to_digits_exact(decoded_float_t *d, char *digit_buffer,
     return len;
 }
 
+/* Length of the fixed notation of 0.d1d2...dn * 10^exponent with precision
+ * digits after the point: the integral part has max(exponent, 1) digits. */
+static size_t fixed_length(bool sign, int16_t exponent, int precision) {
+    size_t length = sign + (exponent > 0 ? (size_t)exponent : 1);
+    if (precision > 0) {
+        length += (size_t)precision + 1;
+    }
+    return length;
+}
+
+/* Renders the digits produced by sio_double_to_digits_exact in fixed notation.
+ * Digits missing on either side of the point are rendered as zeros. */
+static ssize_t sio_output_fixed(sio_output_function output, void *output_state,
+                                bool sign, const char *digits, size_t len,
+                                int16_t exponent, ssize_t padding,
+                                int precision) {
+    size_t length = fixed_length(sign, exponent, precision);
+    size_t left_padding_count = 0;
+    size_t right_padding_count = 0;
+    if (padding > 0 && (size_t)padding > length) {
+        left_padding_count = (size_t)padding - length;
+    }
+    if (padding < 0 && (size_t)(-padding) > length) {
+        right_padding_count = (size_t)(-padding) - length;
+    }
+
+    ssize_t res = output(output_state, ' ', left_padding_count, 0, "-", sign);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t r;
+    size_t first = 0; // index of the first fractional digit
+    if (exponent > 0) {
+        first = (size_t)exponent;
+        size_t shown = minz(len, first);
+        r = output(output_state, '0', 0, first - shown, digits, shown);
+    } else {
+        r = output(output_state, ' ', 0, 0, "0", 1);
+    }
+    if (r < 0) {
+        return r;
+    }
+    res += r;
+    if (precision > 0) {
+        size_t fraction = (size_t)precision;
+        size_t leading = 0;
+        if (exponent < 0) {
+            leading = minz((size_t)(-(ssize_t)exponent), fraction);
+        }
+        size_t shown = len > first ? minz(len - first, fraction - leading) : 0;
+        r = output(output_state, '0', 0, leading, ".", 1);
+        if (r < 0) {
+            return r;
+        }
+        res += r;
+        r = output(output_state, '0', 0, fraction - leading - shown,
+                   digits + first, shown);
+        if (r < 0) {
+            return r;
+        }
+        res += r;
+    }
+    r = output(output_state, ' ', 0, right_padding_count, NULL, 0);
+    if (r < 0) {
+        return r;
+    }
+    return res + r;
+}
+
+/* Number of integral digits sio_double_to_digits_exact reports for d once
+ * rounded to precision fractional digits, computed without generating digits.
+ * Values below one all render a single integral digit, so only values of at
+ * least one need the exact exponent and the rounding carry check. */
+static int16_t sio_double_fixed_exponent(const decoded_float_t *d,
+                                         int precision) {
+    int16_t k = estimate_scaling_factor(d->mantissa, d->exponent);
+    if (k < 0) {
+        return 0; // v <= 10^(k + 1) <= 1, a single integral digit.
+    }
+
+    // v = mant / scale, find the smallest k such that v < 10^k.
+    bignum32x40_t mant, scale, power;
+    bignum32x40_from_uint64(&mant, d->mantissa);
+    bignum32x40_from_uint32(&scale, 1);
+    if (d->exponent < 0) {
+        bignum32x40_mul_pow2(&scale, (size_t)(-d->exponent));
+    } else {
+        bignum32x40_mul_pow2(&mant, (size_t)d->exponent);
+    }
+    for (;;) {
+        bignum32x40_clone(&scale, &power);
+        bignum32x40_mul_pow10(&power, (size_t)k);
+        if (bignum32x40_cmp(&mant, &power) < 0) {
+            break;
+        }
+        k++;
+    }
+    if (k <= 0) {
+        return k;
+    }
+
+    // Rounding carries into a new digit iff v >= 10^k - 10^-precision / 2,
+    // the tie rounds up as the last digit is an odd 9. An integral v has at
+    // most -exponent fractional decimal digits, beyond that v * 10^precision
+    // is an integer below 10^(k + precision) and never carries.
+    if (d->exponent >= 0 || precision >= -d->exponent) {
+        return k;
+    }
+    // 2 * mant * 10^precision >= (2 * 10^(k + precision) - 1) * 2^-exponent
+    bignum32x40_t one;
+    bignum32x40_from_uint32(&one, 1);
+    bignum32x40_mul_pow2(&mant, 1);
+    bignum32x40_mul_pow10(&mant, (size_t)precision);
+    bignum32x40_from_uint32(&power, 2);
+    bignum32x40_mul_pow10(&power, (size_t)k + (size_t)precision);
+    bignum32x40_sub(&power, &one);
+    bignum32x40_mul_pow2(&power, (size_t)(-d->exponent));
+    if (bignum32x40_cmp(&mant, &power) >= 0) {
+        k++;
+    }
+    return k;
+}
+
+size_t sio_measure_double_exact(double d, dtoa_flags_t flags, ssize_t padding,
+                                int precision) {
+    decoded_float_t decoded;
+    float_kind_t float_kind = decode_double(d, &decoded);
+
+    if (flags != FORMAT_f) {
+        // Unsupported
+        sio_assert(false);
+    }
+    if (precision < 0) {
+        precision = FLOAT_DEFAULT_PRECISION;
+    }
+
+    size_t length = 0;
+    switch (float_kind) {
+    case FK_FINITE:
+        length = fixed_length(decoded.sign,
+                              sio_double_fixed_exponent(&decoded, precision),
+                              precision);
+        break;
+    case FK_ZERO:
+        length = fixed_length(decoded.sign, 0, precision);
+        break;
+    case FK_INFINITY:
+        length = decoded.sign + strlen("inf");
+        break;
+    case FK_NAN:
+        length = strlen("nan");
+        break;
+    }
+    size_t width = padding < 0 ? (size_t)(-padding) : (size_t)padding;
+    return maxz(length, width);
+}
+
+#if CSAPP_DTOA_CACHE_SIZE > 0
+/*
+ * Memo of the digits of recent conversions
+ *
+ * Programs tend to print the same values over and over (gauges that did not
+ * move, zeroes, round numbers), and the exact conversion runs bignum
+ * arithmetic for each of them. Each thread keeps a direct-mapped table of the
+ * last digit strings it produced, keyed by the bits of the double, the digit
+ * limit and the flags. Only results of up to DTOA_CACHE_DIGITS digits are
+ * kept, which covers everything but huge values or precisions.
+ *
+ * As for the timestamp cache in csapp.c, the busy flag makes a signal handler
+ * interrupting its thread in the middle of an update bypass the table.
+ */
+#define DTOA_CACHE_DIGITS 40
+
+struct dtoa_cache_entry {
+    uint64_t bits;
+    int16_t limit;
+    int16_t exponent;
+    uint8_t flags;
+    uint8_t len; /* 0 for an empty entry, there is always at least one digit */
+    char digits[DTOA_CACHE_DIGITS];
+};
+
+struct dtoa_cache {
+    volatile sig_atomic_t busy;
+    uint64_t hits;
+    uint64_t misses;
+    struct dtoa_cache_entry entries[CSAPP_DTOA_CACHE_SIZE];
+};
+
+static __thread struct dtoa_cache dtoa_cache;
+
+/*
+ * dtoa_cache_index - Fibonacci hashing of the key, keeping the top bits,
+ *    masked to the table since its size is a power of two
+ */
+static size_t dtoa_cache_index(uint64_t bits, int16_t limit) {
+    uint64_t h = (bits ^ (uint64_t)(uint16_t)limit) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (CSAPP_DTOA_CACHE_SIZE - 1);
+}
+#endif // CSAPP_DTOA_CACHE_SIZE > 0
+
+/* sio_double_to_digits_cached - sio_double_to_digits_exact through the memo */
+static size_t sio_double_to_digits_cached(decoded_float_t *d, uint64_t bits,
+                                          dtoa_flags_t flags,
+                                          char *digit_buffer,
+                                          size_t buffer_size,
+                                          int16_t *exponent, int16_t limit) {
+#if CSAPP_DTOA_CACHE_SIZE > 0
+    struct dtoa_cache *cache = &dtoa_cache;
+    if (cache->busy) {
+        // We interrupted our own thread using the cache
+        return sio_double_to_digits_exact(d, digit_buffer, buffer_size,
+                                          exponent, limit);
+    }
+    cache->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    struct dtoa_cache_entry *entry =
+        &cache->entries[dtoa_cache_index(bits, limit)];
+    size_t len;
+    if (entry->len > 0 && entry->bits == bits && entry->limit == limit &&
+        entry->flags == (uint8_t)flags && entry->len <= buffer_size) {
+        cache->hits++;
+        len = entry->len;
+        memcpy(digit_buffer, entry->digits, len);
+        *exponent = entry->exponent;
+    } else {
+        cache->misses++;
+        len = sio_double_to_digits_exact(d, digit_buffer, buffer_size,
+                                         exponent, limit);
+        if (len > 0 && len <= DTOA_CACHE_DIGITS) {
+            entry->bits = bits;
+            entry->limit = limit;
+            entry->exponent = *exponent;
+            entry->flags = (uint8_t)flags;
+            entry->len = (uint8_t)len;
+            memcpy(entry->digits, digit_buffer, len);
+        }
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    cache->busy = 0;
+    return len;
+#else
+    (void)bits;
+    (void)flags;
+    return sio_double_to_digits_exact(d, digit_buffer, buffer_size, exponent,
+                                      limit);
+#endif // CSAPP_DTOA_CACHE_SIZE > 0
+}
+
+/**
+ * @brief   Reports the digit memo counters of the calling thread.
+ * @param hits     Where to store the number of conversions served from the
+ *                 memo, may be NULL.
+ * @param misses   Where to store the number of conversions that generated
+ *                 their digits, may be NULL.
+ *
+ * Both are always 0 unless the memo is enabled with CSAPP_DTOA_CACHE_SIZE.
+ */
+void sio_dtoa_cache_stats(uint64_t *hits, uint64_t *misses) {
+#if CSAPP_DTOA_CACHE_SIZE > 0
+    if (hits != NULL) {
+        *hits = dtoa_cache.hits;
+    }
+    if (misses != NULL) {
+        *misses = dtoa_cache.misses;
+    }
+#else
+    if (hits != NULL) {
+        *hits = 0;
+    }
+    if (misses != NULL) {
+        *misses = 0;
+    }
+#endif // CSAPP_DTOA_CACHE_SIZE > 0
+}
+
 ssize_t sio_format_double_shortest(sio_output_function output,
                                    void *output_state, double d,
                                    dtoa_flags_t flags, ssize_t padding) {
@@ -955,6 +1241,9 @@ ssize_t sio_format_double_exact(sio_output_function output, void *output_state,
         // Unsupported
         sio_assert(false);
     }
+    if (precision < 0) {
+        precision = FLOAT_DEFAULT_PRECISION;
+    }
 
     size_t left_padding = 0;
     size_t right_padding = 0;
@@ -967,222 +1256,21 @@ ssize_t sio_format_double_exact(sio_output_function output, void *output_state,
 
     switch (float_kind) {
     case FK_FINITE: {
-        char buffer[DTOA_EXACT_BUFFER_SIZE] = {0};
-        char *data = &buffer[0];
+        char buffer[DTOA_EXACT_BUFFER_SIZE];
         int16_t exponent;
-        if (decoded.sign) {
-            *data = '-';
-            data++;
-        }
         int16_t limit;
         if (precision < -((int)INT16_MIN)) {
             limit = (int16_t)-precision;
         } else {
             limit = INT16_MIN;
         }
-        size_t digits = sio_double_to_digits_exact(
-            &decoded, data, DTOA_EXACT_BUFFER_SIZE, &exponent, limit);
-        if (exponent <= limit) {
-            // this is too small and renders as 0
-            sio_assert(digits == 0);
-            *data = '0';
-            data++;
-            size_t length;
-            if (precision > 0) {
-                *data = '.';
-                data++;
-                length = strlen(buffer) + (size_t)precision;
-            } else {
-                length = strlen(buffer);
-            }
-            size_t left_padding_count = 0;
-            size_t right_padding_count = 0;
-            if (left_padding > length) {
-                left_padding_count = left_padding - length;
-            }
-            if (right_padding > length) {
-                right_padding_count = right_padding - length;
-            }
-
-            ssize_t res = output(output_state, ' ', left_padding_count, 0, buffer,
-                                 strlen(buffer));
-            if (res < 0) {
-                return -1;
-            }
-            if (precision > 0) {
-                ssize_t r = output(output_state, '0', (size_t)precision, 0, NULL,
-                                   0);
-                if (r < 0) {
-                    return -1;
-                }
-                res += r;
-
-            }
-            ssize_t r = output(output_state, ' ', (size_t)right_padding_count, 0, NULL,
-                       0);
-            if (r < 0) {
-                return -1;
-            }
-            res += r;
-            return res;
-        } else { // digit to decimal string.
-                 // This may turn into a help if we implement exponential form.
-            sio_assert(digits > 0); // There are digits to print
-            sio_assert(*data > '0' && *data <= '9');
-            if (exponent < 0) {
-                // The decimal points comes first
-                // 0. 000000 1234
-                // Will output space padding and 0. first
-                // then 0 padding and digits.
-                // then if needed additional zeros
-
-                size_t minus_exp = (size_t)(-(
-                    ssize_t)exponent);     // We know th sign of exponent.
-                sio_assert(precision > 0); // Otherwise we should not be here
-                size_t length = decoded.sign + strlen("0.") + (size_t)precision;
-                size_t left_padding_count = 0;
-                size_t right_padding_count = 0;
-                if (left_padding > length) {
-                    left_padding_count = left_padding - length;
-                }
-                if (right_padding > length) {
-                    right_padding_count = right_padding - length;
-                }
-                ssize_t res;
-                if (decoded.sign) {
-                    res = output(output_state, ' ', left_padding_count, 0, "-0.",
-                                 strlen("-0.")); // TODO error handling.
-                } else {
-                    res = output(output_state, ' ', left_padding_count, 0, "0.",
-                                 strlen("0.")); // TODO error handling.
-                }
-                if (res < 0) {
-                    return -1;
-                }
-                ssize_t r = output(output_state, '0', minus_exp, 0, data,
-                                   strlen(data)); // TODO error handling.
-                if (r < 0) {
-                    return -1;
-                }
-                res += r;
-                if (precision > 0 &&
-                    minus_exp + strlen(data) < (size_t)precision) {
-                    r = output(output_state, '0',
-                               (size_t)precision - (minus_exp + strlen(data)), 0,
-                               NULL, 0); // TODO error handling.
-                    if (r < 0) {
-                        return -1;
-                    }
-                    res += r;
-                }
-                r = output(output_state, ' ', (size_t)right_padding_count, 0, NULL,
-                                   0);
-                if (r < 0) {
-                    return -1;
-                }
-                res += r;
-                return res;
-            } else { // exponent >= 0
-                size_t sz_exponent = (uint16_t)exponent;
-                if (sz_exponent < digits) {
-                    // The exponent is inside the digits 1234.5678
-                    size_t length;
-                    if (precision > 0) {
-                        length =
-                            decoded.sign + sz_exponent + (size_t)precision + 1;
-                    } else {
-                        length = decoded.sign + sz_exponent;
-                    }
-                    size_t left_padding_count = 0;
-                    size_t right_padding_count = 0;
-                    if (left_padding > length) {
-                        left_padding_count = left_padding - length;
-                    }
-                    if (right_padding > length) {
-                        right_padding_count = right_padding - length;
-                    }
-
-                    ssize_t res = output(output_state, ' ', left_padding_count, 0,
-                                         buffer, sz_exponent + decoded.sign);
-                    if (res < 0) {
-                        return -1;
-                    }
-                    ssize_t r = output(output_state, '.', 1, 0, data + sz_exponent,
-                                       digits - sz_exponent);
-                    if (r < 0) {
-                        return -1;
-                    }
-                    res += r;
-                    if (precision >= 0 &&
-                        (size_t)precision > digits - sz_exponent) {
-                        r = output(output_state, '0',
-                                   (size_t)precision - digits + sz_exponent, 0,
-                                   NULL, 0);
-                        if (r < 0) {
-                            return -1;
-                        }
-                        res += r;
-                    }
-                    r = output(output_state, ' ', (size_t)right_padding_count, 0, NULL,
-                               0);
-                    if (r < 0) {
-                        return -1;
-                    }
-                    res += r;
-                    return res;
-                } else {
-                    // The point is after the number
-                    size_t length;
-                    if (precision > 0) {
-                        length =
-                            decoded.sign + sz_exponent + (size_t)precision + 1;
-                    } else {
-                        length = decoded.sign + sz_exponent;
-                    }
-                    size_t left_padding_count = 0;
-                    size_t right_padding_count = 0;
-                    if (left_padding > length) {
-                        left_padding_count = left_padding - length;
-                    }
-                    if (right_padding > length) {
-                        right_padding_count = right_padding - length;
-                    }
-                    ssize_t res = output(output_state, ' ', left_padding_count, 0,
-                                         buffer, digits + decoded.sign);
-                    if (res < 0) {
-                        return -1;
-                    }
-                    if (precision > 0) {
-                        ssize_t r = output(output_state, '0',
-                                           sz_exponent - digits, 0, ".", 1);
-                        if (r < 0) {
-                            return -1;
-                        }
-                        res += r;
-                        r = output(output_state, '0', (size_t)precision, 0, NULL,
-                                   0);
-                        if (r < 0) {
-                            return -1;
-                        }
-                        res += r;
-                    } else {
-                        ssize_t r = output(output_state, '0',
-                                           sz_exponent - digits, 0, NULL, 0);
-                        if (r < 0) {
-                            return -1;
-                        }
-                        res += r;
-                    }
-                    ssize_t r = output(output_state, ' ', (size_t)right_padding_count, 0, NULL,
-                               0);
-                    if (r < 0) {
-                        return -1;
-                    }
-                    res += r;
-                    return res;
-                }
-            }
-        }
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        size_t digits = sio_double_to_digits_cached(
+            &decoded, bits, flags, buffer, DTOA_EXACT_BUFFER_SIZE, &exponent,
+            limit);
+        return sio_output_fixed(output, output_state, decoded.sign, buffer,
+                                digits, exponent, padding, precision);
     }
     case FK_ZERO: {
         // This needs to change if we are to support exponential formats.
@@ -1210,19 +1298,19 @@ ssize_t sio_format_double_exact(sio_output_function output, void *output_state,
         ssize_t res = output(output_state, ' ', left_padding_count, 0, data,
                              strlen(data) - (precision <= 0));
         if (res < 0) {
-            return -1;
+            return res;
         }
         if (precision > 0) {
             ssize_t r = output(output_state, '0', (size_t)precision, 0, NULL, 0);
             if (r < 0) {
-                return -1;
+                return r;
             }
             res += r;
         }
         ssize_t r = output(output_state, ' ', (size_t)right_padding_count, 0, NULL,
                            0);
         if (r < 0) {
-            return -1;
+            return r;
         }
         res += r;
         return res;
@@ -5,6 +5,8 @@
 #ifndef CSAPP_DTOA_H
 #define CSAPP_DTOA_H
 
+#include <stdint.h>
+
 // This is the minimum size for a buffer storing the decimal digits of a double
 // guaranteeing that the round trip works.
 //
@@ -16,6 +18,16 @@
 
 #define FLOAT_DEFAULT_PRECISION 6
 
+// Entries of the per-thread memo of recent conversions in
+// sio_format_double_exact, a power of two such as 128. Off by default: each
+// entry costs 56 bytes of thread-local storage in every thread.
+#ifndef CSAPP_DTOA_CACHE_SIZE
+#define CSAPP_DTOA_CACHE_SIZE 0
+#endif
+#if CSAPP_DTOA_CACHE_SIZE & (CSAPP_DTOA_CACHE_SIZE - 1)
+#error "CSAPP_DTOA_CACHE_SIZE must be a power of two"
+#endif
+
 typedef enum {
     FORMAT_f,
     FORMAT_F,
@@ -32,4 +44,12 @@ ssize_t sio_format_double_exact(sio_output_function output, void *output_state,
                                 double d, dtoa_flags_t flags,
                                 ssize_t padding, int precision);
 
+/* Number of bytes sio_format_double_exact emits for the same arguments,
+ * computed without generating the digits. */
+size_t sio_measure_double_exact(double d, dtoa_flags_t flags, ssize_t padding,
+                                int precision);
+
+/* Memo hits and misses of sio_format_double_exact in the calling thread. */
+void sio_dtoa_cache_stats(uint64_t *hits, uint64_t *misses);
+
 #endif // CSAPP_DTOA_H
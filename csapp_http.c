@@ -0,0 +1,374 @@
+/**
+ * @file csapp_http.c
+ * @brief Incremental HTTP/1.x request and response head parser, see
+ * csapp_http.h
+ *
+ * A head is only parsed once it is complete: the empty line ending it is
+ * searched for first with memchr(), resuming where the previous attempt
+ * stopped. The complete head is then parsed and validated in one pass. The
+ * fields that can be long, header values, URIs and reason phrases, are
+ * checked for forbidden control characters with SSE2 or AVX2 compares when
+ * available, like JSON strings are scanned in csapp.c. Tokens, methods and
+ * header names, are short and checked against a bitmap.
+ */
+
+#include "csapp.h"
+#include "csapp_http.h"
+#include "csapp_private.h"
+
+#include <errno.h>   /* errno */
+#include <stdbool.h> /* bool */
+#include <stdint.h>  /* uint32_t */
+#include <string.h>  /* memchr() */
+#include <strings.h> /* strncasecmp() */
+
+#if defined(__AVX2__)
+#include <immintrin.h> /* _mm256_cmpeq_epi8() */
+#elif defined(__SSE2__)
+#include <emmintrin.h> /* _mm_cmpeq_epi8() */
+#endif // __AVX2__
+
+/* Bytes of tokens (RFC 9110): alphanumerics and !#$%&'*+-.^_`|~ */
+static const uint32_t http_tchar[8] = {0x00000000, 0x03ff6cfa, 0xc7fffffe,
+                                       0x57ffffff, 0, 0, 0, 0};
+
+/* http_is_tchar - Check whether c may appear in a token */
+static bool http_is_tchar(unsigned char c) {
+    return (http_tchar[c >> 5] >> (c & 31)) & 1;
+}
+
+/*
+ * http_scan - Return the index of the first byte of s that is up to stop
+ *    but not allowed, or DEL, or len if there is none. Values stop at
+ *    control characters but tabs, URIs at control characters and spaces.
+ */
+static size_t http_scan(const char *s, size_t len, unsigned char stop,
+                        char allowed) {
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i top = _mm256_set1_epi8((char)stop);
+    const __m256i ok = _mm256_set1_epi8(allowed);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+        /* v <= stop (unsigned) iff max(v, stop) == stop */
+        __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, top), top);
+        m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, ok), m);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, del));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+#endif // __AVX2__
+#ifdef __SSE2__
+    const __m128i top16 = _mm_set1_epi8((char)stop);
+    const __m128i ok16 = _mm_set1_epi8(allowed);
+    const __m128i del16 = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, top16), top16);
+        m = _mm_andnot_si128(_mm_cmpeq_epi8(v, ok16), m);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del16));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+#endif // __SSE2__
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if ((c <= stop && c != (unsigned char)allowed) || c == 0x7f) {
+            return i;
+        }
+    }
+    return len;
+}
+
+/*
+ * http_head_end - Return the length of the head at buf, through the empty
+ *    line ending it, or 0 if it is incomplete. The len - from first bytes
+ *    were already searched by a previous call.
+ */
+static size_t http_head_end(const char *buf, size_t len, size_t from) {
+    const char *end = buf + len;
+    const char *p = buf + (from > 2 ? from - 2 : 0);
+
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        p++;
+        if (p < end && *p == '\n') {
+            return (size_t)(p + 1 - buf);
+        }
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+            return (size_t)(p + 2 - buf);
+        }
+    }
+    return 0;
+}
+
+/*
+ * http_line - Return the end of the line at p, before its "\r\n" or "\n",
+ *    and set *next to the start of the next line. The head is complete, so
+ *    every line ends with a '\n'.
+ */
+static const char *http_line(const char *p, const char *end,
+                             const char **next) {
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    *next = eol + 1;
+    return eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+}
+
+/* http_token - Set token to the token at p, returning its end */
+static const char *http_token(const char *p, const char *end,
+                              rio_line_t *token) {
+    const char *start = p;
+    while (p < end && http_is_tchar((unsigned char)*p)) {
+        p++;
+    }
+    token->data = start;
+    token->len = (size_t)(p - start);
+    return p;
+}
+
+/* http_version - Parse "HTTP/1.<digit>" at p, returning its end or NULL */
+static const char *http_version(const char *p, const char *end, int *minor) {
+    if (end - p < 8 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' ||
+        p[7] > '9') {
+        return NULL;
+    }
+    *minor = p[7] - '0';
+    return p + 8;
+}
+
+/*
+ * http_headers - Parse the header lines from p to the empty line ending the
+ *    head. Returns 0, or -1 with errno set.
+ */
+static int http_headers(const char *p, const char *end,
+                        rio_http_message_t *msg) {
+    const char *next;
+
+    msg->nheaders = 0;
+    for (;;) {
+        const char *eol = http_line(p, end, &next);
+        if (eol == p) {
+            return 0; /* The empty line */
+        }
+        if (msg->nheaders == RIO_HTTP_MAX_HEADERS) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        rio_http_header_t *h = &msg->headers[msg->nheaders];
+        p = http_token(p, eol, &h->name);
+        if (h->name.len == 0 || p == eol || *p != ':') {
+            errno = EBADMSG; /* Also rejects obsolete line folding */
+            return -1;
+        }
+        p++;
+        while (p < eol && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        size_t len = (size_t)(eol - p);
+        if (http_scan(p, len, 0x1f, '\t') != len) {
+            errno = EBADMSG;
+            return -1;
+        }
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            len--;
+        }
+        h->value.data = p;
+        h->value.len = len;
+        msg->nheaders++;
+        p = next;
+    }
+}
+
+/* http_skip_empty_lines - Count the empty lines before a request line */
+static size_t http_skip_empty_lines(const char *buf, size_t len) {
+    size_t skip = 0;
+    while (skip < len && (buf[skip] == '\r' || buf[skip] == '\n')) {
+        skip++;
+    }
+    return skip;
+}
+
+/**
+ * @brief   Parses the head of an HTTP/1.x request.
+ * @param buf       The bytes received so far.
+ * @param len       The number of bytes in buf.
+ * @param last_len  The len of the previous call on the same message, which
+ *                  found the head incomplete, or 0.
+ * @param msg       Set to the method, URI, version and headers, as views
+ *                  into buf.
+ * @return          The length of the head, through the empty line ending it,
+ *                  RIO_AGAIN if it is incomplete, or -1 with errno set:
+ *                  EBADMSG if it is malformed, EMSGSIZE if it has more than
+ *                  RIO_HTTP_MAX_HEADERS headers.
+ *
+ * Empty lines before the request line are skipped, and counted in the
+ * length. Lines may end with "\r\n" or "\n".
+ */
+ssize_t rio_http_parse_request(const char *buf, size_t len, size_t last_len,
+                               rio_http_message_t *msg) {
+    size_t skip = http_skip_empty_lines(buf, len);
+    size_t head = http_head_end(buf + skip, len - skip,
+                                last_len > skip ? last_len - skip : 0);
+    if (head == 0) {
+        return RIO_AGAIN;
+    }
+    const char *p = buf + skip;
+    const char *end = p + head;
+    const char *next;
+    const char *eol = http_line(p, end, &next);
+
+    p = http_token(p, eol, &msg->method);
+    if (msg->method.len == 0 || p == eol || *p++ != ' ') {
+        errno = EBADMSG;
+        return -1;
+    }
+    size_t uri_len = http_scan(p, (size_t)(eol - p), ' ', 0x7f);
+    msg->uri.data = p;
+    msg->uri.len = uri_len;
+    p += uri_len;
+    if (uri_len == 0 || p == eol || *p++ != ' ' ||
+        (p = http_version(p, eol, &msg->minor_version)) != eol) {
+        errno = EBADMSG;
+        return -1;
+    }
+    msg->status = 0;
+    msg->reason.data = NULL;
+    msg->reason.len = 0;
+    if (http_headers(next, end, msg) < 0) {
+        return -1;
+    }
+    return (ssize_t)(skip + head);
+}
+
+/**
+ * @brief   Parses the head of an HTTP/1.x response.
+ * @return  The length of the head, RIO_AGAIN if it is incomplete, or -1
+ *          with errno set.
+ * @see     rio_http_parse_request
+ *
+ * msg is set to the version, status, reason phrase and headers.
+ */
+ssize_t rio_http_parse_response(const char *buf, size_t len, size_t last_len,
+                                rio_http_message_t *msg) {
+    size_t head = http_head_end(buf, len, last_len);
+    if (head == 0) {
+        return RIO_AGAIN;
+    }
+    const char *p = buf;
+    const char *end = p + head;
+    const char *next;
+    const char *eol = http_line(p, end, &next);
+
+    p = http_version(p, eol, &msg->minor_version);
+    if (p == NULL || eol - p < 4 || *p++ != ' ' || p[0] < '1' || p[0] > '9' ||
+        p[1] < '0' || p[1] > '9' || p[2] < '0' || p[2] > '9') {
+        errno = EBADMSG;
+        return -1;
+    }
+    msg->status = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+    p += 3;
+    if (p < eol && *p++ != ' ') {
+        errno = EBADMSG;
+        return -1;
+    }
+    size_t reason_len = (size_t)(eol - p);
+    if (http_scan(p, reason_len, 0x1f, '\t') != reason_len) {
+        errno = EBADMSG;
+        return -1;
+    }
+    msg->reason.data = p;
+    msg->reason.len = reason_len;
+    msg->method.data = msg->uri.data = NULL;
+    msg->method.len = msg->uri.len = 0;
+    if (http_headers(next, end, msg) < 0) {
+        return -1;
+    }
+    return (ssize_t)head;
+}
+
+/**
+ * @brief   Finds a header of a parsed message.
+ * @param name  The header name, compared without case.
+ * @return      The value of the first header with this name, or NULL.
+ */
+const rio_line_t *rio_http_header(const rio_http_message_t *msg,
+                                  const char *name) {
+    size_t len = strlen(name);
+    for (size_t i = 0; i < msg->nheaders; i++) {
+        const rio_http_header_t *h = &msg->headers[i];
+        if (h->name.len == len && strncasecmp(h->name.data, name, len) == 0) {
+            return &h->value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * http_read - Parse a head from the internal buffer of rp, reading more
+ *    until it is complete
+ */
+static ssize_t http_read(rio_t *rp, rio_http_message_t *msg, bool request) {
+    size_t last_len = 0;
+    ssize_t rc;
+
+    for (;;) {
+        size_t len = rp->rio_cnt > 0 ? (size_t)rp->rio_cnt : 0;
+        rc = request ? rio_http_parse_request(rp->rio_bufptr, len, last_len,
+                                              msg)
+                     : rio_http_parse_response(rp->rio_bufptr, len, last_len,
+                                               msg);
+        if (rc != RIO_AGAIN) {
+            break;
+        }
+        last_len = len;
+        ssize_t n = rio_fill_more(rp);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return RIO_AGAIN; /* The partial head stays buffered */
+            }
+            return -1; /* errno set by read() */
+        } else if (n == 0) {
+            if (rp->rio_cnt <= 0) {
+                return 0; /* EOF between messages */
+            }
+            errno = (size_t)rp->rio_cnt >= rio_capacity(rp) ? EMSGSIZE
+                                                            : EPROTO;
+            return -1;
+        }
+    }
+    if (rc > 0) {
+        rp->rio_bufptr += rc;
+        rp->rio_cnt -= rc;
+    }
+    return rc;
+}
+
+/**
+ * @brief   Reads the head of an HTTP/1.x request (buffered).
+ * @param msg   Set to the parsed head, as views into the internal buffer of
+ *              rp, valid until the next call on rp.
+ * @return      The length of the head, 0 on EOF before a request, RIO_AGAIN
+ *              if the descriptor is non-blocking and the head incomplete, or
+ *              -1 with errno set: EBADMSG or EMSGSIZE as for
+ *              rio_http_parse_request, EMSGSIZE also if the head does not
+ *              fit in the buffer, EPROTO if EOF cuts it short.
+ *
+ * The body, if any, is read next from rp by the caller. Requests already
+ * buffered behind it, when pipelined, are parsed by the next calls without
+ * reading.
+ */
+ssize_t rio_http_readrequest(rio_t *rp, rio_http_message_t *msg) {
+    return http_read(rp, msg, true);
+}
+
+/**
+ * @brief   Reads the head of an HTTP/1.x response (buffered).
+ * @see     rio_http_readrequest
+ */
+ssize_t rio_http_readresponse(rio_t *rp, rio_http_message_t *msg) {
+    return http_read(rp, msg, false);
+}
@@ -0,0 +1,53 @@
+/**
+ * @file csapp_http.h
+ * @brief Incremental HTTP/1.x request and response head parser
+ *
+ * The head of a message, its start line and headers, is parsed in place: the
+ * method, URI, reason phrase, and header names and values are returned as
+ * views into the input, nothing is copied or allocated. Header values and
+ * URIs, the long fields, are validated 16 or 32 bytes at a time with SSE2 or
+ * AVX2 when available.
+ *
+ * rio_http_readrequest and rio_http_readresponse parse straight from the
+ * internal buffer of a rio_t. Pipelined messages already buffered are parsed
+ * without reading, and on non-blocking descriptors a partial head stays
+ * buffered until the rest arrives. The body is left for the caller to read,
+ * as Content-Length or Transfer-Encoding say.
+ */
+
+#ifndef CSAPP_HTTP_H
+#define CSAPP_HTTP_H
+
+#include "csapp.h"
+
+#include <stddef.h>    /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+/* Most headers in a message head, more fail with EMSGSIZE */
+#define RIO_HTTP_MAX_HEADERS 64
+
+typedef struct {
+    rio_line_t name;  /* As received, compare without case */
+    rio_line_t value; /* Without surrounding spaces and tabs */
+} rio_http_header_t;
+
+typedef struct {
+    rio_line_t method; /* Requests */
+    rio_line_t uri;
+    int status;        /* Responses */
+    rio_line_t reason;
+    int minor_version; /* 1 for HTTP/1.1 */
+    size_t nheaders;
+    rio_http_header_t headers[RIO_HTTP_MAX_HEADERS];
+} rio_http_message_t;
+
+ssize_t rio_http_parse_request(const char *buf, size_t len, size_t last_len,
+                               rio_http_message_t *msg);
+ssize_t rio_http_parse_response(const char *buf, size_t len, size_t last_len,
+                                rio_http_message_t *msg);
+const rio_line_t *rio_http_header(const rio_http_message_t *msg,
+                                  const char *name);
+ssize_t rio_http_readrequest(rio_t *rp, rio_http_message_t *msg);
+ssize_t rio_http_readresponse(rio_t *rp, rio_http_message_t *msg);
+
+#endif // CSAPP_HTTP_H
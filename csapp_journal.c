@@ -0,0 +1,285 @@
+/**
+ * @file csapp_journal.c
+ * @brief journald native protocol records, see csapp_journal.h
+ *
+ * Each field is "NAME=value\n", or, when the value contains a newline,
+ * "NAME\n" followed by the value length as a little endian 64 bit integer,
+ * the value and "\n". Values are formatted in place after room for the longer
+ * header, and moved back over it in the common case without a newline.
+ *
+ * A datagram larger than the socket send buffer fails with EMSGSIZE. The
+ * record is then written to a memfd, sealed, and its descriptor is sent alone
+ * with SCM_RIGHTS, which journald reads as the record.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* memfd_create(), F_ADD_SEALS */
+#endif              // __linux__
+
+#include "csapp.h"
+#include "csapp_journal.h"
+
+#include <errno.h>    /* errno */
+#include <fcntl.h>    /* fcntl() */
+#include <stdbool.h>  /* bool */
+#include <stdint.h>   /* uint64_t */
+#include <string.h>   /* memchr() */
+#include <sys/mman.h> /* memfd_create() */
+#include <sys/uio.h>  /* struct iovec */
+#include <unistd.h>   /* close() */
+
+/* "\n" and the 64 bit length of the binary form of a field */
+#define JOURNAL_BINARY_HEADER_LEN 9
+/* Longest field name journald accepts */
+#define JOURNAL_NAME_MAX 64
+
+/**
+ * @brief   Prepares a journal to send records to journald.
+ * @param journal   The journal to initialize.
+ * @param path      The socket of journald, SIO_JOURNAL_SOCKET if NULL. Tests
+ *                  may point it to a local datagram socket.
+ * @param buffer    Where records are built, which bounds their size.
+ * @param size      The size of buffer.
+ * @return          0 on success, -1 with errno set on error.
+ */
+int sio_journal_open(sio_journal_t *journal, const char *path, char *buffer,
+                     size_t size) {
+    if (path == NULL) {
+        path = SIO_JOURNAL_SOCKET;
+    }
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(journal->addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&journal->addr, 0, sizeof(journal->addr));
+    journal->addr.sun_family = AF_UNIX;
+    memcpy(journal->addr.sun_path, path, path_len + 1);
+    journal->addrlen = (socklen_t)sizeof(journal->addr);
+
+    journal->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (journal->fd < 0) {
+        return -1;
+    }
+    if (fcntl(journal->fd, F_SETFD, FD_CLOEXEC) < 0) {
+        int saved = errno;
+        close(journal->fd);
+        errno = saved;
+        return -1;
+    }
+    journal->buffer = buffer;
+    journal->size = size;
+    journal->len = 0;
+    journal->error = 0;
+    return 0;
+}
+
+/**
+ * @brief   Closes the socket of a journal.
+ * @return  0 on success, -1 with errno set on error.
+ */
+int sio_journal_close(sio_journal_t *journal) {
+    int ret = close(journal->fd);
+    journal->fd = -1;
+    return ret;
+}
+
+/**
+ * @brief   Starts a new record with its PRIORITY field.
+ * @param journal    The journal.
+ * @param priority   The syslog priority of the record, LOG_ERR to LOG_DEBUG.
+ * @return           The number of bytes added, or -1 on error.
+ */
+ssize_t sio_journal_begin(sio_journal_t *journal, int priority) {
+    journal->len = 0;
+    journal->error = 0;
+    return sio_journal_field(journal, "PRIORITY", "%d", priority);
+}
+
+ssize_t sio_journal_field(sio_journal_t *journal, const char *name,
+                          const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_journal_vfield(journal, name, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/*
+ * journal_valid_name - Field names are 1 to 64 upper case letters, digits and
+ *    '_', not starting with a digit
+ */
+static bool journal_valid_name(const char *name, size_t len) {
+    if (len == 0 || len > JOURNAL_NAME_MAX) {
+        return false;
+    }
+    if (name[0] == '_') {
+        return false; // Leading underscores are trusted fields, set by journald
+    }
+    if (name[0] >= '0' && name[0] <= '9') {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief   Adds a field to the current record.
+ * @param journal   The journal.
+ * @param name      The field name, up to 64 upper case letters, digits and
+ *                  '_', starting with a letter.
+ * @param fmt       The format of the value, see sio_vdprintf.
+ * @param argp      The arguments for the format string.
+ * @return          The number of bytes added, or -1 if the name is invalid or
+ *                  the field does not fit. The record is then marked as failed
+ *                  and sio_journal_send will not send it.
+ */
+ssize_t sio_journal_vfield(sio_journal_t *journal, const char *name,
+                           const char *fmt, va_list argp) {
+    size_t name_len = strlen(name);
+    size_t start = journal->len;
+    size_t value_start = start + name_len + JOURNAL_BINARY_HEADER_LEN;
+    if (journal->error || !journal_valid_name(name, name_len) ||
+        value_start >= journal->size) {
+        journal->error = 1;
+        return -1;
+    }
+    char *buffer = journal->buffer;
+    memcpy(&buffer[start], name, name_len);
+
+    // One byte is left for the final newline
+    sio_buffer_trunc_output_t state;
+    state.buffer.buffer = &buffer[value_start];
+    state.buffer.remaining = journal->size - value_start - 1;
+    sio_sink_t sink = {sio_buffer_reserve, sio_buffer_commit,
+                       sio_buffer_trunc_output, &state};
+    ssize_t ret = sio_vformat_sink(&sink, fmt, argp);
+    if (ret < 0) {
+        journal->error = 1;
+        return -1;
+    }
+    size_t value_len = (size_t)ret;
+
+    size_t end;
+    if (memchr(&buffer[value_start], '\n', value_len) == NULL) {
+        buffer[start + name_len] = '=';
+        memmove(&buffer[start + name_len + 1], &buffer[value_start],
+                value_len);
+        end = start + name_len + 1 + value_len;
+    } else {
+        buffer[start + name_len] = '\n';
+        uint64_t len = value_len;
+        for (size_t i = 0; i < 8; i++) {
+            buffer[start + name_len + 1 + i] = (char)(len >> (8 * i));
+        }
+        end = value_start + value_len;
+    }
+    buffer[end++] = '\n';
+    journal->len = end;
+    return (ssize_t)(end - start);
+}
+
+/* journal_sendmsg - sendmsg to journald, restarted when interrupted */
+static ssize_t journal_sendmsg(sio_journal_t *journal, struct msghdr *msg) {
+    msg->msg_name = &journal->addr;
+    msg->msg_namelen = journal->addrlen;
+    ssize_t ret;
+    do {
+        ret = sendmsg(journal->fd, msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+/* journal_send_memfd - Pass a record too large for a datagram in a memfd */
+static ssize_t journal_send_memfd(sio_journal_t *journal) {
+    int fd = memfd_create("sio_journal", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    if (rio_writen(fd, journal->buffer, journal->len) < 0 ||
+        fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t ret = journal_sendmsg(journal, &msg);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    if (ret < 0) {
+        return -1;
+    }
+    return (ssize_t)journal->len;
+}
+#endif // __linux__ && MFD_ALLOW_SEALING
+
+/**
+ * @brief   Sends the current record to journald.
+ * @param journal   The journal.
+ * @return          The size of the record, or -1 with errno set on error,
+ *                  including EMSGSIZE when a field did not fit the buffer.
+ *
+ * The record is sent as a single datagram. When it is too large for one, it
+ * is passed in a sealed memfd on Linux.
+ */
+ssize_t sio_journal_send(sio_journal_t *journal) {
+    if (journal->error) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    struct iovec iov;
+    iov.iov_base = journal->buffer;
+    iov.iov_len = journal->len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t ret = journal_sendmsg(journal, &msg);
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    if (ret < 0 && (errno == EMSGSIZE || errno == ENOBUFS)) {
+        return journal_send_memfd(journal);
+    }
+#endif // __linux__ && MFD_ALLOW_SEALING
+    return ret;
+}
+
+/**
+ * @brief   Sends a record made of a priority and a formatted MESSAGE.
+ * @param journal    The journal.
+ * @param priority   The syslog priority of the record.
+ * @param fmt        The format of the message, see sio_vdprintf.
+ * @return           The size of the record, or -1 on error.
+ */
+ssize_t sio_journal_printf(sio_journal_t *journal, int priority,
+                           const char *fmt, ...) {
+    sio_journal_begin(journal, priority);
+    va_list argp;
+    va_start(argp, fmt);
+    sio_journal_vfield(journal, "MESSAGE", fmt, argp);
+    va_end(argp);
+    return sio_journal_send(journal);
+}
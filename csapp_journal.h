@@ -0,0 +1,53 @@
+/**
+ * @file csapp_journal.h
+ * @brief Structured log records sent to journald over its native protocol
+ *
+ * A record is a list of fields, such as MESSAGE, PRIORITY and any custom
+ * ones, formatted with sio_format into a buffer supplied by the caller, then
+ * sent as a single datagram on a Unix socket. Records too large for a datagram
+ * are passed in a sealed memfd instead, as the protocol allows on Linux.
+ *
+ * Nothing is allocated, and every function is async-signal-safe, so records
+ * can be sent from signal handlers as long as each thread or handler uses its
+ * own sio_journal_t.
+ */
+
+#ifndef CSAPP_JOURNAL_H
+#define CSAPP_JOURNAL_H
+
+#include <stdarg.h>     /* va_list */
+#include <sys/socket.h> /* socklen_t */
+#include <sys/types.h>  /* ssize_t */
+#include <sys/un.h>     /* struct sockaddr_un */
+
+/* Where journald listens for native protocol datagrams */
+#define SIO_JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+typedef struct {
+    int fd;                  /* Unix datagram socket */
+    struct sockaddr_un addr; /* Address of journald */
+    socklen_t addrlen;
+    char *buffer;            /* Record being built */
+    size_t size;
+    size_t len;
+    int error;               /* Set when a field of the record was lost */
+} sio_journal_t;
+
+int sio_journal_open(sio_journal_t *journal, const char *path, char *buffer,
+                     size_t size);
+int sio_journal_close(sio_journal_t *journal);
+
+ssize_t sio_journal_begin(sio_journal_t *journal, int priority);
+ssize_t sio_journal_field(sio_journal_t *journal, const char *name,
+                          const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+ssize_t sio_journal_vfield(sio_journal_t *journal, const char *name,
+                           const char *fmt, va_list argp)
+    __attribute__((format(printf, 3, 0)));
+ssize_t sio_journal_send(sio_journal_t *journal);
+
+ssize_t sio_journal_printf(sio_journal_t *journal, int priority,
+                           const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif // CSAPP_JOURNAL_H
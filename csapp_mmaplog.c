@@ -0,0 +1,294 @@
+/**
+ * @file csapp_mmaplog.c
+ * @brief Append-only log file written through a mapping, see csapp_mmaplog.h
+ *
+ * A record is claimed with a single atomic addition on the tail, after
+ * sio_vformat_measure gave its exact length, so concurrent writers never
+ * interleave within a record. It is then formatted with sio_vformat_sink
+ * directly into the mapping.
+ *
+ * Touching a page of the mapping past the end of the file raises SIGBUS, and
+ * so does touching a page of a sparse file when the disk is full. The file is
+ * therefore grown with posix_fallocate before the tail reaches the end of the
+ * preallocated part, where available, and with ftruncate otherwise.
+ */
+
+#include "csapp.h"
+#include "csapp_mmaplog.h"
+
+#include <errno.h>    /* errno */
+#include <fcntl.h>    /* open(), posix_fallocate() */
+#include <stdbool.h>  /* bool */
+#include <string.h>   /* memcpy(), strlen() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <unistd.h>   /* ftruncate() */
+
+#define MMAPLOG_SCAN_BLOCK 4096
+
+/* Part of the mapping a record is formatted into */
+typedef struct {
+    char *buffer;
+    size_t remaining;
+} mmaplog_region_t;
+
+static char *mmaplog_reserve(void *state, size_t len) {
+    mmaplog_region_t *region = state;
+    return len <= region->remaining ? region->buffer : NULL;
+}
+
+static ssize_t mmaplog_commit(void *state, size_t len) {
+    mmaplog_region_t *region = state;
+    region->buffer += len;
+    region->remaining -= len;
+    return (ssize_t)len;
+}
+
+/* mmaplog_output - Output function into a region, without null termination */
+static ssize_t mmaplog_output(void *state, char padding, size_t count_left,
+                              size_t count_right, const char *data,
+                              size_t len) {
+    mmaplog_region_t *region = state;
+    size_t total = count_left + len + count_right;
+    if (total > region->remaining) {
+        return -1; // The record is longer than measured
+    }
+    memset(region->buffer, padding, count_left);
+    if (len > 0) {
+        memcpy(region->buffer + count_left, data, len);
+    }
+    memset(region->buffer + count_left + len, padding, count_right);
+    region->buffer += total;
+    region->remaining -= total;
+    return (ssize_t)total;
+}
+
+/* mmaplog_grow - Make sure the file is preallocated up to end */
+static int mmaplog_grow(sio_mmaplog_t *log, size_t end) {
+    size_t size = __atomic_load_n(&log->file_size, __ATOMIC_ACQUIRE);
+    while (size < end) {
+        size_t target = (end + log->chunk - 1) / log->chunk * log->chunk;
+        if (target > log->max_size) {
+            target = log->max_size;
+        }
+        // Concurrent growers may race here, growing is idempotent
+#ifdef __linux__
+        int rc = posix_fallocate(log->fd, 0, (off_t)target);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+#else
+        if (ftruncate(log->fd, (off_t)target) < 0) {
+            return -1;
+        }
+#endif // __linux__
+        if (__atomic_compare_exchange_n(&log->file_size, &size, target, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            size = target;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief   Finds the valid end of a log file after an unclean exit.
+ * @param fd   The log file, open for reading and writing.
+ * @return     The length of the valid part, to which the file is truncated,
+ *             or -1 with errno set on error, EINVAL if it is not a log.
+ *
+ * A log closed cleanly ends with the newline of its last record, and is left
+ * as is. A log left by a crash ends with preallocated zeros: they are dropped,
+ * and so is a last record that was not complete, i.e. everything after the
+ * last newline. Records claimed but never completed before records that were
+ * leave runs of null bytes, which are kept. Any other file was not written
+ * as a log, and fails with EINVAL instead of being truncated.
+ */
+ssize_t sio_mmaplog_recover(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    char block[MMAPLOG_SCAN_BLOCK];
+    off_t end = st.st_size;
+    off_t valid = 0;
+    bool data = false;
+    bool crashed = false; /* The file ends with preallocated zeros */
+    while (end > 0 && valid == 0) {
+        off_t start = end > MMAPLOG_SCAN_BLOCK ? end - MMAPLOG_SCAN_BLOCK : 0;
+        ssize_t n = pread(fd, block, (size_t)(end - start), start);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n != end - start) {
+            errno = EIO;
+            return -1;
+        }
+        for (ssize_t i = n - 1; i >= 0; i--) {
+            if (!data && block[i] == '\0') {
+                crashed = true;
+                continue;
+            }
+            if (!crashed && block[i] != '\n') {
+                errno = EINVAL; // Not a log, or not written by one
+                return -1;
+            }
+            data = true;
+            if (block[i] == '\n') {
+                valid = start + i + 1;
+                break;
+            }
+        }
+        end = start;
+    }
+    if (valid != st.st_size && ftruncate(fd, valid) < 0) {
+        return -1;
+    }
+    return (ssize_t)valid;
+}
+
+/**
+ * @brief   Opens or creates a log file and maps it for appending.
+ * @param log        The log to initialize.
+ * @param path       The log file, recovered first if it exists, see
+ *                   sio_mmaplog_recover.
+ * @param max_size   The size of the mapping, which bounds the log.
+ * @param chunk      How much the file grows at once, SIO_MMAPLOG_CHUNK if 0.
+ * @return           0 on success, -1 with errno set on error.
+ */
+int sio_mmaplog_open(sio_mmaplog_t *log, const char *path, size_t max_size,
+                     size_t chunk) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (chunk == 0) {
+        chunk = SIO_MMAPLOG_CHUNK;
+    }
+    chunk = (chunk + (size_t)page - 1) / (size_t)page * (size_t)page;
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, DEF_MODE);
+    if (log->fd < 0) {
+        return -1;
+    }
+    ssize_t tail = sio_mmaplog_recover(log->fd);
+    if (tail >= 0 && (size_t)tail > max_size) {
+        errno = EFBIG;
+        tail = -1;
+    }
+    if (tail < 0) {
+        int saved = errno;
+        close(log->fd);
+        errno = saved;
+        return -1;
+    }
+    log->base = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     log->fd, 0);
+    if (log->base == MAP_FAILED) {
+        int saved = errno;
+        close(log->fd);
+        errno = saved;
+        return -1;
+    }
+    log->max_size = max_size;
+    log->chunk = chunk;
+    log->tail = (size_t)tail;
+    log->file_size = (size_t)tail;
+    return 0;
+}
+
+/**
+ * @brief   Unmaps a log and truncates its file to the records written.
+ * @return  0 on success, -1 with errno set on error.
+ */
+int sio_mmaplog_close(sio_mmaplog_t *log) {
+    size_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+    bool full = tail > log->max_size;
+    if (full) {
+        tail = log->max_size;
+    }
+    int ret = munmap(log->base, log->max_size);
+    if (ftruncate(log->fd, (off_t)tail) < 0) {
+        ret = -1;
+    }
+    // A record that did not fit left zeros at the end
+    if (full && sio_mmaplog_recover(log->fd) < 0) {
+        ret = -1;
+    }
+    if (close(log->fd) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief   Flushes the records written so far to the disk.
+ * @return  0 on success, -1 with errno set on error.
+ *
+ * This is only needed to survive a crash of the system: records are in the
+ * page cache, and thus survive the process, as soon as they are formatted.
+ */
+int sio_mmaplog_sync(sio_mmaplog_t *log) {
+    size_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+    if (tail > log->max_size) {
+        tail = log->max_size;
+    }
+    return msync(log->base, tail, MS_SYNC);
+}
+
+ssize_t sio_mmaplog_printf(sio_mmaplog_t *log, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_mmaplog_vprintf(log, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/**
+ * @brief   Appends a record to a log.
+ * @param log    The log.
+ * @param fmt    The format string, see sio_vdprintf.
+ * @param argp   The arguments for the format string.
+ * @return       The number of bytes written, or -1 with errno set on error,
+ *               ENOSPC once the log reached its maximum size.
+ *
+ * Records are lines: a newline is added to a record whose format does not end
+ * with one, so that sio_mmaplog_recover finds where each record ends.
+ *
+ * @remark   This function is async-signal-safe only while the record fits in
+ *           the preallocated part of the file: growing it calls
+ *           posix_fallocate or ftruncate, which are not.
+ */
+ssize_t sio_mmaplog_vprintf(sio_mmaplog_t *log, const char *fmt,
+                            va_list argp) {
+    va_list copy;
+    va_copy(copy, argp);
+    ssize_t len = sio_vformat_measure(fmt, copy);
+    va_end(copy);
+    if (len <= 0) {
+        return len;
+    }
+    size_t fmt_len = strlen(fmt);
+    bool newline = fmt_len == 0 || fmt[fmt_len - 1] != '\n';
+    len += newline;
+
+    size_t offset =
+        __atomic_fetch_add(&log->tail, (size_t)len, __ATOMIC_ACQ_REL);
+    if (offset + (size_t)len > log->max_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (mmaplog_grow(log, offset + (size_t)len) < 0) {
+        return -1;
+    }
+
+    mmaplog_region_t region = {log->base + offset, (size_t)len - newline};
+    sio_sink_t sink = {mmaplog_reserve, mmaplog_commit, mmaplog_output,
+                       &region};
+    ssize_t ret = sio_vformat_sink(&sink, fmt, argp);
+    if (ret < 0 || !newline) {
+        return ret;
+    }
+    *region.buffer = '\n';
+    return ret + 1;
+}
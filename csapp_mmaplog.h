@@ -0,0 +1,49 @@
+/**
+ * @file csapp_mmaplog.h
+ * @brief Append-only log file written through a shared memory mapping
+ *
+ * Records, one line each, are formatted straight into a MAP_SHARED mapping of
+ * the log file: a record is measured, its space claimed by advancing the tail
+ * atomically, and it is then formatted in place. No write(2) is involved, and
+ * a record is in the page cache as soon as it is formatted, so it survives the
+ * process crashing right after.
+ *
+ * The whole maximum size is mapped once, so the mapping never moves, and the
+ * file is preallocated in large chunks ahead of the tail. After an unclean
+ * exit the file thus ends with zeros; sio_mmaplog_recover, also used when
+ * reopening a log and by the mmaplog_recover tool, finds the valid tail. Files
+ * that end neither with zeros nor with a newline are refused, not truncated.
+ */
+
+#ifndef CSAPP_MMAPLOG_H
+#define CSAPP_MMAPLOG_H
+
+#include <stdarg.h>    /* va_list */
+#include <stddef.h>    /* size_t */
+#include <sys/types.h> /* ssize_t */
+
+/* Default growth of the file */
+#define SIO_MMAPLOG_CHUNK (1 << 20)
+
+typedef struct {
+    int fd;
+    char *base;       /* Mapping of max_size bytes of the file */
+    size_t max_size;  /* The log cannot grow past this size */
+    size_t chunk;     /* File growth increment */
+    size_t tail;      /* End of the claimed records, advanced atomically */
+    size_t file_size; /* Preallocated size of the file */
+} sio_mmaplog_t;
+
+int sio_mmaplog_open(sio_mmaplog_t *log, const char *path, size_t max_size,
+                     size_t chunk);
+int sio_mmaplog_close(sio_mmaplog_t *log);
+int sio_mmaplog_sync(sio_mmaplog_t *log);
+
+ssize_t sio_mmaplog_printf(sio_mmaplog_t *log, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t sio_mmaplog_vprintf(sio_mmaplog_t *log, const char *fmt, va_list argp)
+    __attribute__((format(printf, 2, 0)));
+
+ssize_t sio_mmaplog_recover(int fd);
+
+#endif // CSAPP_MMAPLOG_H
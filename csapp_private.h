@@ -1,7 +1,10 @@
 #ifndef CSAPP_PRIVATE_H
 #define CSAPP_PRIVATE_H
 
+#include "csapp.h"
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // This float is (-1)^sign * 2^exponent * mantissa (with mantissa an integer)
@@ -37,4 +40,15 @@ void check_POW10TO_N();
 
 unsigned int uint64_leading_zeros(uint64_t n);
 
+size_t sio_uint64_to_decimal(uint64_t v, char *s);
+
+/* Flags of rio_t */
+#define RIO_BUF_MALLOC 0x1 /* rio_bufstart was allocated with malloc() */
+#define RIO_BUF_MMAP 0x2   /* rio_bufstart was allocated with mmap() */
+#define RIO_FILE_MAP 0x4   /* rio_bufstart maps a window of the file */
+#define RIO_PREFETCH 0x8   /* rio_ahead fills the buffers from a thread */
+
+ssize_t rio_fill_more(rio_t *rp);
+size_t rio_capacity(const rio_t *rp);
+
 #endif // CSAPP_PRIVATE_H
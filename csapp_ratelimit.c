@@ -0,0 +1,218 @@
+/**
+ * @file csapp_ratelimit.c
+ * @brief Rate limiting and deduplication of log records, see csapp_ratelimit.h
+ *
+ * Records are first formatted into an output function that only hashes them,
+ * so that a suppressed record costs one formatting pass and no write. Only
+ * records that pass are formatted again, into the real output function.
+ *
+ * The token bucket is a generic cell rate algorithm: each slot holds the
+ * theoretical arrival time of the next record, and a record is accepted if it
+ * is not earlier than that time minus the burst tolerance. This keeps the
+ * whole bucket in a single word updated with compare and swap.
+ */
+
+#include "csapp.h"
+#include "csapp_ratelimit.h"
+
+#include <stdbool.h> /* bool */
+#include <string.h>  /* memset() */
+#include <time.h>    /* clock_gettime() */
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* ratelimit_now - Monotonic time in nanoseconds */
+static uint64_t ratelimit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* fnv1a - Hash len bytes of data into h */
+static uint64_t fnv1a(uint64_t h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* ratelimit_hash_output - Output function hashing a record, see sio_vformat */
+static ssize_t ratelimit_hash_output(void *state, char padding,
+                                     size_t count_left, size_t count_right,
+                                     const char *data, size_t len) {
+    uint64_t *h = state;
+    // Padding is hashed by its length rather than byte by byte
+    size_t counts[2] = {count_left, count_right};
+    *h = fnv1a(*h, &padding, 1);
+    *h = fnv1a(*h, (const char *)counts, sizeof(counts));
+    *h = fnv1a(*h, data, len);
+    return (ssize_t)(count_left + len + count_right);
+}
+
+/**
+ * @brief   Initializes a rate limiter in front of an output function.
+ * @param rl             The rate limiter.
+ * @param output         Where records are written, e.g. sio_write_output.
+ * @param output_state   The state of the output function.
+ * @param window_ms      Repeats of a record within this many milliseconds are
+ *                       suppressed, 0 disables deduplication.
+ * @param rate           Records per second allowed for each call site, 0 for
+ *                       no limit.
+ * @param burst          Records a call site may write at once, at least 1.
+ */
+void sio_ratelimit_init(sio_ratelimit_t *rl, sio_output_function output,
+                        void *output_state, unsigned int window_ms,
+                        unsigned int rate, unsigned int burst) {
+    memset(rl, 0, sizeof(*rl));
+    rl->output = output;
+    rl->output_state = output_state;
+    rl->window_ns = (uint64_t)window_ms * 1000000ULL;
+    if (rate > 0) {
+        rl->interval_ns = 1000000000ULL / rate;
+        rl->burst_ns = rl->interval_ns * (burst > 0 ? burst - 1 : 0);
+    }
+}
+
+/* ratelimit_site - Find or claim the slot of a call site */
+static sio_ratelimit_site_t *ratelimit_site(sio_ratelimit_t *rl,
+                                            const char *fmt) {
+    uint64_t h = (uint64_t)(uintptr_t)fmt * 0x9e3779b97f4a7c15ULL;
+    size_t start = (size_t)(h >> 32) % (SIO_RATELIMIT_SITES - 1);
+    // Short linear probing, the last slot is shared by everyone else
+    for (size_t i = 0; i < 8; i++) {
+        sio_ratelimit_site_t *site =
+            &rl->sites[(start + i) % (SIO_RATELIMIT_SITES - 1)];
+        const char *owner = __atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE);
+        if (owner == fmt) {
+            return site;
+        }
+        if (owner == NULL &&
+            (__atomic_compare_exchange_n(&site->fmt, &owner, fmt, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+             owner == fmt)) {
+            return site;
+        }
+    }
+    return &rl->sites[SIO_RATELIMIT_SITES - 1];
+}
+
+/* ratelimit_take_token - Take a token from the bucket of a site at now */
+static bool ratelimit_take_token(sio_ratelimit_t *rl,
+                                 sio_ratelimit_site_t *site, uint64_t now) {
+    if (rl->interval_ns == 0) {
+        return true;
+    }
+    uint64_t tat = __atomic_load_n(&site->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        uint64_t base = tat > now ? tat : now;
+        if (base - now > rl->burst_ns) {
+            return false;
+        }
+        next = base + rl->interval_ns;
+    } while (!__atomic_compare_exchange_n(&site->tat, &tat, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* ratelimit_summary - Write what was suppressed at a site since last time */
+static ssize_t ratelimit_summary(sio_ratelimit_t *rl,
+                                 sio_ratelimit_site_t *site) {
+    uint32_t repeats = __atomic_exchange_n(&site->repeats, 0, __ATOMIC_RELAXED);
+    uint32_t dropped = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED);
+    ssize_t res = 0;
+    if (repeats > 0) {
+        res = sio_format(rl->output, rl->output_state,
+                         "last message repeated %u times\n", repeats);
+        if (res < 0) {
+            return res;
+        }
+    }
+    if (dropped > 0) {
+        ssize_t r = sio_format(rl->output, rl->output_state,
+                               "rate limit: %u messages suppressed\n", dropped);
+        if (r < 0) {
+            return r;
+        }
+        res += r;
+    }
+    return res;
+}
+
+ssize_t sio_ratelimit_printf(sio_ratelimit_t *rl, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_ratelimit_vprintf(rl, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+/**
+ * @brief   Writes a record, unless it repeats or its call site is over rate.
+ * @param rl     The rate limiter.
+ * @param fmt    The format string, which identifies the call site.
+ * @param argp   The arguments for the format string.
+ * @return       The number of bytes written, summaries included, 0 if the
+ *               record was suppressed, or -1 on error.
+ *
+ * @remark   This function is async-signal-safe.
+ */
+ssize_t sio_ratelimit_vprintf(sio_ratelimit_t *rl, const char *fmt,
+                              va_list argp) {
+    sio_ratelimit_site_t *site = ratelimit_site(rl, fmt);
+    uint64_t now = ratelimit_now();
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if (rl->window_ns > 0) {
+        va_list copy;
+        va_copy(copy, argp);
+        ssize_t r = sio_vformat(ratelimit_hash_output, &hash, fmt, copy);
+        va_end(copy);
+        if (r < 0) {
+            return r;
+        }
+        if (__atomic_load_n(&site->last_hash, __ATOMIC_RELAXED) == hash &&
+            now < __atomic_load_n(&site->window_end, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&site->repeats, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    if (!ratelimit_take_token(rl, site, now)) {
+        __atomic_add_fetch(&site->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    ssize_t res = ratelimit_summary(rl, site);
+    if (res < 0) {
+        return res;
+    }
+    __atomic_store_n(&site->last_hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->window_end, now + rl->window_ns, __ATOMIC_RELAXED);
+    ssize_t r = sio_vformat(rl->output, rl->output_state, fmt, argp);
+    if (r < 0) {
+        return r;
+    }
+    return res + r;
+}
+
+/**
+ * @brief   Writes the pending summaries of every call site.
+ * @param rl   The rate limiter.
+ * @return     The number of bytes written, or -1 on error.
+ *
+ * Call it periodically, or on exit, so that the end of a storm is reported
+ * even if its call site stays quiet afterwards.
+ */
+ssize_t sio_ratelimit_flush(sio_ratelimit_t *rl) {
+    ssize_t res = 0;
+    for (size_t i = 0; i < SIO_RATELIMIT_SITES; i++) {
+        ssize_t r = ratelimit_summary(rl, &rl->sites[i]);
+        if (r < 0) {
+            return r;
+        }
+        res += r;
+    }
+    return res;
+}
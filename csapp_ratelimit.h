@@ -0,0 +1,57 @@
+/**
+ * @file csapp_ratelimit.h
+ * @brief Rate limiting and deduplication of log records
+ *
+ * A sio_ratelimit_t sits in front of an output function. Each format string
+ * is a call site, with its own slot: a record identical to the previous one
+ * of its call site within the deduplication window is only counted, and a
+ * token bucket bounds the rate of records a call site may write. What was
+ * suppressed is reported by a "repeated N times" summary before the next
+ * record written for that call site, or by sio_ratelimit_flush.
+ *
+ * Slots are updated with atomic operations only, so that every function here
+ * is lock-free and async-signal-safe. Under contention on a call site, counts
+ * in the summaries are best effort.
+ */
+
+#ifndef CSAPP_RATELIMIT_H
+#define CSAPP_RATELIMIT_H
+
+#include "csapp.h"
+
+#include <stdarg.h>    /* va_list */
+#include <stdint.h>    /* uint64_t */
+#include <sys/types.h> /* ssize_t */
+
+/* Call sites tracked separately, the others share the last slot */
+#define SIO_RATELIMIT_SITES 64
+
+typedef struct {
+    const char *fmt;    /* Format string of the call site, NULL if free */
+    uint64_t last_hash; /* Hash of the last record written */
+    uint64_t window_end; /* When repeats of it are written again */
+    uint64_t tat;       /* Theoretical arrival time of the token bucket */
+    uint32_t repeats;   /* Records suppressed as repeats */
+    uint32_t dropped;   /* Records suppressed by the token bucket */
+} sio_ratelimit_site_t;
+
+typedef struct {
+    sio_output_function output; /* Where records are written */
+    void *output_state;
+    uint64_t window_ns;   /* Deduplication window, 0 to disable */
+    uint64_t interval_ns; /* Time to earn a token, 0 for no rate limit */
+    uint64_t burst_ns;    /* Tolerance of the bucket, (burst - 1) tokens */
+    sio_ratelimit_site_t sites[SIO_RATELIMIT_SITES];
+} sio_ratelimit_t;
+
+void sio_ratelimit_init(sio_ratelimit_t *rl, sio_output_function output,
+                        void *output_state, unsigned int window_ms,
+                        unsigned int rate, unsigned int burst);
+ssize_t sio_ratelimit_printf(sio_ratelimit_t *rl, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t sio_ratelimit_vprintf(sio_ratelimit_t *rl, const char *fmt,
+                              va_list argp)
+    __attribute__((format(printf, 2, 0)));
+ssize_t sio_ratelimit_flush(sio_ratelimit_t *rl);
+
+#endif // CSAPP_RATELIMIT_H
@@ -0,0 +1,218 @@
+/**
+ * @file csapp_stats.c
+ * @brief Hot path counters and latency histograms, see csapp_stats.h
+ *
+ * Threads claim a slot the first time they record something, and keep it
+ * until the process exits, so that their counts remain part of the totals.
+ * Once all slots are claimed, further threads share the last one.
+ *
+ * Updates are relaxed atomic additions: the slot's cache line is only ever
+ * touched by its own thread, so they do not contend, but a signal handler
+ * interrupting an update of the same counter cannot lose it. Everything here
+ * is async-signal-safe.
+ */
+
+#include "csapp.h"
+#include "csapp_stats.h"
+
+#include <stdbool.h> /* bool */
+#include <string.h>  /* memset() */
+#include <time.h>    /* clock_gettime() */
+
+#define CSAPP_STATS_SLOTS 64
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    uint64_t counters[CSAPP_STAT_COUNT];
+    uint64_t histograms[CSAPP_HIST_COUNT][CSAPP_HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) csapp_stats_slot_t;
+
+static csapp_stats_slot_t csapp_stats_slots[CSAPP_STATS_SLOTS];
+static unsigned int csapp_stats_next_slot;
+static __thread csapp_stats_slot_t *csapp_stats_slot;
+
+static const char *const csapp_stat_names[CSAPP_STAT_COUNT] = {
+    [CSAPP_STAT_SIO_BYTES] = "sio_bytes",
+    [CSAPP_STAT_SIO_WRITES] = "sio_writes",
+    [CSAPP_STAT_SIO_SINK_CALLS] = "sio_sink_calls",
+    [CSAPP_STAT_RIO_READS] = "rio_reads",
+    [CSAPP_STAT_RIO_READ_BYTES] = "rio_read_bytes",
+    [CSAPP_STAT_RIO_READ_EINTR] = "rio_read_eintr",
+    [CSAPP_STAT_RIO_SHORT_READS] = "rio_short_reads",
+    [CSAPP_STAT_RIO_WRITES] = "rio_writes",
+    [CSAPP_STAT_RIO_WRITE_BYTES] = "rio_write_bytes",
+    [CSAPP_STAT_RIO_WRITE_EINTR] = "rio_write_eintr",
+    [CSAPP_STAT_RIO_SHORT_WRITES] = "rio_short_writes",
+};
+
+static const char *const csapp_hist_names[CSAPP_HIST_COUNT] = {
+    [CSAPP_HIST_SIO_VFORMAT] = "sio_vformat",
+    [CSAPP_HIST_SIO_FLOAT] = "sio_float",
+    [CSAPP_HIST_RIO_READN] = "rio_readn",
+    [CSAPP_HIST_RIO_WRITEN] = "rio_writen",
+    [CSAPP_HIST_RIO_READLINEB] = "rio_readlineb",
+};
+
+/* csapp_stats_my_slot - Return the slot of the calling thread */
+static csapp_stats_slot_t *csapp_stats_my_slot(void) {
+    csapp_stats_slot_t *slot = csapp_stats_slot;
+    if (slot == NULL) {
+        unsigned int i =
+            __atomic_fetch_add(&csapp_stats_next_slot, 1, __ATOMIC_RELAXED);
+        if (i >= CSAPP_STATS_SLOTS) {
+            i = CSAPP_STATS_SLOTS - 1;
+        }
+        slot = &csapp_stats_slots[i];
+        csapp_stats_slot = slot;
+    }
+    return slot;
+}
+
+const char *csapp_stat_name(csapp_stat_t stat) {
+    return stat < CSAPP_STAT_COUNT ? csapp_stat_names[stat] : "unknown";
+}
+
+const char *csapp_hist_name(csapp_hist_t hist) {
+    return hist < CSAPP_HIST_COUNT ? csapp_hist_names[hist] : "unknown";
+}
+
+void csapp_stats_add(csapp_stat_t stat, uint64_t n) {
+    csapp_stats_slot_t *slot = csapp_stats_my_slot();
+    __atomic_fetch_add(&slot->counters[stat], n, __ATOMIC_RELAXED);
+}
+
+/* csapp_stats_now - Monotonic time in ns, the start of a measurement */
+uint64_t csapp_stats_now(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* csapp_stats_record - Record the latency of a measurement started at start
+ */
+void csapp_stats_record(csapp_hist_t hist, uint64_t start) {
+    uint64_t now = csapp_stats_now();
+    uint64_t ns = now > start ? now - start : 0;
+    size_t bucket = 0;
+    if (ns != 0) {
+        bucket = (size_t)(64 - __builtin_clzll(ns));
+    }
+    if (bucket >= CSAPP_HIST_BUCKETS) {
+        bucket = CSAPP_HIST_BUCKETS - 1;
+    }
+    csapp_stats_slot_t *slot = csapp_stats_my_slot();
+    __atomic_fetch_add(&slot->histograms[hist][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief   Sums the statistics of all threads.
+ * @param stats   Where to store the totals.
+ *
+ * @remark   This function is async-signal-safe. Counters keep moving while
+ *           they are read, so the snapshot is not atomic as a whole.
+ */
+void csapp_stats_snapshot(csapp_stats_t *stats) {
+    unsigned int used =
+        __atomic_load_n(&csapp_stats_next_slot, __ATOMIC_RELAXED);
+    if (used > CSAPP_STATS_SLOTS) {
+        used = CSAPP_STATS_SLOTS;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = used;
+    for (unsigned int i = 0; i < used; i++) {
+        csapp_stats_slot_t *slot = &csapp_stats_slots[i];
+        for (size_t c = 0; c < CSAPP_STAT_COUNT; c++) {
+            stats->counters[c] +=
+                __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+        }
+        for (size_t h = 0; h < CSAPP_HIST_COUNT; h++) {
+            for (size_t b = 0; b < CSAPP_HIST_BUCKETS; b++) {
+                stats->histograms[h][b] +=
+                    __atomic_load_n(&slot->histograms[h][b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/**
+ * @brief   Resets all counters and histograms to zero.
+ *
+ * Threads keep their slots. Updates racing with the reset may survive it.
+ */
+void csapp_stats_reset(void) {
+    for (size_t i = 0; i < CSAPP_STATS_SLOTS; i++) {
+        csapp_stats_slot_t *slot = &csapp_stats_slots[i];
+        for (size_t c = 0; c < CSAPP_STAT_COUNT; c++) {
+            __atomic_store_n(&slot->counters[c], 0, __ATOMIC_RELAXED);
+        }
+        for (size_t h = 0; h < CSAPP_HIST_COUNT; h++) {
+            for (size_t b = 0; b < CSAPP_HIST_BUCKETS; b++) {
+                __atomic_store_n(&slot->histograms[h][b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/**
+ * @brief   Writes a text dump of the statistics to a file descriptor.
+ * @param fd   The file descriptor to write to.
+ * @return     The number of bytes written, or -1 on error.
+ *
+ * @remark   This function is async-signal-safe, so it can be used from a
+ *           SIGUSR1 handler for instance.
+ *
+ * Counters are written one per line as "name value". Each histogram with data
+ * is written as its name followed by one "[low, high) ns: count" line per
+ * non-empty bucket.
+ */
+ssize_t csapp_stats_dump(int fd) {
+    csapp_stats_t stats;
+    ssize_t res = 0;
+    ssize_t r;
+
+    csapp_stats_snapshot(&stats);
+    r = sio_dprintf(fd, "csapp stats (%u threads)\n", stats.threads);
+    if (r < 0) {
+        return -1;
+    }
+    res += r;
+    for (size_t c = 0; c < CSAPP_STAT_COUNT; c++) {
+        r = sio_dprintf(fd, "%s %llu\n", csapp_stat_names[c],
+                        (unsigned long long)stats.counters[c]);
+        if (r < 0) {
+            return -1;
+        }
+        res += r;
+    }
+    for (size_t h = 0; h < CSAPP_HIST_COUNT; h++) {
+        bool empty = true;
+        for (size_t b = 0; b < CSAPP_HIST_BUCKETS; b++) {
+            if (stats.histograms[h][b] == 0) {
+                continue;
+            }
+            if (empty) {
+                r = sio_dprintf(fd, "%s latency:\n", csapp_hist_names[h]);
+                if (r < 0) {
+                    return -1;
+                }
+                res += r;
+                empty = false;
+            }
+            unsigned long long low = b == 0 ? 0 : 1ULL << (b - 1);
+            if (b == CSAPP_HIST_BUCKETS - 1) {
+                r = sio_dprintf(fd, "  [%llu, inf) ns: %llu\n", low,
+                                (unsigned long long)stats.histograms[h][b]);
+            } else {
+                r = sio_dprintf(fd, "  [%llu, %llu) ns: %llu\n", low, 1ULL << b,
+                                (unsigned long long)stats.histograms[h][b]);
+            }
+            if (r < 0) {
+                return -1;
+            }
+            res += r;
+        }
+    }
+    return res;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file csapp_stats.h
+ * @brief Hot path counters and latency histograms for the sio and rio layers
+ *
+ * The library only updates these statistics when it is built with
+ * CSAPP_HAS_STATS defined; otherwise the hooks compile to nothing, every
+ * snapshot reads as zero, and csapp_stats.c need not be linked at all.
+ *
+ * Each thread updates its own cache-line aligned slot, so that threads do not
+ * contend on the counters. A snapshot sums all slots. Only 64 threads get a
+ * slot of their own: later threads share the last one, so the counts of the
+ * threads past 64 are merged, and snapshots report at most 64 threads.
+ */
+
+#ifndef CSAPP_STATS_H
+#define CSAPP_STATS_H
+
+#include <stdint.h>    /* uint64_t */
+#include <sys/types.h> /* ssize_t */
+
+typedef enum {
+    CSAPP_STAT_SIO_BYTES,       /* Bytes written by sio_write_output */
+    CSAPP_STAT_SIO_WRITES,      /* rio_writen calls from sio_write_output */
+    CSAPP_STAT_SIO_SINK_CALLS,  /* Calls to the sio output functions */
+    CSAPP_STAT_RIO_READS,       /* read() system calls */
+    CSAPP_STAT_RIO_READ_BYTES,  /* Bytes returned by read() */
+    CSAPP_STAT_RIO_READ_EINTR,  /* read() interrupted by a signal */
+    CSAPP_STAT_RIO_SHORT_READS, /* read() returning less than asked */
+    CSAPP_STAT_RIO_WRITES,      /* write() system calls */
+    CSAPP_STAT_RIO_WRITE_BYTES, /* Bytes accepted by write() */
+    CSAPP_STAT_RIO_WRITE_EINTR, /* write() interrupted by a signal */
+    CSAPP_STAT_RIO_SHORT_WRITES, /* write() accepting less than asked */
+    CSAPP_STAT_COUNT,
+} csapp_stat_t;
+
+typedef enum {
+    CSAPP_HIST_SIO_VFORMAT,   /* sio_vformat */
+    CSAPP_HIST_SIO_FLOAT,     /* Float conversions within sio_vformat */
+    CSAPP_HIST_RIO_READN,     /* rio_readn */
+    CSAPP_HIST_RIO_WRITEN,    /* rio_writen */
+    CSAPP_HIST_RIO_READLINEB, /* rio_readlineb */
+    CSAPP_HIST_COUNT,
+} csapp_hist_t;
+
+/* Bucket i counts latencies in [2^(i-1), 2^i) ns, bucket 0 those under 1 ns,
+ * and the last bucket everything above. */
+#define CSAPP_HIST_BUCKETS 40
+
+typedef struct {
+    uint64_t counters[CSAPP_STAT_COUNT];
+    uint64_t histograms[CSAPP_HIST_COUNT][CSAPP_HIST_BUCKETS];
+    unsigned int threads; /* Number of threads that recorded something */
+} csapp_stats_t;
+
+void csapp_stats_snapshot(csapp_stats_t *stats);
+void csapp_stats_reset(void);
+ssize_t csapp_stats_dump(int fd);
+const char *csapp_stat_name(csapp_stat_t stat);
+const char *csapp_hist_name(csapp_hist_t hist);
+
+/* Hooks used by the library */
+void csapp_stats_add(csapp_stat_t stat, uint64_t n);
+uint64_t csapp_stats_now(void);
+void csapp_stats_record(csapp_hist_t hist, uint64_t start);
+
+#ifdef CSAPP_HAS_STATS
+#define CSAPP_STAT_ADD(stat, n) csapp_stats_add((stat), (uint64_t)(n))
+#define CSAPP_STAT_START(var) uint64_t var = csapp_stats_now()
+#define CSAPP_STAT_RECORD(hist, var) csapp_stats_record((hist), (var))
+#else
+#define CSAPP_STAT_ADD(stat, n) ((void)0)
+#define CSAPP_STAT_START(var) ((void)0)
+#define CSAPP_STAT_RECORD(hist, var) ((void)0)
+#endif // CSAPP_HAS_STATS
+
+#endif // CSAPP_STATS_H
@@ -0,0 +1,555 @@
+/**
+ * @file csapp_uring.c
+ * @brief Batched reads, writes and accepts through io_uring, see
+ * csapp_uring.h
+ *
+ * The submission queue tail and the completion queue head are only written by
+ * us, the kernel writes the other ends: entries are published with a release
+ * store of the tail, and completions read after an acquire load of the tail.
+ * Without SQPOLL the kernel consumes every submitted entry during
+ * io_uring_enter, so counting the queued entries is enough to know when the
+ * submission queue is full.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* syscall(), MAP_POPULATE */
+#endif              // __linux__
+
+#include "csapp.h"
+#include "csapp_private.h"
+#include "csapp_uring.h"
+
+#include <errno.h>      /* errno */
+#include <stdbool.h>    /* bool */
+#include <stdlib.h>     /* malloc() */
+#include <string.h>     /* memset() */
+#include <sys/socket.h> /* accept() */
+#include <unistd.h>     /* read() */
+
+/* CSAPP_NO_URING builds the blocking fallback only */
+#if defined(__linux__) && defined(__has_include) && !defined(CSAPP_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define RIO_HAVE_URING
+#include <linux/io_uring.h> /* struct io_uring_sqe */
+#include <sys/mman.h>       /* mmap() */
+#include <sys/syscall.h>    /* __NR_io_uring_setup */
+#endif
+#endif // __linux__ && __has_include
+
+/* user_data of the operations of the synchronous wrappers */
+#define RIO_URING_SYNC UINT64_MAX
+/* Longest read or write, longer ones are short transfers like with read() */
+#define RIO_URING_MAX_LEN (1U << 30)
+
+#ifdef RIO_HAVE_URING
+/* rio_uring_unmap - Unmap the rings and close the io_uring descriptor */
+static void rio_uring_unmap(rio_uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->ring_fd);
+    ring->ring_fd = -1;
+    ring->sq_ring = ring->cq_ring = ring->sqes = NULL;
+}
+
+/* rio_uring_map - Map the rings of an io_uring instance */
+static void *rio_uring_map(rio_uring_t *ring, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->ring_fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * rio_uring_supported - Whether the kernel knows every opcode we use. Linux
+ *    5.1 to 5.5 create rings but fail IORING_OP_READ and IORING_OP_WRITE
+ *    with EINVAL, and cannot be probed either.
+ */
+static bool rio_uring_supported(int ring_fd) {
+    static const int opcodes[] = {IORING_OP_READ, IORING_OP_WRITE,
+                                  IORING_OP_ACCEPT};
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+    bool supported = syscall(__NR_io_uring_register, ring_fd,
+                             IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; supported && i < sizeof(opcodes) / sizeof(int); i++) {
+        supported = opcodes[i] <= probe->last_op &&
+                    (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/* rio_uring_setup - Create an io_uring instance, -1 if unavailable */
+static int rio_uring_setup(rio_uring_t *ring, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->ring_fd < 0) {
+        return -1;
+    }
+    if (!rio_uring_supported(ring->ring_fd)) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+        return -1;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = rio_uring_map(ring, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (ring->sq_ring != NULL) {
+        ring->cq_ring = single ? ring->sq_ring
+                               : rio_uring_map(ring, ring->cq_ring_size,
+                                               IORING_OFF_CQ_RING);
+    }
+    if (ring->cq_ring != NULL) {
+        ring->sqes = rio_uring_map(ring, ring->sqes_size, IORING_OFF_SQES);
+    }
+    if (ring->sqes == NULL) {
+        rio_uring_unmap(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    return 0;
+}
+
+/* rio_uring_enter - Submit the queued entries, waiting for min_complete */
+static int rio_uring_enter(rio_uring_t *ring, unsigned int min_complete) {
+    int rc;
+    do {
+        rc = (int)syscall(__NR_io_uring_enter, ring->ring_fd, ring->queued,
+                          min_complete,
+                          min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL,
+                          0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return -1;
+    }
+    ring->queued -= (unsigned int)rc;
+    ring->inflight += (unsigned int)rc;
+    return rc;
+}
+#endif // RIO_HAVE_URING
+
+/*
+ * rio_uring_init - Create a ring for up to entries operations in flight,
+ *    RIO_URING_ENTRIES if 0. Falls back to blocking calls when io_uring is
+ *    unavailable. Returns 0, or -1 with errno set if memory ran out.
+ */
+int rio_uring_init(rio_uring_t *ring, unsigned int entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+    if (entries == 0) {
+        entries = RIO_URING_ENTRIES;
+    }
+#ifdef RIO_HAVE_URING
+    if (rio_uring_setup(ring, entries) == 0) {
+        return 0;
+    }
+#endif // RIO_HAVE_URING
+    ring->entries = entries;
+    ring->ops = calloc(entries, sizeof(*ring->ops));
+    ring->done_size = 2 * entries;
+    ring->done = calloc(ring->done_size, sizeof(*ring->done));
+    if (ring->ops == NULL || ring->done == NULL) {
+        rio_uring_close(ring);
+        return -1; /* errno set by calloc() */
+    }
+    return 0;
+}
+
+/*
+ * rio_uring_close - Release a ring. Operations still in flight complete in
+ *    the kernel, and their buffers must stay valid until they do.
+ */
+void rio_uring_close(rio_uring_t *ring) {
+#ifdef RIO_HAVE_URING
+    if (ring->ring_fd >= 0) {
+        rio_uring_unmap(ring);
+    }
+#endif // RIO_HAVE_URING
+    free(ring->ops);
+    free(ring->done);
+    ring->ops = NULL;
+    ring->done = NULL;
+}
+
+/*
+ * rio_uring_enabled - Whether operations go through io_uring, rather than
+ *    blocking system calls
+ */
+int rio_uring_enabled(const rio_uring_t *ring) {
+    return ring->ring_fd >= 0;
+}
+
+/* rio_uring_queue - Queue an operation, submitting the queue if full */
+static int rio_uring_queue(rio_uring_t *ring, rio_uring_opcode_t opcode,
+                           int fd, void *buf, size_t len,
+                           uint64_t user_data) {
+    if (ring->queued == ring->entries && rio_uring_submit(ring) < 0) {
+        return -1;
+    }
+    if (len > RIO_URING_MAX_LEN) {
+        len = RIO_URING_MAX_LEN;
+    }
+#ifdef RIO_HAVE_URING
+    if (ring->ring_fd >= 0) {
+        unsigned int tail = *ring->sq_tail;
+        unsigned int index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->user_data = user_data;
+        if (opcode == RIO_URING_ACCEPT) {
+            sqe->opcode = IORING_OP_ACCEPT;
+        } else {
+            sqe->opcode =
+                opcode == RIO_URING_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->len = (uint32_t)len;
+            sqe->off = (uint64_t)-1; /* At the file offset, like read() */
+        }
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring->queued++;
+        return 0;
+    }
+#endif // RIO_HAVE_URING
+    rio_uring_op_t *op = &ring->ops[ring->queued++];
+    op->opcode = opcode;
+    op->fd = fd;
+    op->buf = buf;
+    op->len = len;
+    op->user_data = user_data;
+    return 0;
+}
+
+/*
+ * rio_uring_prep_read - Queue a read() of up to len bytes into buf.
+ *    Returns 0, or -1 with errno set if the queue was full and could not be
+ *    submitted.
+ */
+int rio_uring_prep_read(rio_uring_t *ring, int fd, void *buf, size_t len,
+                        uint64_t user_data) {
+    return rio_uring_queue(ring, RIO_URING_READ, fd, buf, len, user_data);
+}
+
+/*
+ * rio_uring_prep_write - Queue a write() of up to len bytes from buf.
+ *    Returns 0, or -1 with errno set if the queue was full and could not be
+ *    submitted.
+ */
+int rio_uring_prep_write(rio_uring_t *ring, int fd, const void *buf,
+                         size_t len, uint64_t user_data) {
+    return rio_uring_queue(ring, RIO_URING_WRITE, fd, (void *)buf, len,
+                           user_data);
+}
+
+/*
+ * rio_uring_prep_accept - Queue an accept() on a listening socket. Returns
+ *    0, or -1 with errno set if the queue was full and could not be
+ *    submitted.
+ */
+int rio_uring_prep_accept(rio_uring_t *ring, int fd, uint64_t user_data) {
+    return rio_uring_queue(ring, RIO_URING_ACCEPT, fd, NULL, 0, user_data);
+}
+
+/* rio_uring_blocking - Run a queued operation as a blocking system call */
+static ssize_t rio_uring_blocking(const rio_uring_op_t *op) {
+    ssize_t res;
+    do {
+        switch (op->opcode) {
+        case RIO_URING_READ:
+            res = read(op->fd, op->buf, op->len);
+            break;
+        case RIO_URING_WRITE:
+            res = write(op->fd, op->buf, op->len);
+            break;
+        default:
+            res = accept(op->fd, NULL, NULL);
+            break;
+        }
+    } while (res < 0 && errno == EINTR);
+    return res < 0 ? -errno : res;
+}
+
+/*
+ * rio_uring_grow_done - Double the completion queue of the fallback, which
+ *    keeps every completion, like io_uring does when its ring overflows
+ */
+static int rio_uring_grow_done(rio_uring_t *ring) {
+    unsigned int size = 2 * ring->done_size;
+    rio_uring_cqe_t *done = malloc(size * sizeof(*done));
+    if (done == NULL) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < ring->done_count; i++) {
+        done[i] = ring->done[(ring->done_head + i) % ring->done_size];
+    }
+    free(ring->done);
+    ring->done = done;
+    ring->done_head = 0;
+    ring->done_size = size;
+    return 0;
+}
+
+/*
+ * rio_uring_submit - Submit the queued operations with a single system
+ *    call. Without io_uring, they run now, in order. Returns the number of
+ *    operations submitted, or -1 with errno set on error.
+ */
+int rio_uring_submit(rio_uring_t *ring) {
+    if (ring->queued == 0) {
+        return 0;
+    }
+#ifdef RIO_HAVE_URING
+    if (ring->ring_fd >= 0) {
+        return rio_uring_enter(ring, 0);
+    }
+#endif // RIO_HAVE_URING
+    unsigned int n = ring->queued;
+    if (ring->done_count + n > ring->done_size &&
+        rio_uring_grow_done(ring) < 0) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        rio_uring_cqe_t *cqe =
+            &ring->done[(ring->done_head + ring->done_count) % ring->done_size];
+        cqe->user_data = ring->ops[i].user_data;
+        cqe->res = rio_uring_blocking(&ring->ops[i]);
+        ring->done_count++;
+    }
+    ring->queued = 0;
+    return (int)n;
+}
+
+/*
+ * rio_uring_peek - Take a completion if one is ready. Returns 1 if cqe was
+ *    filled, 0 otherwise.
+ */
+int rio_uring_peek(rio_uring_t *ring, rio_uring_cqe_t *cqe) {
+#ifdef RIO_HAVE_URING
+    if (ring->ring_fd >= 0) {
+        unsigned int head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        struct io_uring_cqe *c =
+            (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+        cqe->user_data = c->user_data;
+        cqe->res = c->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        ring->inflight--;
+        return 1;
+    }
+#endif // RIO_HAVE_URING
+    if (ring->done_count == 0) {
+        return 0;
+    }
+    *cqe = ring->done[ring->done_head];
+    ring->done_head = (ring->done_head + 1) % ring->done_size;
+    ring->done_count--;
+    return 1;
+}
+
+/*
+ * rio_uring_wait - Submit the queued operations and wait for a completion.
+ *    Returns 0 once cqe is filled, or -1 with errno set on error, EAGAIN if
+ *    no operation is in flight.
+ */
+int rio_uring_wait(rio_uring_t *ring, rio_uring_cqe_t *cqe) {
+    for (;;) {
+        if (rio_uring_peek(ring, cqe)) {
+            return 0;
+        }
+#ifdef RIO_HAVE_URING
+        if (ring->ring_fd >= 0) {
+            if (ring->queued == 0 && ring->inflight == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            if (rio_uring_enter(ring, 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+#endif // RIO_HAVE_URING
+        if (ring->queued == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (rio_uring_submit(ring) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* rio_uring_idle - Whether no operation is queued or in flight */
+static bool rio_uring_idle(const rio_uring_t *ring) {
+    return ring->queued == 0 && ring->inflight == 0 && ring->done_count == 0;
+}
+
+/* rio_uring_transfer - One read or write through the ring, -1 on error */
+static ssize_t rio_uring_transfer(rio_uring_t *ring, rio_uring_opcode_t op,
+                                  int fd, void *buf, size_t len) {
+    rio_uring_cqe_t cqe;
+    do {
+        if (rio_uring_queue(ring, op, fd, buf, len, RIO_URING_SYNC) < 0 ||
+            rio_uring_wait(ring, &cqe) < 0) {
+            return -1;
+        }
+    } while (cqe.res == -EINTR);
+    if (cqe.res < 0) {
+        errno = (int)-cqe.res;
+        return -1;
+    }
+    return cqe.res;
+}
+
+/*
+ * rio_uring_readn - Robustly read n bytes (unbuffered), like rio_readn,
+ *    through the ring. No other operation may be in flight. Returns the
+ *    number of bytes read, short only on EOF, or -1 on error.
+ */
+ssize_t rio_uring_readn(rio_uring_t *ring, int fd, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    char *bufp = usrbuf;
+
+    if (!rio_uring_enabled(ring)) {
+        return rio_readn(fd, usrbuf, n);
+    }
+    if (!rio_uring_idle(ring)) {
+        errno = EBUSY;
+        return -1;
+    }
+    while (nleft > 0) {
+        ssize_t nread = rio_uring_transfer(ring, RIO_URING_READ, fd, bufp,
+                                           nleft);
+        if (nread < 0) {
+            return -1;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        nleft -= (size_t)nread;
+        bufp += nread;
+    }
+    return (ssize_t)(n - nleft);
+}
+
+/*
+ * rio_uring_writen - Robustly write n bytes (unbuffered), like rio_writen,
+ *    through the ring. No other operation may be in flight. Returns n, or
+ *    -1 on error.
+ */
+ssize_t rio_uring_writen(rio_uring_t *ring, int fd, const void *usrbuf,
+                         size_t n) {
+    size_t nleft = n;
+    const char *bufp = usrbuf;
+
+    if (!rio_uring_enabled(ring)) {
+        return rio_writen(fd, usrbuf, n);
+    }
+    if (!rio_uring_idle(ring)) {
+        errno = EBUSY;
+        return -1;
+    }
+    while (nleft > 0) {
+        ssize_t nwritten = rio_uring_transfer(ring, RIO_URING_WRITE, fd,
+                                              (void *)bufp, nleft);
+        if (nwritten < 0) {
+            return -1;
+        }
+        nleft -= (size_t)nwritten;
+        bufp += nwritten;
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * rio_uring_fillv - Refill the empty buffers of n rio_t with one batch of
+ *    reads, ring->entries at a time. Buffers with unread bytes, mapped
+ *    files, prefetching and adaptive rio_t are left alone, the latter
+ *    since their size is only adapted by rio_read. No other operation may
+ *    be in flight. Returns the number of rio_t with unread bytes
+ *    afterwards, or -1 with errno set if a read failed; the others are
+ *    refilled all the same. If queueing fails, the reads already queued
+ *    are waited for before returning -1, so that none is left writing into
+ *    a buffer. If waiting itself fails, reads may still be in flight: the
+ *    ring must then be closed before the rio_t are used or freed.
+ */
+ssize_t rio_uring_fillv(rio_uring_t *ring, rio_t **rps, size_t n) {
+    size_t ready = 0;
+    int error = 0;
+
+    if (!rio_uring_idle(ring)) {
+        errno = EBUSY;
+        return -1;
+    }
+    for (size_t i = 0; i < n && error == 0;) {
+        unsigned int pending = 0;
+        for (; i < n && pending < ring->entries; i++) {
+            rio_t *rp = rps[i];
+            if (rp->rio_cnt > 0) {
+                ready++;
+                continue;
+            }
+            if (rp->rio_flags & (RIO_FILE_MAP | RIO_PREFETCH) ||
+                rp->rio_bufmax > 0) {
+                continue;
+            }
+            rp->rio_cnt = 0;
+            if (rio_uring_prep_read(ring, rp->rio_fd, rp->rio_bufstart,
+                                    rp->rio_bufsize, i) < 0) {
+                error = errno;
+                break;
+            }
+            pending++;
+        }
+        while (pending > 0) {
+            rio_uring_cqe_t cqe;
+            if (rio_uring_wait(ring, &cqe) < 0) {
+                return -1;
+            }
+            pending--;
+            rio_t *rp = rps[cqe.user_data];
+            if (cqe.res > 0) {
+                rp->rio_cnt = cqe.res;
+                rp->rio_bufptr = rp->rio_bufstart;
+                ready++;
+            } else if (cqe.res < 0 && cqe.res != -EINTR && error == 0) {
+                error = (int)-cqe.res;
+            }
+        }
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return (ssize_t)ready;
+}
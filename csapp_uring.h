@@ -0,0 +1,91 @@
+/**
+ * @file csapp_uring.h
+ * @brief Batched reads, writes and accepts through io_uring
+ *
+ * A rio_uring_t queues operations, submits a whole batch with one
+ * io_uring_enter(2), and reports their completions, tagged with the caller's
+ * user_data. rio_uring_readn and rio_uring_writen wrap single operations with
+ * the robust semantics of rio_readn and rio_writen, and rio_uring_fillv
+ * refills the buffers of many rio_t at once.
+ *
+ * The ring is driven with raw system calls, without liburing. When io_uring
+ * is unavailable (Linux before 5.6, other systems, disabled by sysctl or
+ * seccomp), rio_uring_init still succeeds and every operation runs as the
+ * blocking system call, in order, when it is submitted.
+ */
+
+#ifndef CSAPP_URING_H
+#define CSAPP_URING_H
+
+#include "csapp.h"
+
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <sys/types.h> /* ssize_t */
+
+/* Default number of operations in flight */
+#define RIO_URING_ENTRIES 64
+
+typedef enum {
+    RIO_URING_READ,
+    RIO_URING_WRITE,
+    RIO_URING_ACCEPT,
+} rio_uring_opcode_t;
+
+/* A queued operation, used when io_uring is unavailable */
+typedef struct {
+    rio_uring_opcode_t opcode;
+    int fd;
+    void *buf;
+    size_t len;
+    uint64_t user_data;
+} rio_uring_op_t;
+
+/* The completion of an operation */
+typedef struct {
+    uint64_t user_data;
+    ssize_t res; /* What the system call returned, or -errno */
+} rio_uring_cqe_t;
+
+typedef struct {
+    int ring_fd; /* -1 when operations run as blocking calls */
+    unsigned int entries;
+    unsigned int queued;   /* Operations not submitted yet */
+    unsigned int inflight; /* Submitted to io_uring, not reaped yet */
+
+    /* Submission and completion rings shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+
+    /* Blocking fallback: queued operations and their completions */
+    rio_uring_op_t *ops;
+    rio_uring_cqe_t *done; /* Circular, grown when full */
+    unsigned int done_head, done_count, done_size;
+} rio_uring_t;
+
+int rio_uring_init(rio_uring_t *ring, unsigned int entries);
+void rio_uring_close(rio_uring_t *ring);
+int rio_uring_enabled(const rio_uring_t *ring);
+
+int rio_uring_prep_read(rio_uring_t *ring, int fd, void *buf, size_t len,
+                        uint64_t user_data);
+int rio_uring_prep_write(rio_uring_t *ring, int fd, const void *buf,
+                         size_t len, uint64_t user_data);
+int rio_uring_prep_accept(rio_uring_t *ring, int fd, uint64_t user_data);
+int rio_uring_submit(rio_uring_t *ring);
+int rio_uring_wait(rio_uring_t *ring, rio_uring_cqe_t *cqe);
+int rio_uring_peek(rio_uring_t *ring, rio_uring_cqe_t *cqe);
+
+ssize_t rio_uring_readn(rio_uring_t *ring, int fd, void *usrbuf, size_t n);
+ssize_t rio_uring_writen(rio_uring_t *ring, int fd, const void *usrbuf,
+                         size_t n);
+ssize_t rio_uring_fillv(rio_uring_t *ring, rio_t **rps, size_t n);
+
+#endif // CSAPP_URING_H
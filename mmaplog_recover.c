@@ -0,0 +1,42 @@
+/*
+ * mmaplog_recover - Truncate logs written with csapp_mmaplog.h after an
+ * unclean exit to their last complete record.
+ *
+ * usage: mmaplog_recover <log file>...
+ */
+
+#include "csapp.h"
+#include "csapp_mmaplog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        sio_eprintf("usage: %s <log file>...\n", argv[0]);
+        return 2;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        struct stat st;
+        int fd = open(argv[i], O_RDWR);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            sio_eprintf("%s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        ssize_t valid = sio_mmaplog_recover(fd);
+        if (valid < 0) {
+            sio_eprintf("%s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        } else {
+            sio_printf("%s: %zd bytes of records, %lld bytes dropped\n",
+                       argv[i], valid, (long long)(st.st_size - valid));
+        }
+        close(fd);
+    }
+    return status;
+}
@@ -0,0 +1,119 @@
+#include "csapp.h"
+#include "csapp_columns.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROWS 100000
+
+static int64_t ids[ROWS];
+static uint64_t counts[ROWS];
+static double prices[ROWS];
+static char expected_wide[3 * 20400];
+
+/* Formats the rows with snprintf, one call per row */
+static char *reference(size_t rows, char delimiter, int precision,
+                       size_t *len) {
+    size_t size = rows * 80 + 1;
+    char *data = malloc(size);
+    *len = 0;
+    for (size_t i = 0; i < rows; i++) {
+        *len += (size_t)snprintf(data + *len, size - *len,
+                                 "%lld%c%llu%c%.*f\n", (long long)ids[i],
+                                 delimiter, (unsigned long long)counts[i],
+                                 delimiter, precision, prices[i]);
+    }
+    return data;
+}
+
+int main(void) {
+    for (size_t i = 0; i < ROWS; i++) {
+        ids[i] = (int64_t)(i * 2654435761u) - (int64_t)(i << 20);
+        counts[i] = (uint64_t)i * 11400714819323198485ULL;
+        prices[i] = (double)(i % 1000) / 8.0 - 20.0;
+    }
+    ids[1] = INT64_MIN;
+    ids[2] = INT64_MAX;
+    counts[3] = UINT64_MAX;
+    prices[4] = -0.0;
+    prices[5] = 1e21;
+    prices[6] = 0.0005;
+
+    size_t size = ROWS * 80 + 1;
+    char *out = malloc(size);
+    sio_column_t columns[] = {
+        {SIO_COLUMN_INT64, ids, 0},
+        {SIO_COLUMN_UINT64, counts, 0},
+        {SIO_COLUMN_DOUBLE, prices, 3},
+    };
+    {
+        // CSV into a reserve/commit sink, like printf row by row
+        sio_buffer_output_t state = {out, size - 1};
+        sio_sink_t sink = {sio_buffer_reserve, sio_buffer_commit,
+                           sio_buffer_output, &state};
+        ssize_t ret = sio_format_columns(&sink, columns, 3, ROWS, ',');
+        size_t len;
+        char *expected = reference(ROWS, ',', 3, &len);
+        printf("csv: %zd bytes, first rows:\n%.*s", ret,
+               (int)(strchr(strchr(out, '\n') + 1, '\n') + 1 - out), out);
+        sio_assert(ret == (ssize_t)len);
+        sio_assert(memcmp(out, expected, len) == 0);
+        free(expected);
+    }
+    {
+        // TSV into an output-only sink, default precision
+        columns[2].precision = -1;
+        sio_buffer_output_t state = {out, size - 1};
+        sio_sink_t sink = SIO_OUTPUT_SINK(sio_buffer_output, &state);
+        ssize_t ret = sio_format_columns(&sink, columns, 3, ROWS, '\t');
+        size_t len;
+        char *expected = reference(ROWS, '\t', 6, &len);
+        printf("tsv: %zd bytes\n", ret);
+        sio_assert(ret == (ssize_t)len);
+        sio_assert(memcmp(out, expected, len) == 0);
+
+        // Several threads produce the same output in order
+        state.buffer = out;
+        state.remaining = size - 1;
+        memset(out, 0, size);
+        ret = sio_format_columns_parallel(&sink, columns, 3, ROWS, '\t', 4);
+        printf("tsv with 4 threads: %zd bytes\n", ret);
+        sio_assert(ret == (ssize_t)len);
+        sio_assert(memcmp(out, expected, len) == 0);
+        free(expected);
+    }
+    {
+        // Values longer than a block bypass it, between reserved blocks
+        static double wide[3] = {0.5, 1.25, 1e300};
+        sio_column_t column = {SIO_COLUMN_DOUBLE, wide, 20000};
+        sio_buffer_output_t state = {out, size - 1};
+        sio_sink_t sink = {sio_buffer_reserve, sio_buffer_commit,
+                           sio_buffer_output, &state};
+        ssize_t ret = sio_format_columns(&sink, &column, 1, 3, ',');
+        size_t len = 0;
+        for (int i = 0; i < 3; i++) {
+            len += (size_t)snprintf(expected_wide + len,
+                                    sizeof(expected_wide) - len, "%.20000f\n",
+                                    wide[i]);
+        }
+        printf("wide values: %zd bytes\n", ret);
+        sio_assert(ret == (ssize_t)len);
+        sio_assert(memcmp(out, expected_wide, len) == 0);
+    }
+    {
+        // A sink too small fails, with or without threads
+        sio_buffer_trunc_output_t state = {{out, 1000}};
+        sio_sink_t sink = SIO_OUTPUT_SINK(sio_buffer_trunc_output, &state);
+        ssize_t ret = sio_format_columns(&sink, columns, 3, ROWS, ',');
+        sio_assert(ret == SIO_OUTPUT_FULL);
+        state.buffer.buffer = out;
+        state.buffer.remaining = 1000;
+        ret = sio_format_columns_parallel(&sink, columns, 3, ROWS, ',', 3);
+        sio_assert(ret == SIO_OUTPUT_FULL);
+        printf("full sink: %zd\n", ret);
+    }
+    free(out);
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include "csapp.h"
+#include "csapp_http.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Checks that a view holds exactly the string s */
+static int equals(rio_line_t view, const char *s) {
+    return view.len == strlen(s) && memcmp(view.data, s, view.len) == 0;
+}
+
+/* Parses buf as a request, expecting failure with err */
+static void bad_request(const char *buf, int err) {
+    static rio_http_message_t msg;
+    errno = 0;
+    sio_assert(rio_http_parse_request(buf, strlen(buf), 0, &msg) == -1);
+    sio_assert(errno == err);
+}
+
+int main(void) {
+    static rio_http_message_t msg;
+    {
+        // A simple request, every prefix of it incomplete
+        const char *req = "GET /index.html?q=1 HTTP/1.1\r\n"
+                          "Host: example.com\r\n"
+                          "Accept:  */*  \r\n"
+                          "X-Empty:\r\n"
+                          "\r\n"
+                          "body";
+        size_t head = strlen(req) - 4;
+        for (size_t len = 0; len < head; len++) {
+            sio_assert(rio_http_parse_request(req, len, 0, &msg) ==
+                       RIO_AGAIN);
+        }
+        sio_assert(rio_http_parse_request(req, strlen(req), 0, &msg) ==
+                   (ssize_t)head);
+        sio_assert(equals(msg.method, "GET"));
+        sio_assert(equals(msg.uri, "/index.html?q=1"));
+        sio_assert(msg.minor_version == 1);
+        sio_assert(msg.nheaders == 3);
+        sio_assert(equals(msg.headers[0].name, "Host"));
+        sio_assert(equals(msg.headers[0].value, "example.com"));
+        sio_assert(equals(*rio_http_header(&msg, "accept"), "*/*"));
+        sio_assert(equals(*rio_http_header(&msg, "X-EMPTY"), ""));
+        sio_assert(rio_http_header(&msg, "Host:") == NULL);
+        sio_assert(msg.uri.data == req + 4); // A view, not a copy
+        printf("request: %.*s %.*s, %zu headers, %zu bytes\n",
+               (int)msg.method.len, msg.method.data, (int)msg.uri.len,
+               msg.uri.data, msg.nheaders, head);
+
+        // Resuming with last_len gives the same result
+        size_t last_len = 0;
+        ssize_t rc = RIO_AGAIN;
+        for (size_t len = 1; rc == RIO_AGAIN; len++) {
+            rc = rio_http_parse_request(req, len, last_len, &msg);
+            last_len = len;
+        }
+        sio_assert(rc == (ssize_t)head && msg.nheaders == 3);
+
+        // Bare newlines and empty lines before the request line
+        const char *lf = "\r\n\nPOST * HTTP/1.0\nA: b\n\n";
+        sio_assert(rio_http_parse_request(lf, strlen(lf), 0, &msg) ==
+                   (ssize_t)strlen(lf));
+        sio_assert(equals(msg.method, "POST") && equals(msg.uri, "*"));
+        sio_assert(msg.minor_version == 0 && msg.nheaders == 1);
+        sio_assert(equals(msg.headers[0].value, "b"));
+    }
+    {
+        // Malformed heads
+        bad_request("GET / HTTP/1.1\r\nHost : a\r\n\r\n", EBADMSG);
+        bad_request("GET / HTTP/1.1\r\n: a\r\n\r\n", EBADMSG);
+        bad_request("GET / HTTP/1.1\r\nA: b\r\n c\r\n\r\n", EBADMSG);
+        bad_request("GET / HTTP/1.1\r\nA: b\rc\r\n\r\n", EBADMSG);
+        bad_request("GET / HTTP/2.0\r\n\r\n", EBADMSG);
+        bad_request("GET / HTTP/1.1 \r\n\r\n", EBADMSG);
+        bad_request("GET  / HTTP/1.1\r\n\r\n", EBADMSG);
+        bad_request("G(T / HTTP/1.1\r\n\r\n", EBADMSG);
+        bad_request("GET /a\x7f HTTP/1.1\r\n\r\n", EBADMSG);
+        bad_request("GET /\tb HTTP/1.1\r\n\r\n", EBADMSG);
+        bad_request("GET /\r\n\r\n", EBADMSG);
+
+        char many[4096] = "GET / HTTP/1.1\r\n";
+        for (int i = 0; i <= RIO_HTTP_MAX_HEADERS; i++) {
+            strcat(many, "A: b\r\n");
+        }
+        strcat(many, "\r\n");
+        bad_request(many, EMSGSIZE);
+        printf("malformed requests rejected\n");
+    }
+    {
+        // Forbidden bytes at every offset of long values, through the SIMD
+        // blocks and the scalar tail; tabs and obs-text are allowed
+        static char buf[512];
+        const char *prefix = "GET / HTTP/1.1\r\nV: ";
+        size_t plen = strlen(prefix);
+        for (size_t vlen = 1; vlen < 100; vlen++) {
+            for (size_t at = 0; at < vlen; at++) {
+                memcpy(buf, prefix, plen);
+                for (size_t i = 0; i < vlen; i++) {
+                    buf[plen + i] = (char)(i % 3 == 1 ? '\t' : 0x80 + i);
+                }
+                buf[plen] = 'v';
+                buf[plen + vlen - 1] = 'v';
+                memcpy(buf + plen + vlen, "\r\n\r\n", 4);
+                size_t len = plen + vlen + 4;
+                sio_assert(rio_http_parse_request(buf, len, 0, &msg) ==
+                           (ssize_t)len);
+                sio_assert(msg.headers[0].value.len == vlen);
+                if (at == 0 || at == vlen - 1) {
+                    continue; // Would only be trimmed
+                }
+                buf[plen + at] = at % 2 ? '\x01' : '\x7f';
+                sio_assert(rio_http_parse_request(buf, len, 0, &msg) == -1);
+                sio_assert(errno == EBADMSG);
+            }
+        }
+        // And in long URIs
+        for (size_t at = 1; at < 100; at++) {
+            memcpy(buf, "GET /", 5);
+            memset(buf + 5, 'u', 100);
+            memcpy(buf + 105, " HTTP/1.1\r\n\r\n", 13);
+            buf[5 + at] = '\x1f';
+            sio_assert(rio_http_parse_request(buf, 118, 0, &msg) == -1);
+        }
+        printf("control bytes found at every offset\n");
+    }
+    {
+        // Responses
+        const char *res = "HTTP/1.1 404 Not Found\r\n"
+                          "Content-Length: 0\r\n\r\n"
+                          "HTTP/1.0 204\r\n\r\n";
+        ssize_t rc = rio_http_parse_response(res, strlen(res), 0, &msg);
+        sio_assert(rc == 45);
+        sio_assert(msg.status == 404 && msg.minor_version == 1);
+        sio_assert(equals(msg.reason, "Not Found"));
+        sio_assert(equals(*rio_http_header(&msg, "content-length"), "0"));
+        sio_assert(rio_http_parse_response(res + rc, strlen(res + rc), 0,
+                                           &msg) == 16);
+        sio_assert(msg.status == 204 && msg.reason.len == 0);
+        sio_assert(msg.nheaders == 0);
+        printf("responses: 404 Not Found, then %d\n", msg.status);
+        const char *bad = "HTTP/1.1 20 OK\r\n\r\n";
+        sio_assert(rio_http_parse_response(bad, strlen(bad), 0, &msg) == -1);
+        bad = "HTTP/1.1 200OK\r\n\r\n";
+        sio_assert(rio_http_parse_response(bad, strlen(bad), 0, &msg) == -1);
+    }
+    {
+        // Pipelined requests on a non-blocking socket, sent a few bytes at a
+        // time: partial heads stay buffered and resume on the next call
+        const char *req = "GET /%d HTTP/1.1\r\nHost: h\r\nX-N: %d\r\n\r\n";
+        static char stream[64 * 1000];
+        size_t len = 0;
+        for (int i = 0; i < 1000; i++) {
+            len += (size_t)snprintf(stream + len, sizeof(stream) - len, req, i,
+                                    i);
+        }
+        int sv[2];
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        sio_assert(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+        static rio_t rio;
+        rio_readinitb(&rio, sv[1]);
+        size_t sent = 0, again = 0;
+        int parsed = 0;
+        for (size_t chunk = 1; parsed < 1000;) {
+            if (sent < len) {
+                size_t n = chunk < len - sent ? chunk : len - sent;
+                sio_assert(rio_writen(sv[0], stream + sent, n) == (ssize_t)n);
+                sent += n;
+                chunk = chunk * 7 % 97 + 1;
+                if (sent == len) {
+                    shutdown(sv[0], SHUT_WR);
+                }
+            }
+            ssize_t rc;
+            while ((rc = rio_http_readrequest(&rio, &msg)) > 0) {
+                char uri[16];
+                snprintf(uri, sizeof(uri), "/%d", parsed);
+                sio_assert(equals(msg.uri, uri));
+                sio_assert(equals(*rio_http_header(&msg, "x-n"), uri + 1));
+                parsed++;
+            }
+            sio_assert(rc == RIO_AGAIN || (rc == 0 && parsed == 1000));
+            again += rc == RIO_AGAIN;
+        }
+        sio_assert(again > 0);
+        sio_assert(rio_http_readrequest(&rio, &msg) == 0);
+        printf("pipelined: %d requests, %zu reads deferred\n", parsed, again);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    {
+        // EOF in the middle of a head, and a head larger than the buffer
+        int sv[2];
+        static rio_t rio;
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        const char *cut = "GET / HTTP/1.1\r\nHost: h\r\n";
+        sio_assert(rio_writen(sv[0], cut, strlen(cut)) ==
+                   (ssize_t)strlen(cut));
+        shutdown(sv[0], SHUT_WR);
+        rio_readinitb(&rio, sv[1]);
+        sio_assert(rio_http_readrequest(&rio, &msg) == -1 && errno == EPROTO);
+        close(sv[0]);
+        close(sv[1]);
+
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        if (fork() == 0) {
+            close(sv[1]);
+            static char big[RIO_BUFSIZE + 100];
+            memset(big, 'a', sizeof(big));
+            memcpy(big, "GET / HTTP/1.1\r\nA: ", 19);
+            rio_writen(sv[0], big, sizeof(big)); // Fails once sv[1] closes
+            _exit(0);
+        }
+        close(sv[0]);
+        rio_readinitb(&rio, sv[1]);
+        sio_assert(rio_http_readrequest(&rio, &msg) == -1 &&
+                   errno == EMSGSIZE);
+        close(sv[1]);
+        wait(NULL);
+        printf("truncated and oversized heads rejected\n");
+    }
+    return 0;
+}
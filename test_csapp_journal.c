@@ -0,0 +1,126 @@
+#include "csapp.h"
+#include "csapp_journal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+static char record[65536];
+static char received[65536];
+
+/* Receives one datagram, or the content of the descriptor passed instead */
+static ssize_t receive(int fd) {
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {received, sizeof(received)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t ret = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret == 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+        int memfd;
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        ret = pread(memfd, received, sizeof(received), 0);
+        close(memfd);
+        printf("(record passed as a descriptor) ");
+    }
+    return ret;
+}
+
+int main(void) {
+    // A local datagram socket stands in for journald
+    char path[64];
+    sio_snprintf(path, sizeof(path), "/tmp/test_csapp_journal.%d", getpid());
+    unlink(path);
+    int server = socket(AF_UNIX, SOCK_DGRAM, 0);
+    sio_assert(server >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sio_assert(bind(server, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    sio_journal_t journal;
+    sio_assert(sio_journal_open(&journal, path, record, sizeof(record)) == 0);
+    {
+        ssize_t ret = sio_journal_printf(&journal, LOG_INFO, "accepted %d", 42);
+        ssize_t len = receive(server);
+        printf("%zd %zd:%.*s", ret, len, (int)len, received);
+        sio_assert(ret == len);
+        sio_assert(memcmp(received, "PRIORITY=6\nMESSAGE=accepted 42\n",
+                          (size_t)len) == 0);
+    }
+    {
+        // Values with a newline use the binary form
+        sio_journal_begin(&journal, LOG_ERR);
+        sio_journal_field(&journal, "MESSAGE", "two\n%s", "lines");
+        sio_journal_field(&journal, "CODE_LINE", "%d", __LINE__);
+        ssize_t ret = sio_journal_send(&journal);
+        ssize_t len = receive(server);
+        printf("%zd %zd\n", ret, len);
+        const char expected[] = "PRIORITY=3\nMESSAGE\n\x09\0\0\0\0\0\0\0"
+                                "two\nlines\nCODE_LINE=";
+        sio_assert(ret == len);
+        sio_assert(memcmp(received, expected, sizeof(expected) - 1) == 0);
+    }
+    {
+        // Invalid names and fields that do not fit fail the whole record
+        sio_journal_begin(&journal, LOG_INFO);
+        sio_assert(sio_journal_field(&journal, "lower", "x") == -1);
+        sio_assert(sio_journal_send(&journal) == -1);
+        sio_journal_begin(&journal, LOG_INFO);
+        sio_assert(sio_journal_field(&journal, "1ST", "x") == -1);
+        sio_assert(sio_journal_send(&journal) == -1);
+        char name[66];
+        memset(name, 'N', sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        sio_journal_begin(&journal, LOG_INFO);
+        sio_assert(sio_journal_field(&journal, name, "x") == -1);
+        sio_assert(sio_journal_send(&journal) == -1);
+        name[64] = '\0';
+        sio_journal_begin(&journal, LOG_INFO);
+        sio_assert(sio_journal_field(&journal, name, "x") > 0);
+
+        char small[32];
+        sio_journal_t tiny = journal;
+        tiny.buffer = small;
+        tiny.size = sizeof(small);
+        sio_journal_begin(&tiny, LOG_INFO);
+        sio_assert(sio_journal_field(&tiny, "MESSAGE", "%s",
+                                     "far too long for the buffer") == -1);
+        sio_assert(sio_journal_send(&tiny) == -1);
+    }
+#ifdef __linux__
+    {
+        // Records larger than a datagram go through a memfd
+        int sndbuf = 4096;
+        setsockopt(journal.fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        char value[40000];
+        memset(value, 'x', sizeof(value) - 1);
+        value[sizeof(value) - 1] = '\0';
+        sio_journal_begin(&journal, LOG_DEBUG);
+        sio_journal_field(&journal, "MESSAGE", "%s", value);
+        ssize_t ret = sio_journal_send(&journal);
+        ssize_t len = receive(server);
+        printf("%zd %zd\n", ret, len);
+        sio_assert(ret == len);
+        sio_assert(len == (ssize_t)(strlen("PRIORITY=7\nMESSAGE=") +
+                                    sizeof(value) - 1 + 1));
+        sio_assert(received[len - 1] == '\n' && received[len - 2] == 'x');
+    }
+#endif // __linux__
+
+    sio_assert(sio_journal_close(&journal) == 0);
+    close(server);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include "csapp.h"
+#include "csapp_mmaplog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define RECORDS 10000
+
+static sio_mmaplog_t log_file;
+static char path[64];
+
+static void *writer(void *arg) {
+    long id = (long)arg;
+    for (int i = 0; i < RECORDS; i++) {
+        sio_mmaplog_printf(&log_file, "thread %ld record %d %s\n", id, i,
+                           "padding to make records a bit longer");
+    }
+    return NULL;
+}
+
+/* Reads the whole log file */
+static char *read_log(size_t *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    sio_assert(fd >= 0 && fstat(fd, &st) == 0);
+    char *data = malloc((size_t)st.st_size + 1);
+    sio_assert(rio_readn(fd, data, (size_t)st.st_size) == st.st_size);
+    data[st.st_size] = '\0';
+    close(fd);
+    *len = (size_t)st.st_size;
+    return data;
+}
+
+int main(void) {
+    sio_snprintf(path, sizeof(path), "/tmp/test_csapp_mmaplog.%d", getpid());
+    unlink(path);
+    {
+        // Concurrent writers never interleave within a record
+        sio_assert(sio_mmaplog_open(&log_file, path, 64 << 20, 1 << 16) == 0);
+        pthread_t threads[THREADS];
+        for (long i = 0; i < THREADS; i++) {
+            pthread_create(&threads[i], NULL, writer, (void *)i);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        sio_assert(sio_mmaplog_close(&log_file) == 0);
+
+        size_t len;
+        char *data = read_log(&len);
+        size_t lines = 0;
+        for (char *line = strtok(data, "\n"); line != NULL;
+             line = strtok(NULL, "\n")) {
+            long id;
+            int i;
+            char rest[64];
+            sio_assert(sscanf(line, "thread %ld record %d %63[^\n]", &id, &i,
+                              rest) == 3);
+            sio_assert(strcmp(rest, "padding to make records a bit longer") ==
+                       0);
+            lines++;
+        }
+        printf("%zu bytes, %zu records\n", len, lines);
+        sio_assert(lines == THREADS * RECORDS);
+        free(data);
+    }
+    {
+        // Records survive a crash, recovery drops the preallocated zeros
+        pid_t pid = fork();
+        if (pid == 0) {
+            sio_assert(sio_mmaplog_open(&log_file, path, 64 << 20, 1 << 20) ==
+                       0);
+            sio_mmaplog_printf(&log_file, "before crash %d\n", 1);
+            sio_mmaplog_printf(&log_file, "before crash %d\n", 2);
+            abort();
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        sio_assert(WIFSIGNALED(status));
+
+        struct stat st;
+        sio_assert(stat(path, &st) == 0);
+        sio_assert(st.st_size % (1 << 20) == 0);
+        int fd = open(path, O_RDWR);
+        ssize_t valid = sio_mmaplog_recover(fd);
+        close(fd);
+        size_t len;
+        char *data = read_log(&len);
+        printf("recovered %zd of %lld bytes: %s", valid, (long long)st.st_size,
+               strstr(data, "before crash 1"));
+        sio_assert((size_t)valid == len);
+        sio_assert(strcmp(strstr(data, "before crash 1"),
+                          "before crash 1\nbefore crash 2\n") == 0);
+        free(data);
+    }
+    {
+        // A clean log is reopened as is, other files are refused untouched
+        const char *contents[] = {"a\n", "no newline", "a\nb"};
+        for (int i = 0; i < 3; i++) {
+            int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            size_t n = strlen(contents[i]);
+            sio_assert(rio_writen(fd, contents[i], n) == (ssize_t)n);
+            close(fd);
+            int rc = sio_mmaplog_open(&log_file, path, 1 << 20, 0);
+            if (i == 0) {
+                sio_assert(rc == 0);
+                sio_mmaplog_printf(&log_file, "%s\n", "b");
+                sio_assert(sio_mmaplog_close(&log_file) == 0);
+            } else {
+                sio_assert(rc == -1 && errno == EINVAL);
+            }
+            size_t len;
+            char *data = read_log(&len);
+            sio_assert(strcmp(data, i == 0 ? "a\nb\n" : contents[i]) == 0);
+            free(data);
+        }
+        printf("clean log kept, other files refused\n");
+
+        // Records formatted without a newline still end lines
+        unlink(path);
+        sio_assert(sio_mmaplog_open(&log_file, path, 1 << 24, 0) == 0);
+        sio_assert(sio_mmaplog_printf(&log_file, "no newline %d", 1) == 13);
+        sio_assert(sio_mmaplog_close(&log_file) == 0);
+        sio_assert(sio_mmaplog_open(&log_file, path, 1 << 24, 0) == 0);
+        sio_mmaplog_printf(&log_file, "%s", "no newline 2");
+        sio_assert(sio_mmaplog_close(&log_file) == 0);
+        size_t len;
+        char *data = read_log(&len);
+        sio_assert(strcmp(data, "no newline 1\nno newline 2\n") == 0);
+        free(data);
+    }
+    {
+        // A full log refuses records
+        unlink(path);
+        sio_assert(sio_mmaplog_open(&log_file, path, 4096, 0) == 0);
+        ssize_t ret;
+        size_t written = 0;
+        while ((ret = sio_mmaplog_printf(&log_file, "%s\n", "filling")) > 0) {
+            written += (size_t)ret;
+        }
+        sio_assert(ret == -1);
+        sio_assert(sio_mmaplog_close(&log_file) == 0);
+        struct stat st;
+        sio_assert(stat(path, &st) == 0);
+        printf("full at %lld bytes\n", (long long)st.st_size);
+        sio_assert((size_t)st.st_size == written);
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "csapp.h"
+#include "csapp_ratelimit.h"
+#include <stdio.h>
+#include <string.h>
+
+static char log_buffer[4096];
+
+/* Counts the lines written in log_buffer */
+static size_t count_lines(void) {
+    size_t lines = 0;
+    for (char *p = log_buffer; (p = strchr(p, '\n')) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+int main(void) {
+    sio_buffer_output_t state;
+    sio_ratelimit_t rl;
+    {
+        // A storm of identical records is written once, then summarized
+        state.buffer = log_buffer;
+        state.remaining = sizeof(log_buffer) - 1;
+        sio_ratelimit_init(&rl, sio_buffer_output, &state, 60000, 0, 0);
+        ssize_t total = 0;
+        for (int i = 0; i < 100000; i++) {
+            total += sio_ratelimit_printf(&rl, "connect to %s failed: %d\n",
+                                          "db", 111);
+        }
+        total += sio_ratelimit_printf(&rl, "connect to %s failed: %d\n", "db",
+                                      113);
+        total += sio_ratelimit_flush(&rl);
+        printf("%zd:%s", total, log_buffer);
+        sio_assert(strcmp(log_buffer, "connect to db failed: 111\n"
+                                      "last message repeated 99999 times\n"
+                                      "connect to db failed: 113\n") == 0);
+        sio_assert(total == (ssize_t)strlen(log_buffer));
+    }
+    {
+        // Different records of a call site share its token bucket
+        state.buffer = log_buffer;
+        state.remaining = sizeof(log_buffer) - 1;
+        sio_ratelimit_init(&rl, sio_buffer_output, &state, 0, 1, 3);
+        for (int i = 0; i < 1000; i++) {
+            sio_ratelimit_printf(&rl, "retry %d\n", i);
+            sio_ratelimit_printf(&rl, "other site\n");
+        }
+        sio_ratelimit_flush(&rl);
+        printf("%s", log_buffer);
+        sio_assert(strncmp(log_buffer, "retry 0\nother site\nretry 1\n",
+                           strlen("retry 0\nother site\nretry 1\n")) == 0);
+        sio_assert(strstr(log_buffer,
+                          "rate limit: 997 messages suppressed\n") != NULL);
+        sio_assert(count_lines() == 8);
+    }
+    return 0;
+}
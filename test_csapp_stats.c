@@ -0,0 +1,48 @@
+#include "csapp.h"
+#include "csapp_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(void) {
+    int fds[2];
+    char buffer[1024];
+    csapp_stats_t stats;
+    rio_t rio;
+
+    sio_assert(pipe(fds) == 0);
+    csapp_stats_reset();
+
+    sio_assert(sio_dprintf(fds[1], "%d %s %f\n", 42, "hello", 1.5) == 18);
+    sio_assert(rio_writen(fds[1], "second line\n", 12) == 12);
+    sio_assert(rio_readn(fds[0], buffer, 18) == 18);
+    rio_readinitb(&rio, fds[0]);
+    sio_assert(rio_readlineb(&rio, buffer, sizeof(buffer)) == 12);
+
+    csapp_stats_snapshot(&stats);
+    sio_assert(stats.threads >= 1);
+    sio_assert(stats.counters[CSAPP_STAT_SIO_BYTES] == 18);
+    sio_assert(stats.counters[CSAPP_STAT_SIO_WRITES] >= 1);
+    sio_assert(stats.counters[CSAPP_STAT_SIO_SINK_CALLS] >= 1);
+    sio_assert(stats.counters[CSAPP_STAT_RIO_WRITE_BYTES] == 30);
+    sio_assert(stats.counters[CSAPP_STAT_RIO_READ_BYTES] == 30);
+    sio_assert(stats.counters[CSAPP_STAT_RIO_READS] == 2);
+    for (size_t h = 0; h < CSAPP_HIST_COUNT; h++) {
+        uint64_t total = 0;
+        for (size_t b = 0; b < CSAPP_HIST_BUCKETS; b++) {
+            total += stats.histograms[h][b];
+        }
+        printf("%s: %lu samples\n", csapp_hist_name((csapp_hist_t)h),
+               (unsigned long)total);
+        sio_assert(total >= 1);
+    }
+    fflush(stdout);
+
+    sio_assert(csapp_stats_dump(STDOUT_FILENO) > 0);
+
+    csapp_stats_reset();
+    csapp_stats_snapshot(&stats);
+    sio_assert(stats.counters[CSAPP_STAT_SIO_BYTES] == 0);
+    printf("---------------------------------------------\n");
+    return 0;
+}
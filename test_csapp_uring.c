@@ -0,0 +1,144 @@
+#include "csapp.h"
+#include "csapp_uring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PAIRS 100
+#define DATA_LEN (1 << 20)
+
+static char data[DATA_LEN];
+static char copy[DATA_LEN];
+
+int main(void) {
+    rio_uring_t ring;
+    sio_assert(rio_uring_init(&ring, 16) == 0);
+    printf("io_uring %s\n", rio_uring_enabled(&ring) ? "enabled" : "disabled");
+    for (size_t i = 0; i < DATA_LEN; i++) {
+        data[i] = (char)(i * 7 + i / 251);
+    }
+    {
+        // A batch of writes then a batch of reads, more than the ring holds
+        int fds[PAIRS][2];
+        char in[PAIRS][32];
+        char out[PAIRS][32];
+        for (int i = 0; i < PAIRS; i++) {
+            sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == 0);
+            sio_snprintf(out[i], sizeof(out[i]), "message %d", i);
+            sio_assert(rio_uring_prep_write(&ring, fds[i][0], out[i],
+                                            strlen(out[i]) + 1,
+                                            (uint64_t)i) == 0);
+        }
+        int completed = 0;
+        rio_uring_cqe_t cqe;
+        while (completed < PAIRS) {
+            sio_assert(rio_uring_wait(&ring, &cqe) == 0);
+            sio_assert(cqe.user_data < PAIRS);
+            sio_assert(cqe.res == (ssize_t)strlen(out[cqe.user_data]) + 1);
+            completed++;
+        }
+        sio_assert(rio_uring_wait(&ring, &cqe) == -1 && errno == EAGAIN);
+
+        for (int i = 0; i < PAIRS; i++) {
+            sio_assert(rio_uring_prep_read(&ring, fds[i][1], in[i],
+                                           sizeof(in[i]),
+                                           (uint64_t)(1000 + i)) == 0);
+        }
+        sio_assert(rio_uring_submit(&ring) >= 0);
+        for (completed = 0; completed < PAIRS; completed++) {
+            sio_assert(rio_uring_wait(&ring, &cqe) == 0);
+            int i = (int)(cqe.user_data - 1000);
+            sio_assert(i >= 0 && i < PAIRS);
+            sio_assert(cqe.res == (ssize_t)strlen(out[i]) + 1);
+            sio_assert(strcmp(in[i], out[i]) == 0);
+        }
+        sio_assert(rio_uring_peek(&ring, &cqe) == 0);
+        printf("%d writes and reads\n", PAIRS);
+
+        // Refill the buffers of many rio_t at once, but the adaptive one
+        rio_t rios[PAIRS];
+        rio_t *rps[PAIRS];
+        for (int i = 0; i < PAIRS; i++) {
+            if (i == 0) {
+                sio_assert(rio_readinitb_adaptive(&rios[i], fds[i][1],
+                                                  RIO_BUFSIZE * 4) == 0);
+            } else {
+                rio_readinitb(&rios[i], fds[i][1]);
+            }
+            rps[i] = &rios[i];
+            if (i % 2 == 0) {
+                sio_assert(rio_writen(fds[i][0], out[i], strlen(out[i])) ==
+                           (ssize_t)strlen(out[i]));
+                sio_assert(rio_writen(fds[i][0], "\n", 1) == 1);
+            }
+            close(fds[i][0]);
+        }
+        sio_assert(rio_uring_fillv(&ring, rps, PAIRS) == PAIRS / 2 - 1);
+        sio_assert(rios[0].rio_cnt == 0);
+        for (int i = 0; i < PAIRS; i++) {
+            char line[32];
+            sio_assert(rio_readlineb(&rios[i], line, sizeof(line)) ==
+                       (i % 2 == 0 ? (ssize_t)strlen(out[i]) + 1 : 0));
+            sio_assert(i % 2 != 0 ||
+                       strncmp(line, out[i], strlen(out[i])) == 0);
+            rio_freeb(&rios[i]);
+            close(fds[i][1]);
+        }
+        printf("%d buffers refilled\n", PAIRS / 2);
+    }
+    {
+        // Accept connections on a listening socket
+        int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sio_assert(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        sio_assert(listen(listenfd, 8) == 0);
+        sio_assert(getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) ==
+                   0);
+        int clientfd = socket(AF_INET, SOCK_STREAM, 0);
+        sio_assert(connect(clientfd, (struct sockaddr *)&addr, addrlen) == 0);
+
+        rio_uring_cqe_t cqe;
+        sio_assert(rio_uring_prep_accept(&ring, listenfd, 42) == 0);
+        sio_assert(rio_uring_wait(&ring, &cqe) == 0);
+        sio_assert(cqe.user_data == 42 && cqe.res >= 0);
+        int connfd = (int)cqe.res;
+        printf("accepted\n");
+
+        // The synchronous wrappers move whole buffers
+        pid_t pid = fork();
+        if (pid == 0) {
+            // The rings are shared with the parent after fork()
+            rio_uring_t child;
+            sio_assert(rio_uring_init(&child, 0) == 0);
+            sio_assert(rio_uring_writen(&child, clientfd, data, DATA_LEN) ==
+                       DATA_LEN);
+            _exit(0);
+        }
+        close(clientfd);
+        sio_assert(rio_uring_readn(&ring, connfd, copy, DATA_LEN) == DATA_LEN);
+        sio_assert(memcmp(data, copy, DATA_LEN) == 0);
+        sio_assert(rio_uring_readn(&ring, connfd, copy, 1) == 0);
+        waitpid(pid, NULL, 0);
+        printf("%d bytes through readn and writen\n", DATA_LEN);
+
+        // Errors come back as -errno
+        sio_assert(rio_uring_prep_read(&ring, -1, copy, 1, 7) == 0);
+        sio_assert(rio_uring_wait(&ring, &cqe) == 0);
+        sio_assert(cqe.user_data == 7 && cqe.res == -EBADF);
+        sio_assert(rio_uring_readn(&ring, -1, copy, 1) == -1 && errno == EBADF);
+        close(connfd);
+        close(listenfd);
+    }
+    rio_uring_close(&ring);
+    return 0;
+}
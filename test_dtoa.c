@@ -3,11 +3,13 @@
 //
 
 #include "csapp.h"
+#include "csapp_dtoa.h"
 #include "csapp_private.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
 double NAN = 0.0/0.0;
@@ -147,6 +149,34 @@ int main(void) {
     sio_printf("%*f\n", 15, 32.0);
     printf("%*f\n", 15, 32.0);
 
+    {
+        // Repeated conversions are served from the digit memo, and give the
+        // same output as the first one and as printf. 1e300 has too many
+        // digits to be kept.
+        static const double values[] = {0.1, 1234.5, 3.14159265358979, 1e300,
+                                        -2.5e-7};
+        uint64_t hits_before, misses_before, hits, misses;
+        sio_dtoa_cache_stats(&hits_before, &misses_before);
+        for (int round = 0; round < 3; round++) {
+            for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+                for (int precision = 0; precision < 20; precision += 3) {
+                    char ours[512], theirs[512];
+                    sio_snprintf(ours, sizeof(ours), "%.*f", precision,
+                                 values[i]);
+                    snprintf(theirs, sizeof(theirs), "%.*f", precision,
+                             values[i]);
+                    sio_assert(strcmp(ours, theirs) == 0);
+                }
+            }
+        }
+        sio_dtoa_cache_stats(&hits, &misses);
+        printf("dtoa memo: %llu hits, %llu misses\n",
+               (unsigned long long)(hits - hits_before),
+               (unsigned long long)(misses - misses_before));
+        // The memo is only compiled in for this test, see the Makefile
+        sio_assert(hits > hits_before);
+    }
+
     print_leading_zeros(0);
     print_leading_zeros(1);
     print_leading_zeros(3);
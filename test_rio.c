@@ -0,0 +1,702 @@
+#include "csapp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define DATA_LEN (1 << 20)
+
+static char data[DATA_LEN];
+
+/* The byte by byte rio_readlineb, as a reference for its semantics */
+static ssize_t readline_reference(rio_t *rp, char *usrbuf, size_t maxlen) {
+    size_t n;
+    ssize_t rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        } else if (rc == 0) {
+            if (n == 1) {
+                return 0;
+            } else {
+                break;
+            }
+        } else {
+            return -1;
+        }
+    }
+    *bufp = 0;
+    return (ssize_t)(n - 1);
+}
+
+/* Writes buf to a pipe in chunks of varying sizes, returns the read end */
+static int chunked_pipe(const char *buf, size_t len) {
+    int fds[2];
+    sio_assert(pipe(fds) == 0);
+    if (fork() == 0) {
+        close(fds[0]);
+        size_t off = 0;
+        for (size_t chunk = 1; off < len; chunk = chunk * 7 % 10007 + 1) {
+            size_t n = chunk < len - off ? chunk : len - off;
+            sio_assert(rio_writen(fds[1], buf + off, n) == (ssize_t)n);
+            off += n;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+int main(void) {
+    // Lines of random lengths, some longer than the buffers, no final newline
+    srand(1);
+    for (size_t i = 0; i < DATA_LEN; i++) {
+        data[i] = rand() % 40 == 0 ? '\n' : (char)('a' + rand() % 26);
+    }
+    for (size_t i = 1000; i < 30000; i++) {
+        data[i] = 'x';
+    }
+    data[DATA_LEN - 1] = 'z';
+
+    char path[] = "/tmp/test_rio.XXXXXX";
+    int fd = mkstemp(path);
+    sio_assert(fd >= 0);
+    sio_assert(rio_writen(fd, data, DATA_LEN) == DATA_LEN);
+
+    static const size_t maxlens[] = {0, 1, 2, 3, 17, 80, RIO_BUFSIZE,
+                                     RIO_BUFSIZE + 1, 100000};
+    for (size_t m = 0; m < sizeof(maxlens) / sizeof(maxlens[0]); m++) {
+        size_t maxlen = maxlens[m];
+        static char expected[100001], got[100001];
+        static rio_t reference, rio;
+        sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+        rio_readinitb(&reference, fd);
+        int in = chunked_pipe(data, DATA_LEN);
+        rio_readinitb(&rio, in);
+        size_t calls = 0;
+        size_t total = 0;
+        for (;;) {
+            memset(expected, 'E', sizeof(expected));
+            memset(got, 'E', sizeof(got));
+            ssize_t rc_expected =
+                readline_reference(&reference, expected, maxlen);
+            ssize_t rc = rio_readlineb(&rio, got, maxlen);
+            sio_assert(rc == rc_expected);
+            sio_assert(memcmp(got, expected, maxlen + 1) == 0);
+            total += (size_t)rc;
+            if (rc <= 0 && (maxlen > 1 || ++calls == 1000)) {
+                break; // With maxlen <= 1, nothing is ever read
+            }
+            if (rc > 0) {
+                calls++;
+            }
+        }
+        close(in);
+        wait(NULL);
+        printf("maxlen %zu: %zu calls, %zu bytes\n", maxlen, calls, total);
+        sio_assert(maxlen <= 1 || total == DATA_LEN);
+    }
+    {
+        // Line views split lines like rio_readlineb with RIO_BUFSIZE + 1
+        static char expected[RIO_BUFSIZE + 1];
+        static rio_t reference, rio, batch;
+        sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+        rio_readinitb(&reference, fd);
+        int in = chunked_pipe(data, DATA_LEN);
+        rio_readinitb(&rio, in);
+        int in_batch = chunked_pipe(data, DATA_LEN);
+        rio_readinitb(&batch, in_batch);
+        rio_line_t lines[16];
+        size_t nlines = 0, next = 0, batches = 0, total = 0;
+        for (;;) {
+            ssize_t rc_expected =
+                rio_readlineb(&reference, expected, sizeof(expected));
+            rio_line_t line;
+            ssize_t rc = rio_readline_view(&rio, &line);
+            sio_assert(rc == rc_expected && line.len == (size_t)rc);
+            sio_assert(memcmp(line.data, expected, line.len) == 0);
+            if (next == nlines) {
+                ssize_t n = rio_readlines_view(&batch, lines, 16);
+                sio_assert(n >= 0);
+                nlines = (size_t)n;
+                next = 0;
+                batches++;
+            }
+            if (rc == 0) {
+                sio_assert(nlines == 0);
+                break;
+            }
+            sio_assert(lines[next].len == line.len);
+            sio_assert(memcmp(lines[next].data, expected, line.len) == 0);
+            next++;
+            total += (size_t)rc;
+        }
+        close(in);
+        close(in_batch);
+        wait(NULL);
+        wait(NULL);
+        printf("line views: %zu bytes, %zu batches\n", total, batches);
+        sio_assert(total == DATA_LEN);
+    }
+    {
+        // Caller supplied and allocated buffers of any size
+        static char small[64];
+        static char got[DATA_LEN];
+        static const size_t sizes[] = {sizeof(small), 100000, 4 << 20};
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            static rio_t rio;
+            sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+            sio_assert(rio_readinitb_sized(&rio, fd, i == 0 ? small : NULL,
+                                           sizes[i]) == 0);
+            size_t total = 0;
+            ssize_t rc;
+            while ((rc = rio_readnb(&rio, got + total, 1000)) > 0) {
+                total += (size_t)rc;
+            }
+            sio_assert(total == DATA_LEN && memcmp(got, data, DATA_LEN) == 0);
+            printf("buffer of %zu bytes: %zu bytes read\n", rio.rio_bufsize,
+                   total);
+            rio_freeb(&rio);
+            sio_assert(rio.rio_bufstart == rio.rio_buf);
+        }
+    }
+    {
+        // An adaptive buffer grows while reads fill it, shrinks back after
+        int fds[2];
+        sio_assert(pipe(fds) == 0);
+        static rio_t rio;
+        static char got[32768];
+        rio_readinitb_adaptive(&rio, fds[0], sizeof(got));
+        for (int i = 0; i < 20; i++) {
+            sio_assert(rio_writen(fds[1], data, sizeof(got)) == sizeof(got));
+            sio_assert(rio_readnb(&rio, got, sizeof(got)) == sizeof(got));
+            sio_assert(memcmp(got, data, sizeof(got)) == 0);
+        }
+        printf("adaptive buffer grew to %zu bytes\n", rio.rio_bufsize);
+        sio_assert(rio.rio_bufsize == sizeof(got));
+        for (int i = 0; i < 100; i++) {
+            sio_assert(rio_writen(fds[1], data, 100) == 100);
+            sio_assert(rio_readnb(&rio, got, 100) == 100);
+        }
+        printf("adaptive buffer shrank to %zu bytes\n", rio.rio_bufsize);
+        sio_assert(rio.rio_bufsize == RIO_BUFSIZE);
+        rio_freeb(&rio);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    {
+        // Mapped files read like buffered ones, through small windows too
+        static const size_t windows[] = {0, 3 * 4096, 1};
+        static char expected[100001], got[100001];
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+            static rio_t reference, rio;
+            sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+            rio_readinitb(&reference, fd);
+            int mapped = open(path, O_RDONLY);
+            sio_assert(lseek(mapped, 10, SEEK_SET) == 10);
+            sio_assert(rio_readinitb_mmap(&rio, mapped, windows[w]) == 0);
+            sio_assert(rio_readnb(&reference, expected, 10) == 10);
+            ssize_t rc;
+            size_t total = 10;
+            while ((rc = rio_readlineb(&rio, got, sizeof(got))) > 0) {
+                sio_assert(rio_readlineb(&reference, expected,
+                                         sizeof(expected)) == rc);
+                sio_assert(memcmp(got, expected, (size_t)rc + 1) == 0);
+                total += (size_t)rc;
+            }
+            sio_assert(rc == 0 && total == DATA_LEN);
+            rio_freeb(&rio);
+
+            // Views never copy, a line longer than the window comes in parts
+            sio_assert(rio_readinitb_mmap(&rio, mapped, windows[w]) == 0);
+            sio_assert(lseek(mapped, 0, SEEK_CUR) == 10);
+            rio_line_t line;
+            size_t offset = 10, views = 0;
+            while ((rc = rio_readline_view(&rio, &line)) > 0) {
+                sio_assert(memcmp(line.data, data + offset, line.len) == 0);
+                offset += line.len;
+                views++;
+            }
+            sio_assert(rc == 0 && offset == DATA_LEN);
+            printf("mapped window %zu: %zu bytes, %zu views\n", rio.rio_bufmax,
+                   total, views);
+            rio_freeb(&rio);
+            close(mapped);
+        }
+
+        // Pipes fall back to read()
+        static rio_t rio;
+        int in = chunked_pipe(data, DATA_LEN);
+        sio_assert(rio_readinitb_mmap(&rio, in, 0) == 0);
+        static char all[DATA_LEN];
+        sio_assert(rio_readnb(&rio, all, DATA_LEN) == DATA_LEN);
+        sio_assert(memcmp(all, data, DATA_LEN) == 0);
+        rio_freeb(&rio);
+        close(in);
+        wait(NULL);
+    }
+    {
+        // Prefetching readers read like the others, from files and pipes,
+        // with a line longer than a buffer seen through views
+        static const size_t sizes[] = {0, 4096, 1000};
+        static char expected[100001], got[100001];
+        for (size_t k = 0; k < 2 * sizeof(sizes) / sizeof(sizes[0]); k++) {
+            static rio_t reference, rio;
+            size_t size = sizes[k / 2];
+            bool from_pipe = k % 2;
+            sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+            rio_readinitb(&reference, fd);
+            int in = from_pipe ? chunked_pipe(data, DATA_LEN)
+                               : open(path, O_RDONLY);
+            unsigned int nbufs = size == 0 ? 0 : 2;
+            sio_assert(rio_readinitb_prefetch(&rio, in, size, nbufs) == 0);
+            sio_assert(rio_readnb(&rio, got, 10) == 10);
+            sio_assert(rio_readnb(&reference, expected, 10) == 10);
+            sio_assert(memcmp(got, expected, 10) == 0);
+            ssize_t rc;
+            size_t total = 10, views = 0;
+            for (int i = 0; (rc = rio_readlineb(&rio, got, sizeof(got))) > 0;
+                 i++) {
+                sio_assert(rio_readlineb(&reference, expected,
+                                         sizeof(expected)) == rc);
+                sio_assert(memcmp(got, expected, (size_t)rc + 1) == 0);
+                total += (size_t)rc;
+                if (i == 10) {
+                    break;
+                }
+            }
+            rio_line_t line;
+            while ((rc = rio_readline_view(&rio, &line)) > 0) {
+                sio_assert(line.len <
+                           2 * (size ? size : RIO_PREFETCH_BUFSIZE));
+                sio_assert(memcmp(line.data, data + total, line.len) == 0);
+                total += line.len;
+                views++;
+            }
+            sio_assert(rc == 0 && total == DATA_LEN);
+            sio_assert(rio_readnb(&rio, got, 1) == 0);
+            printf("prefetch %zu byte buffers, %s: %zu bytes, %zu views\n",
+                   rio.rio_bufsize, from_pipe ? "pipe" : "file", total, views);
+            rio_freeb(&rio);
+            close(in);
+        }
+
+        // Freeing stops a thread blocked in read()
+        int fds[2];
+        sio_assert(pipe(fds) == 0);
+        sio_assert(rio_writen(fds[1], "first\n", 6) == 6);
+        static rio_t rio;
+        sio_assert(rio_readinitb_prefetch(&rio, fds[0], 0, 0) == 0);
+        sio_assert(rio_readlineb(&rio, got, sizeof(got)) == 6);
+        rio_freeb(&rio);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    {
+        // Length prefixed frames, views when they fit in the buffer
+        static char stream[4 << 20], body[1 << 16];
+        size_t len = 0, frames = 0;
+        for (size_t i = 0; len + 4 + 20000 < sizeof(stream); i++, frames++) {
+            size_t n = i % 7 == 0 ? 9000 + i % 11000 : i % 300;
+            for (size_t b = 0; b < 4; b++) {
+                stream[len++] = (char)(n >> (24 - 8 * b));
+            }
+            memcpy(stream + len, data + i, n);
+            len += n;
+        }
+        rio_framing_t framing = {4, 0, sizeof(body)};
+        static rio_t rio;
+        rio_line_t frame;
+        int in = chunked_pipe(stream, len);
+        rio_readinitb(&rio, in);
+        size_t total = 0, views = 0;
+        for (size_t i = 0; i < frames; i++) {
+            ssize_t rc = rio_readframe(&rio, &framing, body, &frame);
+            sio_assert(rc == 4 + (ssize_t)frame.len);
+            sio_assert(frame.len == (i % 7 == 0 ? 9000 + i % 11000 : i % 300));
+            sio_assert(memcmp(frame.data, data + i, frame.len) == 0);
+            views += frame.data != body;
+            total += (size_t)rc;
+        }
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == 0);
+        sio_assert(total == len && views > 0 && views < frames);
+        close(in);
+        printf("frames: %zu, %zu views\n", frames, views);
+
+        // Too long for max_len, or for the buffer without usrbuf
+        in = chunked_pipe(stream, len);
+        rio_readinitb(&rio, in);
+        framing.max_len = 8999;
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == -1 &&
+                   errno == EMSGSIZE);
+        framing.max_len = sizeof(body);
+        sio_assert(rio_readframe(&rio, &framing, NULL, &frame) == -1 &&
+                   errno == EMSGSIZE);
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == 9004);
+        close(in);
+
+        // Little endian 2 byte prefixes, and a frame cut short by EOF
+        static const char little[] = "\x03\x00"
+                                     "abc"
+                                     "\x00\x00"
+                                     "\x05\x00"
+                                     "ab";
+        in = chunked_pipe(little, sizeof(little) - 1);
+        rio_readinitb(&rio, in);
+        framing.width = 2;
+        framing.little_endian = 1;
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == 5);
+        sio_assert(frame.len == 3 && memcmp(frame.data, "abc", 3) == 0);
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == 2);
+        sio_assert(frame.len == 0);
+        sio_assert(rio_readframe(&rio, &framing, body, &frame) == -1 &&
+                   errno == EPROTO);
+        close(in);
+    }
+    {
+        // Records with any delimiter split like lines with '\n'
+        static rio_t lines, records;
+        sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+        rio_readinitb(&lines, fd);
+        int in = chunked_pipe(data, DATA_LEN);
+        rio_readinitb(&records, in);
+        rio_line_t line, record;
+        ssize_t rc;
+        while ((rc = rio_readline_view(&lines, &line)) > 0) {
+            sio_assert(rio_readuntil(&records, "\n", 1, NULL, 0, &record) ==
+                       rc);
+            sio_assert(memcmp(record.data, line.data, line.len) == 0);
+        }
+        sio_assert(rio_readuntil(&records, "\n", 1, NULL, 0, &record) == 0);
+        close(in);
+
+        // Multi-byte delimiters, with records longer than the buffer copied
+        static char stream[DATA_LEN], usr[40000];
+        memcpy(stream, data, DATA_LEN);
+        for (size_t i = 0; i + 1 < DATA_LEN; i++) {
+            if (stream[i] == '\n') {
+                stream[i] = i % 3 ? '\r' : 'x'; // Some lone '\r' and '\n'
+                stream[i + 1] = i % 5 ? '\n' : 'x';
+                i++;
+            }
+        }
+        size_t expected = 0;
+        for (size_t i = 0; i + 1 < DATA_LEN; i++) {
+            expected += stream[i] == '\r' && stream[i + 1] == '\n';
+        }
+        in = chunked_pipe(stream, DATA_LEN);
+        rio_readinitb(&records, in);
+        size_t offset = 0, count = 0, copies = 0;
+        while ((rc = rio_readuntil(&records, "\r\n", 2, usr, sizeof(usr),
+                                   &record)) > 0) {
+            sio_assert(memcmp(record.data, stream + offset, record.len) == 0);
+            size_t end = offset;
+            while (end + 1 < DATA_LEN &&
+                   (stream[end] != '\r' || stream[end + 1] != '\n')) {
+                end++;
+            }
+            if (end + 1 < DATA_LEN) {
+                sio_assert(record.len == end + 2 - offset);
+                count++;
+            } else {
+                sio_assert(offset + record.len == DATA_LEN);
+            }
+            copies += record.data == usr;
+            offset += record.len;
+        }
+        sio_assert(rc == 0 && offset == DATA_LEN && count == expected);
+        sio_assert(copies > 0);
+        close(in);
+
+        // Records longer than usrbuf
+        in = chunked_pipe(stream, DATA_LEN);
+        rio_readinitb(&records, in);
+        while ((rc = rio_readuntil(&records, "\r\n", 2, usr, 100, &record)) >
+               0) {
+        }
+        sio_assert(rc == -1 && errno == EMSGSIZE);
+        close(in);
+        printf("records: %zu, %zu copies\n", count, copies);
+    }
+    {
+        // Buffered writes of any size reach files and sockets in order
+        int fds[2];
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        char out_path[] = "/tmp/test_rio_out.XXXXXX";
+        int out = mkstemp(out_path);
+        sio_assert(out >= 0);
+        unlink(out_path);
+        static const int targets[] = {0, 1};
+        for (size_t t = 0; t < 2; t++) {
+            int target = targets[t] ? fds[0] : out;
+            pid_t pid = fork();
+            if (pid == 0) {
+                static rio_writer_t writer;
+                rio_writeinitb(&writer, target);
+                size_t off = 0;
+                for (size_t n = 1; off < DATA_LEN - 100;
+                     n = n * 13 % 30011 + 1) {
+                    if (n > DATA_LEN - 100 - off) {
+                        n = DATA_LEN - 100 - off;
+                    }
+                    sio_assert(rio_writeb(&writer, data + off, n) ==
+                               (ssize_t)n);
+                    off += n;
+                }
+                char line[100];
+                memcpy(line, data + off, 99);
+                line[99] = '\0';
+                sio_assert(rio_writelineb(&writer, line) == 100);
+                sio_assert(rio_flushb(&writer) == 0);
+                _exit(0);
+            }
+            static char got[DATA_LEN];
+            if (targets[t]) {
+                sio_assert(rio_readn(fds[1], got, DATA_LEN) == DATA_LEN);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            sio_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            if (!targets[t]) {
+                sio_assert(pread(out, got, DATA_LEN, 0) == DATA_LEN);
+            }
+            sio_assert(memcmp(got, data, DATA_LEN - 1) == 0);
+            sio_assert(got[DATA_LEN - 1] == '\n');
+            printf("buffered writes to a %s: %d bytes\n",
+                   targets[t] ? "socket" : "file", DATA_LEN);
+        }
+        close(out);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    {
+        // Vectored transfers of more than IOV_MAX buffers, split differently
+        // on each side, with empty buffers and a short read at EOF
+        int fds[2];
+        sio_assert(pipe(fds) == 0);
+        static struct iovec iov[8192];
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            size_t off = 0;
+            int n = 0;
+            for (; off < DATA_LEN; n++) {
+                sio_assert(n < 8192);
+                size_t len = n % 7 == 0 ? 0 : (size_t)(n * 31 % 997);
+                if (len > DATA_LEN - off) {
+                    len = DATA_LEN - off;
+                }
+                iov[n].iov_base = data + off;
+                iov[n].iov_len = len;
+                off += len;
+            }
+            sio_assert(rio_writevn(fds[1], iov, n) == DATA_LEN);
+            _exit(0);
+        }
+        close(fds[1]);
+        static char got[DATA_LEN + 1000];
+        size_t off = 0;
+        int n = 0;
+        for (; off < sizeof(got); n++) {
+            sio_assert(n < 8192);
+            size_t len = n % 5 == 0 ? 0 : (size_t)(n * 17 % 701);
+            if (len > sizeof(got) - off) {
+                len = sizeof(got) - off;
+            }
+            iov[n].iov_base = got + off;
+            iov[n].iov_len = len;
+            off += len;
+        }
+        ssize_t rc = rio_readvn(fds[0], iov, n);
+        int status;
+        waitpid(pid, &status, 0);
+        sio_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        printf("vectored: %zd bytes in %d buffers\n", rc, n);
+        sio_assert(rc == DATA_LEN && memcmp(got, data, DATA_LEN) == 0);
+        close(fds[0]);
+    }
+    {
+        // fd to fd copies between files, sockets and pipes
+        static char got[DATA_LEN];
+        char out_path[] = "/tmp/test_rio_copy.XXXXXX";
+        int out = mkstemp(out_path);
+        sio_assert(out >= 0);
+        unlink(out_path);
+
+        // File to file, at an offset then at the file offset
+        off_t offset = 100;
+        sio_assert(rio_copyfd(out, fd, &offset, 1000) == 1000);
+        sio_assert(offset == 1100);
+        sio_assert(lseek(fd, 1100, SEEK_SET) == 1100);
+        sio_assert(rio_copyfd(out, fd, NULL, DATA_LEN) == DATA_LEN - 1100);
+        sio_assert(pread(out, got, DATA_LEN, 0) == DATA_LEN - 100);
+        sio_assert(memcmp(got, data + 100, DATA_LEN - 100) == 0);
+
+        // File to socket, socket to socket, pipe to file
+        int a[2], b[2];
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, a) == 0);
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, b) == 0);
+        int p[2];
+        sio_assert(pipe(p) == 0);
+        pid_t pid = fork();
+        if (pid == 0) {
+            offset = 0;
+            sio_assert(rio_copyfd(a[0], fd, &offset, DATA_LEN) == DATA_LEN);
+            close(a[0]);
+            _exit(0);
+        }
+        close(a[0]);
+        pid_t relay = fork();
+        if (relay == 0) {
+            sio_assert(rio_copyfd(b[0], a[1], NULL, DATA_LEN) == DATA_LEN);
+            _exit(0);
+        }
+        close(a[1]);
+        close(b[0]);
+        pid_t piper = fork();
+        if (piper == 0) {
+            sio_assert(rio_copyfd(p[1], b[1], NULL, DATA_LEN) == DATA_LEN);
+            _exit(0);
+        }
+        close(b[1]);
+        close(p[1]);
+        sio_assert(ftruncate(out, 0) == 0);
+        sio_assert(lseek(out, 0, SEEK_SET) == 0);
+        sio_assert(rio_copyfd(out, p[0], NULL, 2 * DATA_LEN) == DATA_LEN);
+        for (int i = 0; i < 3; i++) {
+            int status;
+            wait(&status);
+            sio_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+        close(p[0]);
+        sio_assert(pread(out, got, DATA_LEN, 0) == DATA_LEN);
+        sio_assert(memcmp(got, data, DATA_LEN) == 0);
+
+        // The buffered bytes of a rio_t come first, mapped or not
+        for (int mapped = 0; mapped < 2; mapped++) {
+            static rio_t rio;
+            static char line[RIO_BUFSIZE];
+            sio_assert(lseek(fd, 0, SEEK_SET) == 0);
+            if (mapped) {
+                sio_assert(rio_readinitb_mmap(&rio, fd, 3 * 4096) == 0);
+            } else {
+                rio_readinitb(&rio, fd);
+            }
+            ssize_t first = rio_readlineb(&rio, line, sizeof(line));
+            sio_assert(first > 0);
+            sio_assert(ftruncate(out, 0) == 0);
+            sio_assert(lseek(out, 0, SEEK_SET) == 0);
+            sio_assert(rio_copyfdb(out, &rio, DATA_LEN - (size_t)first - 1) ==
+                       DATA_LEN - first - 1);
+            sio_assert(rio_readnb(&rio, line, 10) == 1);
+            sio_assert(pread(out, got, DATA_LEN, 0) == DATA_LEN - first - 1);
+            sio_assert(memcmp(got, data + first,
+                              DATA_LEN - (size_t)first - 1) == 0);
+            rio_freeb(&rio);
+        }
+
+        // Socket to a file in append mode, where splice() is refused only
+        // once the bytes left the socket
+        sio_assert(ftruncate(out, 0) == 0);
+        sio_assert(fcntl(out, F_SETFL, O_APPEND) == 0);
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, a) == 0);
+        sio_assert(rio_writen(a[0], data, 1000) == 1000);
+        close(a[0]);
+        sio_assert(rio_copyfd(out, a[1], NULL, 2000) == 1000);
+        sio_assert(pread(out, got, 2000, 0) == 1000);
+        sio_assert(memcmp(got, data, 1000) == 0);
+        close(a[1]);
+        printf("fd copies: %d bytes\n", DATA_LEN);
+        close(out);
+    }
+    {
+        // Non-blocking transfers return RIO_AGAIN and resume where they
+        // stopped, with one thread driving both ends
+        static char received[DATA_LEN];
+        int sv[2];
+        sio_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        sio_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+        sio_assert(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+        size_t wdone = 0, rdone = 0, again = 0;
+        while (rdone < DATA_LEN) {
+            ssize_t rc = rio_writen_nb(sv[0], data, DATA_LEN, &wdone);
+            sio_assert(rc == DATA_LEN || rc == RIO_AGAIN);
+            again += rc == RIO_AGAIN;
+            rc = rio_readn_nb(sv[1], received, DATA_LEN, &rdone);
+            sio_assert(rc == DATA_LEN || rc == RIO_AGAIN);
+        }
+        sio_assert(again > 0);
+        sio_assert(memcmp(received, data, DATA_LEN) == 0);
+
+        // Buffered: partial lines wait in the rio_t, pending bytes in the
+        // rio_writer_t
+        static rio_writer_t writer;
+        static rio_t reader;
+        rio_writeinitb(&writer, sv[0]);
+        rio_readinitb(&reader, sv[1]);
+        memset(received, 0, DATA_LEN);
+        size_t sent = 0, got = 0, head = 0, write_again = 0, read_again = 0;
+        bool flushed = false;
+        for (unsigned int i = 0; got < DATA_LEN;) {
+            ssize_t rc;
+            // Write until the socket pushes back
+            while (sent < DATA_LEN) {
+                size_t n = (i++ * 7919) % 20000 + 1;
+                if (n > DATA_LEN - sent) {
+                    n = DATA_LEN - sent;
+                }
+                rc = rio_writeb_nb(&writer, data + sent, n);
+                sio_assert(rc > 0 || rc == RIO_AGAIN);
+                if (rc == RIO_AGAIN || (size_t)rc < n) {
+                    sent += rc > 0 ? (size_t)rc : 0;
+                    write_again++;
+                    break;
+                }
+                sent += (size_t)rc;
+            }
+            if (sent == DATA_LEN && !flushed) {
+                rc = rio_flushb_nb(&writer);
+                sio_assert(rc == 0 || rc == RIO_AGAIN);
+                write_again += rc == RIO_AGAIN;
+                if (rc == 0) {
+                    flushed = true;
+                    shutdown(sv[0], SHUT_WR); // The last line ends at EOF
+                }
+            }
+            if (head < 1000) {
+                rc = rio_readnb_nb(&reader, received, 1000, &head);
+                sio_assert(rc == 1000 || rc == RIO_AGAIN);
+                got = head;
+                continue;
+            }
+            rio_line_t line;
+            while ((rc = rio_readline_nb(&reader, &line)) > 0) {
+                sio_assert(got + line.len <= DATA_LEN);
+                memcpy(received + got, line.data, line.len);
+                got += line.len;
+            }
+            sio_assert(rc == RIO_AGAIN || (rc == 0 && got == DATA_LEN));
+            read_again += rc == RIO_AGAIN;
+        }
+        sio_assert(write_again > 0 && read_again > 0);
+        sio_assert(memcmp(received, data, DATA_LEN) == 0);
+        printf("non-blocking: %d bytes, %zu writes and %zu reads deferred\n",
+               DATA_LEN, write_again, read_again);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    close(fd);
+    unlink(path);
+    return 0;
+}
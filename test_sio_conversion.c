@@ -0,0 +1,137 @@
+#include "csapp.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+struct span {
+    unsigned long trace;
+    unsigned int id;
+};
+
+/* Formats a span as trace/id, honoring padding */
+static ssize_t format_span(sio_output_function output, void *output_state,
+                           const void *arg, int padding, int precision) {
+    const struct span *span = arg;
+    if (padding != 0) {
+        // Simple conversions can just format themselves again
+        char buffer[64];
+        sio_snprintf(buffer, sizeof(buffer), "%lx/%u", span->trace, span->id);
+        return sio_format(output, output_state, "%*s", padding, buffer);
+    }
+    return sio_format(output, output_state, "%lx/%u", span->trace, span->id);
+}
+
+int main(void) {
+    char buffer[1024];
+    ssize_t ret;
+    struct span span = {0xabcdef, 42};
+
+    sio_assert(sio_register_conversion('S', format_span) == 0);
+    sio_assert(sio_register_conversion('J', format_span) == -1);
+    sio_assert(sio_register_conversion('s', format_span) == -1);
+
+    ret = sio_snprintf(buffer, sizeof(buffer), "span %pS done", (void *)&span);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "span abcdef/42 done") == 0);
+    sio_assert(ret == (ssize_t)strlen(buffer));
+
+    ret = sio_snprintf(buffer, sizeof(buffer), "'%*pS'", 12, (void *)&span);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "'   abcdef/42'") == 0);
+
+    // Unregistered suffixes are plain pointers followed by a letter
+    ret = sio_snprintf(buffer, sizeof(buffer), "%pQ", (void *)0x10);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "0x10Q") == 0);
+
+    sio_assert(sio_register_conversion('S', NULL) == 0);
+    ret = sio_snprintf(buffer, sizeof(buffer), "%pS", (void *)0x10);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "0x10S") == 0);
+    printf("---------------------------------------------\n");
+
+    struct timespec ts = {0, 0};
+    ret = sio_snprintf(buffer, sizeof(buffer), "[%pT]", (void *)&ts);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "[1970-01-01T00:00:00.000000Z]") == 0);
+
+    ts.tv_sec = 1700000000;
+    ts.tv_nsec = 123456789;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat" // Precision with %p
+    ret = sio_snprintf(buffer, sizeof(buffer), "[%.*pT] [%.*pT] [%pT]", 9,
+                       (void *)&ts, 0, (void *)&ts, (void *)&ts);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "[2023-11-14T22:13:20.123456789Z] "
+                              "[2023-11-14T22:13:20Z] "
+                              "[2023-11-14T22:13:20.123456Z]") == 0);
+
+    // Same second from the cache, then a leap day and a negative time
+    ts.tv_nsec = 999999999;
+    sio_snprintf(buffer, sizeof(buffer), "%.*pT", 3, (void *)&ts);
+    printf("%s\n", buffer);
+    sio_assert(strcmp(buffer, "2023-11-14T22:13:20.999Z") == 0);
+    ts.tv_sec = 951782400;
+    sio_snprintf(buffer, sizeof(buffer), "%.*pT", 0, (void *)&ts);
+    printf("%s\n", buffer);
+    sio_assert(strcmp(buffer, "2000-02-29T00:00:00Z") == 0);
+    ts.tv_sec = -1;
+    sio_snprintf(buffer, sizeof(buffer), "%.*pT", 0, (void *)&ts);
+    printf("%s\n", buffer);
+    sio_assert(strcmp(buffer, "1969-12-31T23:59:59Z") == 0);
+#pragma GCC diagnostic pop
+
+    // Nanoseconds out of range are an invalid argument
+    ts.tv_nsec = 1000000000;
+    sio_assert(sio_snprintf(buffer, sizeof(buffer), "%pT", (void *)&ts) == -1);
+    ts.tv_nsec = -1;
+    sio_assert(sio_snprintf(buffer, sizeof(buffer), "%pT", (void *)&ts) == -1);
+
+    ret = sio_snprintf(buffer, sizeof(buffer), "%*pT|", -30, NULL);
+    printf("%zd:%s (now)\n", ret, buffer);
+    sio_assert(ret == 31);
+    printf("---------------------------------------------\n");
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(8080);
+    inet_pton(AF_INET, "192.168.0.10", &sin.sin_addr);
+    ret = sio_snprintf(buffer, sizeof(buffer), "%pI %pN [%*pI]", (void *)&sin,
+                       (void *)&sin, -14, (void *)&sin);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer,
+                      "192.168.0.10 192.168.0.10:8080 [192.168.0.10  ]") == 0);
+
+    // IPv6 must match inet_ntop, zero compression included
+    static const char *addresses[] = {
+        "::",           "::1",           "2001:db8::1",
+        "2001:db8:0:0:1:0:0:1",          "2001:0:0:1:0:0:0:1",
+        "fe80::1:2:3:4", "1:2:3:4:5:6:7:8", "1:0:3:4:5:6:7:8",
+        "::ffff:10.0.0.1", "ff02::",     "0:1:0:1:0:1:0:1",
+    };
+    struct sockaddr_in6 sin6;
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(443);
+    for (size_t i = 0; i < sizeof(addresses) / sizeof(addresses[0]); i++) {
+        char expected[INET6_ADDRSTRLEN];
+        inet_pton(AF_INET6, addresses[i], &sin6.sin6_addr);
+        inet_ntop(AF_INET6, &sin6.sin6_addr, expected, sizeof(expected));
+        ret = sio_snprintf(buffer, sizeof(buffer), "%pI", (void *)&sin6);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer, expected) == 0);
+    }
+    ret = sio_snprintf(buffer, sizeof(buffer), "%pN", (void *)&sin6);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "[0:1:0:1:0:1:0:1]:443") == 0);
+
+    ret = sio_snprintf(buffer, sizeof(buffer), "%pN", NULL);
+    printf("%zd:%s\n", ret, buffer);
+    sio_assert(strcmp(buffer, "(null)") == 0);
+    printf("---------------------------------------------\n");
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "csapp.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(void) {
+    {
+        char buffer[1024];
+        ssize_t ret;
+
+        ret = sio_snprintf(buffer, sizeof(buffer), "\"%pJ\"", "plain");
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer, "\"plain\"") == 0);
+
+        ret = sio_snprintf(buffer, sizeof(buffer), "\"%pJ\"",
+                           "quote\" backslash\\ tab\t newline\n bell\a");
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer, "\"quote\\\" backslash\\\\ tab\\t newline"
+                                  "\\n bell\\u0007\"") == 0);
+        sio_assert(ret == (ssize_t)strlen(buffer));
+
+        // Long enough to go through the vectorized scan
+        ret = sio_snprintf(buffer, sizeof(buffer), "%pJ",
+                           "0123456789abcdef0123456789abcdef\"0123456789");
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer,
+                          "0123456789abcdef0123456789abcdef\\\"0123456789") ==
+                   0);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat" // Precision with %p
+        ret = sio_snprintf(buffer, sizeof(buffer), "'%*pJ' '%*pJ' '%.*pJ'", 6,
+                           "a\"", -6, "a\"", 3, "a\"bcd");
+#pragma GCC diagnostic pop
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer, "'   a\\\"' 'a\\\"   ' 'a\\\"b'") == 0);
+
+        ret = sio_snprintf(buffer, sizeof(buffer), "%pJ %p", NULL, NULL);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(strcmp(buffer, "(null) (nil)") == 0);
+
+        // Plain strings and characters report their length
+        ret = sio_snprintf(buffer, sizeof(buffer), "%s%c%%", "ab", 'c');
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(ret == 4);
+        printf("---------------------------------------------\n");
+    }
+
+    {
+        char buffer[1024];
+        sio_buffer_output_t state = {buffer, sizeof(buffer) - 1};
+        sio_json_record_t rec;
+        ssize_t ret;
+
+        sio_json_begin(&rec, sio_buffer_output, &state);
+        sio_json_add_string(&rec, "msg", "hello \"world\"\n");
+        sio_json_add_int(&rec, "int", -42);
+        sio_json_add_uint(&rec, "uint", 18446744073709551615ULL);
+        sio_json_add_double(&rec, "ratio", 12.25, 3);
+        sio_json_add_double(&rec, "inf", 1.0 / 0.0, -1);
+        sio_json_add_bool(&rec, "ok", 1);
+        sio_json_add_string(&rec, "none", NULL);
+        sio_json_add_format(&rec, "fmt", "%s=%d", "a\"b", 7);
+        ret = sio_json_end(&rec);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(ret == (ssize_t)strlen(buffer));
+        sio_assert(strcmp(buffer, "{\"msg\":\"hello \\\"world\\\"\\n\","
+                                  "\"int\":-42,"
+                                  "\"uint\":18446744073709551615,"
+                                  "\"ratio\":12.250,\"inf\":null,\"ok\":true,"
+                                  "\"none\":null,\"fmt\":\"a\\\"b=7\"}") ==
+                   0);
+
+        // JSON lines straight to a file descriptor
+        sio_write_output_t out = {STDOUT_FILENO};
+        sio_json_begin(&rec, sio_write_output, &out);
+        sio_json_add_string(&rec, "level", "info");
+        sio_json_add_int(&rec, "pid", 1);
+        sio_json_end(&rec);
+        sio_printf("\n");
+        printf("---------------------------------------------\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "csapp.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static char buffer[4096];
+
+/* Measures and formats the same arguments, the lengths must agree */
+#define CHECK(...)                                                             \
+    do {                                                                       \
+        ssize_t measured = sio_format_measure(__VA_ARGS__);                    \
+        ssize_t ret = sio_snprintf(buffer, sizeof(buffer), __VA_ARGS__);       \
+        printf("%zd %zd:%s\n", measured, ret, buffer);                         \
+        sio_assert(measured == ret);                                           \
+    } while (0)
+
+/* Floats are also compared with the C library */
+#define CHECK_FLOAT(precision, value)                                          \
+    do {                                                                       \
+        char expected[512];                                                    \
+        CHECK("%.*f", precision, value);                                       \
+        snprintf(expected, sizeof(expected), "%.*f", precision, value);        \
+        sio_assert(strcmp(buffer, expected) == 0);                             \
+    } while (0)
+
+int main(void) {
+    {
+        CHECK("plain text");
+        CHECK("%d %d %d %d", 0, 9, 10, -10);
+        CHECK("%lld %lld", (long long)INT64_MAX, (long long)INT64_MIN);
+        CHECK("%llu %llx %llo", (unsigned long long)UINT64_MAX,
+              (unsigned long long)UINT64_MAX, (unsigned long long)UINT64_MAX);
+        CHECK("%u %u %u %u", 99999u, 100000u, 999999999u, 1000000000u);
+        CHECK("%x %x %o %o", 0u, 0x10u, 7u, 8u);
+        CHECK("%zd %zu", (ssize_t)-1, (size_t)12345);
+        CHECK("%p %p", (void *)(uintptr_t)0x1234abcd, (void *)NULL);
+        CHECK("%s|%.*s|%s", "abc", 2, "abcdef", "");
+        CHECK("%c%%", 'x');
+        CHECK("[%*d] [%*d] [%*s]", 6, 42, -6, 42, 2, "longer");
+        CHECK("%pJ", "quote\" newline\n");
+        struct timespec ts = {1700000000, 123456789};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat" // Precision with %p, bad formats
+        CHECK("%.*pT", 3, (void *)&ts);
+        CHECK("invalid formats: %q%r%%%j%l\n%"); // Both fail
+#pragma GCC diagnostic pop
+    }
+    {
+        CHECK_FLOAT(6, 0.5);
+        CHECK_FLOAT(2, 0.999);
+        CHECK_FLOAT(1, 9.99);
+        CHECK_FLOAT(0, 9.5);
+        CHECK_FLOAT(0, 99.5);
+        CHECK_FLOAT(0, 10.5);
+        CHECK_FLOAT(2, 99.999);
+        CHECK_FLOAT(3, 0.0005);
+        CHECK_FLOAT(6, 123.456);
+        CHECK_FLOAT(2, -0.001);
+        CHECK_FLOAT(0, 1e20);
+        CHECK_FLOAT(3, 1e300);
+        CHECK_FLOAT(20, 0.1);
+        CHECK_FLOAT(6, 5e-324);
+        CHECK_FLOAT(6, -0.0);
+        CHECK("[%*f] [%*f]", 12, 9.9999999, -12, -1.5);
+    }
+    {
+        // Sizing a buffer once, then formatting into it
+        ssize_t len =
+            sio_format_measure("%s=%d (%.*f)", "answer", 42, 2, 41.999);
+        char exact[32];
+        sio_assert(len >= 0 && (size_t)len < sizeof(exact));
+        ssize_t ret = sio_snprintf(exact, (size_t)len + 1, "%s=%d (%.*f)",
+                                   "answer", 42, 2, 41.999);
+        printf("%zd:%s\n", ret, exact);
+        sio_assert(ret == len);
+        sio_assert(strcmp(exact, "answer=42 (42.00)") == 0);
+    }
+    return 0;
+}
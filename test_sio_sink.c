@@ -0,0 +1,86 @@
+#include "csapp.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A sink over a fixed array, counting how the formatter used it */
+typedef struct {
+    char data[256];
+    size_t len;
+    size_t reserves;
+    size_t outputs;
+} test_sink_t;
+
+static char *test_reserve(void *state, size_t len) {
+    test_sink_t *sink = state;
+    if (len > sizeof(sink->data) - sink->len) {
+        return NULL;
+    }
+    sink->reserves++;
+    return sink->data + sink->len;
+}
+
+static ssize_t test_commit(void *state, size_t len) {
+    test_sink_t *sink = state;
+    sink->len += len;
+    return (ssize_t)len;
+}
+
+static ssize_t test_output(void *state, char padding, size_t count_left,
+                           size_t count_right, const char *data, size_t len) {
+    test_sink_t *sink = state;
+    sink->outputs++;
+    size_t total = count_left + len + count_right;
+    if (total > sizeof(sink->data) - sink->len) {
+        return -1;
+    }
+    memset(sink->data + sink->len, padding, count_left);
+    if (len > 0) {
+        memcpy(sink->data + sink->len + count_left, data, len);
+    }
+    memset(sink->data + sink->len + count_left + len, padding, count_right);
+    sink->len += total;
+    return (ssize_t)total;
+}
+
+int main(void) {
+    {
+        test_sink_t state = {{0}, 0, 0, 0};
+        sio_sink_t sink = {test_reserve, test_commit, test_output, &state};
+        ssize_t ret = sio_format_sink(
+            &sink, "%d|%*d|%*d|%u|%x|%o|%p|%p|%lld", -42, 6, 7, -6, -8, 10u,
+            255u, 8u, (void *)0x1234, NULL, (long long)INT64_MIN);
+        state.data[state.len] = '\0';
+        printf("%zd:%s (%zu reserves, %zu outputs)\n", ret, state.data,
+               state.reserves, state.outputs);
+        sio_assert(strcmp(state.data, "-42|     7|-8    |10|ff|10|0x1234|"
+                                      "(nil)|-9223372036854775808") == 0);
+        sio_assert(ret == (ssize_t)state.len);
+        // Every integer and pointer but (nil) went through reserve
+        sio_assert(state.reserves == 8);
+    }
+    {
+        // Output functions alone still work through the adapter
+        test_sink_t state = {{0}, 0, 0, 0};
+        sio_sink_t sink = SIO_OUTPUT_SINK(test_output, &state);
+        ssize_t ret = sio_format_sink(&sink, "%s=%d", "answer", 42);
+        state.data[state.len] = '\0';
+        printf("%zd:%s\n", ret, state.data);
+        sio_assert(strcmp(state.data, "answer=42") == 0);
+        sio_assert(state.reserves == 0);
+    }
+    {
+        // The buffer sink falls back to the output function when out of room
+        char buffer[8];
+        ssize_t ret = sio_snprintf(buffer, sizeof(buffer), "%d %d", 1234, 5678);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(ret == 9);
+        sio_assert(strcmp(buffer, "1234 56") == 0);
+
+        ret = sio_snprintf_trunc(buffer, sizeof(buffer), "%d %d", 1234, 5678);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(ret == (ssize_t)sizeof(buffer));
+        sio_assert(strcmp(buffer, "1234 56") == 0);
+    }
+    return 0;
+}
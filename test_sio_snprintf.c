@@ -1,6 +1,7 @@
 #include "csapp.h"
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 int main(void) {
@@ -144,5 +145,35 @@ int main(void) {
         printf("---------------------------------------------\n");
     }
 
+    // Truncating variant, which stops as soon as the buffer is full
+    {
+        char buffer[1024];
+        char buffer8[8];
+        ssize_t ret;
+
+        ret = sio_snprintf_trunc(buffer, 1024, "%d %s %f", 1, "two", 3.0);
+        printf("%zd:%s\n", ret, buffer);
+        sio_assert(ret == 14);
+
+        ret = sio_snprintf_trunc(buffer8, 8, "%d %s %f", 1, "two", 3.0);
+        printf("%zd:%s\n", ret, buffer8);
+        sio_assert(ret == 8 && strcmp(buffer8, "1 two 3") == 0);
+
+        ret = sio_snprintf_trunc(buffer8, 8, "1234567");
+        printf("%zd:%s\n", ret, buffer8);
+        sio_assert(ret == 7 && strcmp(buffer8, "1234567") == 0);
+
+        ret = sio_snprintf_trunc(buffer8, 8, "%*d", 20, 5);
+        printf("%zd:%s\n", ret, buffer8);
+        sio_assert(ret == 8 && strcmp(buffer8, "       ") == 0);
+
+        ret = sio_snprintf_trunc(buffer8, 0, "%d", 5);
+        printf("%zd\n", ret);
+        sio_assert(ret == 0);
+        ret = sio_snprintf_trunc(buffer8, 0, "");
+        sio_assert(ret == 0);
+        printf("---------------------------------------------\n");
+    }
+
     return 0;
 }